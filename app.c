@@ -1,11 +1,20 @@
 #include "server.h"
+#include "executor.h"
 #include "playlist.h"
 #include "player.h"
+#include "archive.h"
+#include "cache.h"
+#include "json.h"
+#include "metrics.h"
+#include "trace.h"
 #include "config.h"
 #include "util.h"
+#include "logger.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -13,14 +22,71 @@
 #include <pwd.h>
 #include <signal.h>
 #include <wordexp.h>
+#include <time.h>
+
+#define LOG_MODULE lmApp
 
 #define FILE_MODE S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH
 #define DIR_MODE S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH
 
+// the kinds of events posted to the executor
+#define APP_EVENT_SONG_END 1
+#define APP_EVENT_RELOAD 2
+#define APP_EVENT_RESUME 3
+
+// how often (in seconds) the playlist and the position are saved while running
+#define APP_STATE_INTERVAL 30
+
+// everything rpd.conf can set
+typedef struct {
+    fm_playlist_config_t playlist;
+    fm_player_config_t player;
+    char addr[16];
+    char port[8];
+    char socket_path[108];
+    char log_level[128];
+    int log_size;
+} fm_app_config_t;
+
+// what `info` reports; the executor publishes it after everything it does so that it can be read without waiting on it
+typedef struct {
+    int status;
+    char kbps[8];
+    char channel[128];
+    char user[16];
+    char title[128];
+    char artist[128];
+    char album[128];
+    int year;
+    char cover[128];
+    char url[128];
+    int sid;
+    int like;
+    int pos;
+    int len;
+    // when pos was taken; it moves on by itself while playing
+    struct timespec sampled;
+} fm_app_info_t;
+
 typedef struct {
     fm_server_t server;
+    fm_executor_t executor;
     fm_playlist_t playlist;
     fm_player_t player;
+    // a seqlock around info: odd while the executor is writing it
+    unsigned info_seq;
+    fm_app_info_t info;
+    // where the executor encodes the changes it publishes
+    fm_json_t event_json;
+    char config_file[128];
+    // waits for SIGHUP to reload the config
+    pthread_t tid_signal;
+    // where the channel, the queue and the position are kept across restarts
+    char state_file[160];
+    time_t state_saved;
+    // what the player was doing when the state was saved
+    enum fm_player_status resume_status;
+    int resume_pos;
 } fm_app_t;
 
 fm_app_t app = {
@@ -30,51 +96,280 @@ fm_app_t app = {
     }
 };
 
-void get_fm_info(fm_app_t *app, char *output)
+void json_error(fm_json_t *w, const char *format, const char *arg)
 {
-    fm_song_t *current;
+    char message[SERVER_LINE_MAX + 128];
+    snprintf(message, sizeof(message), format, arg);
+    fm_json_object(w);
+    fm_json_kstr(w, "status", "error");
+    fm_json_kstr(w, "message", message);
+    fm_json_object_end(w);
+}
 
-    switch (app->player.status) {
+void format_info(const fm_app_info_t *info, fm_json_t *w)
+{
+    fm_json_object(w);
+    switch (info->status) {
         case FM_PLAYER_PLAY:
         case FM_PLAYER_PAUSE:
-            current = fm_playlist_current(&app->playlist);
-            char btitle[128], bart[128], balb[128], bcover[128], burl[128]; 
-            sprintf(output, "{\"status\":\"%s\",\"kbps\":\"%s\",\"channel\":\"%s\",\"user\":\"%s\","
-                    "\"title\":\"%s\",\"artist\":\"%s\", \"album\":\"%s\",\"year\":%d,"
-                    "\"cover\":\"%s\",\"url\":\"%s\",\"sid\":%d,"
-                    "\"like\":%d,\"pos\":%d,\"len\":%d}",
-                    app->player.status == FM_PLAYER_PLAY? "play": "pause",
-                    current->kbps,app->playlist.config.channel, app->playlist.config.uname,
-                    escapejson(btitle, current->title), 
-                    escapejson(bart, current->artist), 
-                    escapejson(balb, current->album),
-                    current->pubdate, 
-                    escapejson(bcover, current->cover), 
-                    escapejson(burl, current->url),
-                    current->sid, current->like, fm_player_pos(&app->player),
-                    fm_player_length(&app->player));
-            break;
-        case FM_PLAYER_STOP:
-            sprintf(output, "{\"status\":\"stop\",\"kbps\":\"%s\",\"channel\":\"%s\",\"user\":\"%s\"}",
-                    app->playlist.config.kbps,app->playlist.config.channel, app->playlist.config.uname);
+            fm_json_kstr(w, "status", info->status == FM_PLAYER_PLAY? "play": "pause");
+            fm_json_kstr(w, "kbps", info->kbps);
+            fm_json_kstr(w, "channel", info->channel);
+            fm_json_kstr(w, "user", info->user);
+            fm_json_kstr(w, "title", info->title);
+            fm_json_kstr(w, "artist", info->artist);
+            fm_json_kstr(w, "album", info->album);
+            fm_json_kint(w, "year", info->year);
+            fm_json_kstr(w, "cover", info->cover);
+            fm_json_kstr(w, "url", info->url);
+            fm_json_kint(w, "sid", info->sid);
+            fm_json_kint(w, "like", info->like);
+            fm_json_kint(w, "pos", info->pos);
+            fm_json_kint(w, "len", info->len);
             break;
         default:
+            fm_json_kstr(w, "status", "stop");
+            fm_json_kstr(w, "kbps", info->kbps);
+            fm_json_kstr(w, "channel", info->channel);
+            fm_json_kstr(w, "user", info->user);
             break;
     }
+    fm_json_object_end(w);
+}
+
+// what the clients waiting with idle or subscribe get to hear about
+unsigned info_changes(const fm_app_info_t *old, const fm_app_info_t *info)
+{
+    unsigned mask = 0;
+    int same_song = old->sid == info->sid && strcmp(old->title, info->title) == 0 && strcmp(old->url, info->url) == 0;
+    if (old->status != info->status || !same_song)
+        mask |= SERVER_EVENT_PLAYER;
+    if (same_song && old->like != info->like)
+        mask |= SERVER_EVENT_PLAYLIST;
+    if (strcmp(old->channel, info->channel) != 0 || strcmp(old->kbps, info->kbps) != 0 || strcmp(old->user, info->user) != 0)
+        mask |= SERVER_EVENT_OPTIONS;
+    return mask;
+}
+
+// only ever called on the executor thread, which owns the playlist and the player
+void publish_info(fm_app_t *app)
+{
+    fm_app_info_t info;
+    fm_song_t *current = app->playlist.current;
+    unsigned seq = app->info_seq;
+    unsigned changes;
+
+    memset(&info, 0, sizeof(info));
+    info.status = current ? app->player.status : FM_PLAYER_STOP;
+    strcpy(info.channel, app->playlist.config.channel);
+    strcpy(info.user, app->playlist.config.uname);
+    if (info.status == FM_PLAYER_STOP) {
+        strcpy(info.kbps, app->playlist.config.kbps);
+    } else {
+        strcpy(info.kbps, current->kbps);
+        strcpy(info.title, current->title);
+        strcpy(info.artist, current->artist);
+        strcpy(info.album, current->album);
+        info.year = current->pubdate;
+        strcpy(info.cover, current->cover);
+        strcpy(info.url, current->url);
+        info.sid = current->sid;
+        info.like = current->like;
+        info.pos = fm_player_pos(&app->player);
+        info.len = fm_player_length(&app->player);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &info.sampled);
+    // nobody else writes the published copy, so it can be read here as it is
+    changes = info_changes(&app->info, &info);
+
+    __atomic_store_n(&app->info_seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&app->info, &info, sizeof(info));
+    __atomic_store_n(&app->info_seq, seq + 2, __ATOMIC_RELEASE);
+
+    if (changes) {
+        fm_json_reset(&app->event_json);
+        format_info(&info, &app->event_json);
+        fm_server_notify(&app->server, changes, app->event_json.buf);
+    }
+}
+
+// can be called from any thread; never waits on the executor
+void read_info(fm_app_t *app, fm_app_info_t *info)
+{
+    unsigned seq;
+    struct timespec now;
+    do {
+        while ((seq = __atomic_load_n(&app->info_seq, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        memcpy(info, &app->info, sizeof(*info));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&app->info_seq, __ATOMIC_RELAXED) != seq);
+
+    if (info->status == FM_PLAYER_PLAY) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        info->pos += now.tv_sec - info->sampled.tv_sec;
+        if (info->pos > info->len)
+            info->pos = info->len;
+    }
+}
+
+void get_published_info(fm_app_t *app, fm_json_t *output)
+{
+    fm_app_info_t info;
+    read_info(app, &info);
+    format_info(&info, output);
+}
+
+void get_fm_info(fm_app_t *app, fm_json_t *output)
+{
+    publish_info(app);
+    get_published_info(app, output);
+}
+
+void get_eq_info(fm_app_t *app, fm_json_t *output)
+{
+    fm_eq_params_t params;
+    int i;
+    fm_equalizer_get(&app->player.eq, &params);
+    fm_json_object(output);
+    fm_json_kint(output, "enabled", params.enabled);
+    fm_json_kdouble(output, "preamp", params.preamp, 1);
+    fm_json_key(output, "bands");
+    fm_json_array(output);
+    for (i = 0; i < FM_EQ_MAX_BANDS; i++) {
+        fm_eq_band_t *b = &params.bands[i];
+        fm_json_object(output);
+        fm_json_kint(output, "band", i + 1);
+        if (b->type == eqNone) {
+            fm_json_kstr(output, "type", "none");
+        } else {
+            fm_json_kstr(output, "type", fm_eq_band_type_str(b->type));
+            fm_json_kdouble(output, "freq", b->freq, 1);
+            fm_json_kdouble(output, "gain", b->gain, 1);
+            fm_json_kdouble(output, "q", b->q, 2);
+        }
+        fm_json_object_end(output);
+    }
+    fm_json_array_end(output);
+    fm_json_object_end(output);
+}
+
+void get_archive_info(fm_app_t *app, fm_json_t *output)
+{
+    fm_archive_status_t status;
+    int i;
+    fm_archive_get_status(app->playlist.archive, &status);
+    fm_json_object(output);
+    fm_json_kint(output, "queued", status.queued);
+    fm_json_kint(output, "active", status.active);
+    fm_json_kint(output, "done", status.done);
+    fm_json_kint(output, "failed", status.failed);
+    fm_json_kint(output, "dropped", status.dropped);
+    fm_json_key(output, "jobs");
+    fm_json_array(output);
+    for (i = 0; i < status.nrecent; i++) {
+        fm_json_object(output);
+        fm_json_kstr(output, "title", status.recent[i].title);
+        fm_json_kstr(output, "state", fm_archive_state_str(status.recent[i].state));
+        fm_json_object_end(output);
+    }
+    fm_json_array_end(output);
+    fm_json_object_end(output);
+}
+
+// trace [chrome]: the timelines of the songs played last, followed by the current one
+void get_trace_info(fm_app_t *app, char *arg, fm_json_t *output)
+{
+    fm_trace_record_t live;
+    fm_song_t *song = app->playlist.current;
+    if (arg && strcmp(arg, "chrome") != 0) {
+        json_error(output, "Wrong argument: %s", arg);
+        return;
+    }
+    if (song) {
+        pthread_mutex_lock(&app->playlist.mutex_song_downloader);
+        live.trace = song->trace;
+        pthread_mutex_unlock(&app->playlist.mutex_song_downloader);
+        live.sid = song->sid;
+        strcpy(live.artist, song->artist);
+        strcpy(live.title, song->title);
+    }
+    fm_trace_write(output, song ? &live : NULL, arg != NULL);
+}
+
+// eq [on|off|clear|preamp <db>|<band> <spec>]
+void app_eq_handler(fm_app_t *app, char *arg, fm_json_t *output)
+{
+    fm_eq_params_t params;
+    fm_equalizer_get(&app->player.eq, &params);
+    if (arg) {
+        char *sub = arg;
+        char *rest = split(arg, ' ');
+        int band = atoi(sub);
+        if (strcmp(sub, "on") == 0) {
+            params.enabled = 1;
+        } else if (strcmp(sub, "off") == 0) {
+            params.enabled = 0;
+        } else if (strcmp(sub, "clear") == 0) {
+            memset(params.bands, 0, sizeof(params.bands));
+            params.preamp = 0;
+        } else if (strcmp(sub, "preamp") == 0 && rest) {
+            params.preamp = atof(rest);
+        } else if (band >= 1 && band <= FM_EQ_MAX_BANDS && rest) {
+            if (fm_eq_parse_band(&params.bands[band - 1], rest) != 0) {
+                json_error(output, "Wrong band specification: %s", rest);
+                return;
+            }
+        } else {
+            json_error(output, "Wrong argument: %s", sub);
+            return;
+        }
+        fm_equalizer_set(&app->player.eq, &params);
+    }
+    get_eq_info(app, output);
 }
 
-void app_client_handler(void *ptr, char *input, char *output)
+int read_config(const char *file, fm_app_config_t *conf);
+
+// runs on the executor thread: apply whatever can change without a restart; the song playing carries on
+int app_reload(fm_app_t *app)
+{
+    fm_app_config_t conf;
+    if (read_config(app->config_file, &conf) != 0)
+        return -1;
+    fm_log_info("Reloading %s", app->config_file);
+    fm_playlist_reload(&app->playlist, &conf.playlist);
+    if (strcmp(conf.player.driver, app->player.config.driver) != 0 || strcmp(conf.player.dev, app->player.config.dev) != 0) {
+        if (fm_player_set_output(&app->player, &conf.player) != 0)
+            fm_log_warn("Unknown audio driver %s; keeping %s", conf.player.driver, app->player.config.driver);
+    }
+    fm_equalizer_set(&app->player.eq, &conf.player.eq);
+    if (fm_log_set_levels(conf.log_level) != 0)
+        fm_log_warn("Wrong log level: %s", conf.log_level);
+    if (strcmp(conf.addr, app->server.addr) != 0 || strcmp(conf.port, app->server.port) != 0 || strcmp(conf.socket_path, app->server.socket_path) != 0)
+        fm_log_warn("The [Server] settings only take effect after a restart");
+    return 0;
+}
+
+// runs on the executor thread
+void app_command_handler(void *ptr, fm_request_t *req)
 {
     fm_app_t *app = (fm_app_t*) ptr;
+    char input[sizeof(req->input)];
+    fm_json_t *output = &req->output;
     char *cmd = input;
-    char *arg = split(input, ' ');
+    char *arg;
+
+    strcpy(input, req->input);
+    arg = split(input, ' ');
 
     if (strcmp(cmd, "play") == 0) {
         if (app->player.status != FM_PLAYER_STOP || fm_player_set_song(&app->player, fm_playlist_current(&app->playlist)) == 0) {
             fm_player_play(&app->player);
             get_fm_info(app, output);
         } else 
-            sprintf(output, "{\"status\":\"error\",\"message\":\"Some errors occurred during the processing of the song\"}");
+            json_error(output, "Some errors occurred during the processing of the song", NULL);
     }
     else if(strcmp(cmd, "stop") == 0) {
         fm_player_stop(&app->player);
@@ -98,7 +393,7 @@ void app_client_handler(void *ptr, char *input, char *output)
                 if (fm_player_set_song(&app->player, fm_playlist_current(&app->playlist)) == 0) {
                     fm_player_play(&app->player);
                 } else {
-                    sprintf(output, "{\"status\":\"error\",\"message\":\"Some errors occurred during the processing of the song\"}");
+                    json_error(output, "Some errors occurred during the processing of the song", NULL);
                 }  
                 break;
         }
@@ -108,14 +403,14 @@ void app_client_handler(void *ptr, char *input, char *output)
             fm_player_play(&app->player);
             get_fm_info(app, output);
         } else
-            sprintf(output, "{\"status\":\"error\",\"message\":\"Some errors occurred during the processing of the song\"}");
+            json_error(output, "Some errors occurred during the processing of the song", NULL);
     }
     else if(strcmp(cmd, "ban") == 0) {
         if (fm_player_set_song(&app->player, fm_playlist_ban(&app->playlist)) == 0) {
             fm_player_play(&app->player);
             get_fm_info(app, output);
         } else
-            sprintf(output, "{\"status\":\"error\",\"message\":\"Some errors occurred during the processing of the song\"}");
+            json_error(output, "Some errors occurred during the processing of the song", NULL);
     }
     else if(strcmp(cmd, "rate") == 0) {
         fm_playlist_rate(&app->playlist);
@@ -128,12 +423,33 @@ void app_client_handler(void *ptr, char *input, char *output)
     else if(strcmp(cmd, "info") == 0) {
         get_fm_info(app, output);
     }
+    else if(strcmp(cmd, "eq") == 0) {
+        app_eq_handler(app, arg, output);
+    }
+    else if(strcmp(cmd, "archive") == 0) {
+        get_archive_info(app, output);
+    }
+    else if(strcmp(cmd, "reload") == 0) {
+        if (app_reload(app) == 0)
+            get_fm_info(app, output);
+        else
+            json_error(output, "Unable to read %s", app->config_file);
+    }
+    else if(strcmp(cmd, "loglevel") == 0) {
+        if (arg && fm_log_set_levels(arg) != 0)
+            json_error(output, "Wrong argument: %s", arg);
+        else
+            fm_log_get_levels(output);
+    }
+    else if(strcmp(cmd, "trace") == 0) {
+        get_trace_info(app, arg, output);
+    }
     else if(strcmp(cmd, "end") == 0) {
         app->server.should_quit = 1;
     }
     else if(strcmp(cmd, "setch") == 0) {
         if (arg == NULL) {
-            sprintf(output, "{\"status\":\"error\",\"message\":\"Missing argument: %s\"}", input);
+            json_error(output, "Missing argument: %s", input);
         }
         else {
             if (strcmp(arg, app->playlist.config.channel) != 0) {
@@ -144,12 +460,12 @@ void app_client_handler(void *ptr, char *input, char *output)
                         case -2: message = "Unable to set local channel because music directory is not set."; break;
                         default: message = "Unable to set channel.";
                     }
-                    sprintf(output, "{\"status\":\"error\",\"message\":\"%s\"}", message);
+                    json_error(output, "%s", message);
                 } else if (fm_player_set_song(&app->player, fm_playlist_skip(&app->playlist, 1)) == 0) {
                     fm_player_play(&app->player);
                     get_fm_info(app, output);
                 } else {
-                    sprintf(output, "{\"status\":\"error\",\"message\":\"Some errors occurred during the processing of the song\"}");
+                    json_error(output, "Some errors occurred during the processing of the song", NULL);
                 }
             }
         }
@@ -157,28 +473,49 @@ void app_client_handler(void *ptr, char *input, char *output)
     else if(strcmp(cmd, "kbps") == 0) {
         if (app->playlist.mode == plDouban) {
             if (arg == NULL) {
-                sprintf(output, "{\"status\":\"error\",\"message\":\"Missing argument: %s\"}", input);
+                json_error(output, "Missing argument: %s", input);
             }
             else if (strcmp(arg, "64") != 0 && strcmp(arg, "128") != 0 && strcmp(arg, "192") != 0) {
-                sprintf(output, "{\"status\":\"error\",\"message\":\"Wrong argument: %s\"}", arg);
+                json_error(output, "Wrong argument: %s", arg);
             }
             else {
                 if (strcmp(arg, app->playlist.config.kbps) != 0) {
-                    strcpy(app->playlist.config.kbps, arg);
+                    fm_playlist_set_kbps(&app->playlist, arg);
                     if (fm_player_set_song(&app->player, fm_playlist_skip(&app->playlist, 0)) == 0) {
                         fm_player_play(&app->player);
                         get_fm_info(app, output);
                     } else 
-                        sprintf(output, "{\"status\":\"error\",\"message\":\"Some errors occurred during the processing of the song\"}");
+                        json_error(output, "Some errors occurred during the processing of the song", NULL);
                 } else
                     get_fm_info(app, output);
             }
         } else {
-            sprintf(output, "{\"status\":\"error\",\"message\":\"Current channel does not support bitrate switch: %s\"}", input);
+            json_error(output, "Current channel does not support bitrate switch: %s", input);
         }
     } else {
-        sprintf(output, "{\"status\":\"error\",\"message\":\"Wrong command: %s\"}", input);
+        json_error(output, "Wrong command: %s", input);
     }
+    publish_info(app);
+}
+
+// runs on the server thread: the read-only commands are answered right away, the rest wait their turn on the executor
+int app_client_handler(void *ptr, fm_request_t *req)
+{
+    fm_app_t *app = (fm_app_t*) ptr;
+    if (strcmp(req->input, "info") == 0) {
+        get_published_info(app, &req->output);
+        return 0;
+    }
+    if (strcmp(req->input, "archive") == 0) {
+        get_archive_info(app, &req->output);
+        return 0;
+    }
+    if (strcmp(req->input, "metrics") == 0) {
+        fm_metrics_write(&req->output);
+        return 0;
+    }
+    fm_executor_submit(&app->executor, req);
+    return 1;
 }
 
 void daemonize(const char *log_file, const char *err_file)
@@ -187,14 +524,14 @@ void daemonize(const char *log_file, const char *err_file)
     int fd0, fd1, fd2;
 
     if ((pid = fork()) < 0) {
-        perror("fork");
+        fm_log_error("Unable to fork: %s", strerror(errno));
     }
     else if(pid > 0) {
         exit(0);
     }
 
     if ((pid = fork()) < 0) {
-        perror("fork");
+        fm_log_error("Unable to fork: %s", strerror(errno));
     }
     else if(pid > 0) {
         exit(0);
@@ -207,7 +544,8 @@ void daemonize(const char *log_file, const char *err_file)
     close(STDERR_FILENO);
 
     fd0 = open("/dev/null", O_RDONLY);
-    fd1 = open(log_file, O_WRONLY | O_TRUNC | O_CREAT, FILE_MODE);
+    // the log carries on from the last run; the logger rotates it once it grows too large
+    fd1 = open(log_file, O_WRONLY | O_APPEND | O_CREAT, FILE_MODE);
     fd2 = open(err_file, O_WRONLY | O_TRUNC | O_CREAT, FILE_MODE);
 
     if (fd0 != STDIN_FILENO || fd1 != STDOUT_FILENO || fd2 != STDERR_FILENO) {
@@ -219,23 +557,108 @@ void daemonize(const char *log_file, const char *err_file)
     setvbuf(stderr, NULL, _IOLBF, 0);
 }
 
-void player_end_handler(int sig)
+// runs on the executor thread, or after it has stopped
+void app_save_state(fm_app_t *app)
+{
+    char tmp[168];
+    FILE *f;
+    sprintf(tmp, "%s.tmp", app->state_file);
+    app->state_saved = time(NULL);
+    if (!(f = fopen(tmp, "w"))) {
+        fm_log_warn("Unable to save the state to %s", tmp);
+        return;
+    }
+    fprintf(f, "p %d %d\n", app->player.status, app->player.status == FM_PLAYER_STOP ? 0 : fm_player_pos(&app->player));
+    fm_playlist_save_state(&app->playlist, f);
+    if (fclose(f) != 0 || rename(tmp, app->state_file) != 0)
+        unlink(tmp);
+}
+
+int app_restore_state(fm_app_t *app)
+{
+    FILE *f;
+    int status, pos, ret = -1;
+    if (!(f = fopen(app->state_file, "r")))
+        return -1;
+    if (fscanf(f, "p %d %d\n", &status, &pos) == 2 && fm_playlist_restore_state(&app->playlist, f) == 0) {
+        app->resume_status = status;
+        app->resume_pos = pos;
+        ret = 0;
+    }
+    fclose(f);
+    return ret;
+}
+
+// runs on the executor thread
+void app_event_handler(void *ptr, const fm_executor_event_t *event)
 {
-    if (fm_player_set_song(&app.player, fm_playlist_next(&app.playlist)) == 0) {
-        fm_player_play(&app.player);
-    } else
-        printf("Some errors occurred during the processing of the song\n");
+    fm_app_t *app = (fm_app_t*) ptr;
+    struct timespec now;
+    switch (event->kind) {
+        case APP_EVENT_SONG_END:
+            // a command might have moved on to another song while the event was queued
+            if (event->arg != app->player.serial) {
+                fm_log_info("Ignoring the end of an earlier song");
+                break;
+            }
+            if (fm_player_set_song(&app->player, fm_playlist_next(&app->playlist)) == 0) {
+                fm_player_play(&app->player);
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                fm_metrics_observe(mhSongTransition, (now.tv_sec - event->posted.tv_sec) + (now.tv_nsec - event->posted.tv_nsec) / 1e9);
+            } else
+                fm_log_error("Some errors occurred during the processing of the song");
+            publish_info(app);
+            break;
+        case APP_EVENT_RELOAD:
+            if (app_reload(app) != 0)
+                fm_log_error("Unable to read %s", app->config_file);
+            publish_info(app);
+            break;
+        case APP_EVENT_RESUME:
+            // a client might have got in first
+            if (app->player.status != FM_PLAYER_STOP || !app->playlist.current)
+                break;
+            fm_player_set_song(&app->player, app->playlist.current);
+            // only a song that is all there can be sought into
+            if (app->playlist.current->audio[0] == '\0')
+                fm_player_set_start(&app->player, app->resume_pos);
+            fm_log_info("Resuming %s / %s at %d seconds", app->playlist.current->artist, app->playlist.current->title, app->resume_pos);
+            fm_player_play(&app->player);
+            if (app->resume_status == FM_PLAYER_PAUSE)
+                fm_player_pause(&app->player);
+            publish_info(app);
+            break;
+    }
+}
+
+// keeps the published position from drifting away from the player's, and the saved state from getting old
+void player_tick(void *ptr)
+{
+    fm_app_t *app = (fm_app_t*) ptr;
+    if (app->player.status == FM_PLAYER_PLAY)
+        publish_info(app);
+    if (time(NULL) - app->state_saved >= APP_STATE_INTERVAL)
+        app_save_state(app);
+}
+
+// runs on the play thread
+void player_end_notify(void *ptr, unsigned long serial)
+{
+    fm_app_t *app = (fm_app_t*) ptr;
+    fm_executor_post(&app->executor, APP_EVENT_SONG_END, serial);
 }
 
-void install_player_end_handler(fm_player_t *player)
+// SIGHUP is blocked everywhere else, so it ends up here rather than interrupting some other thread
+void *signal_thread(void *ptr)
 {
-    int player_end_sig = SIGUSR1;
-    struct sigaction player_end_act;
-    player_end_act.sa_handler = player_end_handler;
-    sigemptyset(&player_end_act.sa_mask);
-    player_end_act.sa_flags = 0;
-    sigaction(player_end_sig, &player_end_act, NULL);
-    fm_player_set_ack(player, pthread_self(), player_end_sig);
+    fm_app_t *app = (fm_app_t*) ptr;
+    sigset_t set;
+    int sig;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    while (sigwait(&set, &sig) == 0)
+        fm_executor_post(&app->executor, APP_EVENT_RELOAD, 0);
+    return ptr;
 }
 
 void stop_player()
@@ -247,26 +670,45 @@ int start_fmd(fm_playlist_config_t *playlist_conf, fm_player_config_t *player_co
 {
     fm_player_init();
     if (fm_player_open(&app.player, player_conf) < 0) {
-        perror("Open audio output");
+        fm_log_error("Unable to open the audio output %s", player_conf->driver);
         return 1;
     }
-    install_player_end_handler(&app.player);
-
     fm_playlist_init(&app.playlist, playlist_conf, stop_player);
 
-    int ret = fm_playlist_update_mode(&app.playlist, playlist_conf->channel);
-    switch (ret) {
-        case 0: break;
-        case -2: printf("Unable to set local channel because music directory is not set."); return ret;
-        default: printf("Unable to set channel."); return ret;
+    // pick up where the last run left off; the configured channel is only used the first time
+    sprintf(app.state_file, "%s/state", playlist_conf->rpd_dir);
+    app.state_saved = time(NULL);
+    app.resume_status = FM_PLAYER_STOP;
+    if (app_restore_state(&app) != 0) {
+        int ret = fm_playlist_update_mode(&app.playlist, playlist_conf->channel);
+        switch (ret) {
+            case 0: break;
+            case -2: fm_log_error("Unable to set local channel because music directory is not set."); return ret;
+            default: fm_log_error("Unable to set channel."); return ret;
+        }
     }
 
     if (fm_server_setup(&app.server) < 0) {
-        perror("Server");
+        fm_log_error("Unable to set up the server");
         return 1;
     }
+    publish_info(&app);
+    fm_player_set_ack(&app.player, player_end_notify, &app);
+    if (fm_executor_init(&app.executor, &app.server, app_command_handler, app_event_handler, player_tick, &app) < 0) {
+        fm_log_error("Unable to start the executor");
+        return 1;
+    }
+    pthread_create(&app.tid_signal, NULL, signal_thread, &app);
+    if (app.resume_status != FM_PLAYER_STOP)
+        fm_executor_post(&app.executor, APP_EVENT_RESUME, 0);
     fm_server_run(&app.server, app_client_handler, &app);
 
+    pthread_cancel(app.tid_signal);
+    pthread_join(app.tid_signal, NULL);
+    fm_executor_cleanup(&app.executor);
+    fm_server_cleanup(&app.server);
+    // before the songs are let go of, which moves their downloads into the cache
+    app_save_state(&app);
     fm_playlist_cleanup(&app.playlist);
     fm_player_close(&app.player);
     fm_player_exit();
@@ -274,31 +716,13 @@ int start_fmd(fm_playlist_config_t *playlist_conf, fm_player_config_t *player_co
     return 0;
 }
 
-int main() {
-    struct passwd *pwd = getpwuid(getuid());
-    const int MAX_DIR_LEN = 128;
-    char fmd_dir[MAX_DIR_LEN];
-    char config_file[MAX_DIR_LEN];
-    char log_file[MAX_DIR_LEN];
-    char err_file[MAX_DIR_LEN];
-
-    strcpy(fmd_dir, pwd->pw_dir);
-    strcat(fmd_dir, "/.rpd");
-    mkdir(fmd_dir, DIR_MODE);
-
-    strcpy(config_file, pwd->pw_dir);
-    strcat(config_file, "/.rpd/rpd.conf");
-
-    strcpy(log_file, pwd->pw_dir);
-    strcat(log_file, "/.rpd/rpd.log");
-
-    strcpy(err_file, pwd->pw_dir);
-    strcat(err_file, "/.rpd/rpd.err");
-
-    daemonize(log_file, err_file);
-
-    fm_playlist_config_t playlist_conf = {
+// read rpd.conf on top of the defaults
+int read_config(const char *file, fm_app_config_t *conf)
+{
+    int i;
+    conf->playlist = (fm_playlist_config_t) {
         .channel = "0",
+        .rpd_dir = "",
         .douban_uid = 0,
         .uname = "",
         .douban_token = "",
@@ -306,118 +730,271 @@ int main() {
         .kbps = "",
         .music_dir = "",
         .download_lyrics = 0,
+        .cache_size = CACHE_DEFAULT_SIZE,
         .jing_uid = 0,
         .jing_atoken = "",
         .jing_rtoken = ""
     };
-    fm_player_config_t player_conf = {
+    conf->player = (fm_player_config_t) {
         .channels = 2,
         .driver = "alsa",
         .dev = "default",
     };
+    strcpy(conf->log_level, "info");
+    conf->log_size = LOGGER_DEFAULT_SIZE;
+    strcpy(conf->addr, "localhost");
+    strcpy(conf->port, "10098");
+    conf->socket_path[0] = '\0';
+    int eq_enabled = 0;
+    char eq_preamp[16] = "0";
+    char eq_bands[FM_EQ_MAX_BANDS][64] = {{0}};
     fm_config_t configs[] = {
         {
             .type = FM_CONFIG_STR,
             .section = "Radio",
             .key = "channel",
-            .val.s = playlist_conf.channel
+            .val.s = conf->playlist.channel
         },
         {
             .type = FM_CONFIG_INT,
             .section = "DoubanFM",
             .key = "uid",
-            .val.i = &playlist_conf.douban_uid
+            .val.i = &conf->playlist.douban_uid
         },
         {
             .type = FM_CONFIG_STR,
             .section = "DoubanFM",
             .key = "uname",
-            .val.s = playlist_conf.uname
+            .val.s = conf->playlist.uname
         },
         {
             .type = FM_CONFIG_STR,
             .section = "DoubanFM",
             .key = "token",
-            .val.s = playlist_conf.douban_token
+            .val.s = conf->playlist.douban_token
         },
         {
             .type = FM_CONFIG_INT,
             .section = "DoubanFM",
             .key = "expire",
-            .val.i = &playlist_conf.expire
+            .val.i = &conf->playlist.expire
         },
         {
             .type = FM_CONFIG_STR,
             .section = "DoubanFM",
             .key = "kbps",
-            .val.s = playlist_conf.kbps
+            .val.s = conf->playlist.kbps
         },
         {
             .type = FM_CONFIG_STR,
             .section = "Local",
             .key = "music_dir",
-            .val.s = playlist_conf.music_dir
+            .val.s = conf->playlist.music_dir
         },
         {
             .type = FM_CONFIG_INT,
             .section = "Local",
             .key = "download_lyrics",
-            .val.i = &playlist_conf.download_lyrics
+            .val.i = &conf->playlist.download_lyrics
+        },
+        {
+            .type = FM_CONFIG_INT,
+            .section = "Local",
+            .key = "cache_size",
+            .val.i = &conf->playlist.cache_size
         },
         {
             .type = FM_CONFIG_STR,
             .section = "Output",
             .key = "driver",
-            .val.s = player_conf.driver
+            .val.s = conf->player.driver
         },
         {
             .type = FM_CONFIG_STR,
             .section = "Output",
             .key = "device",
-            .val.s = player_conf.dev
+            .val.s = conf->player.dev
         },
         {
             .type = FM_CONFIG_STR,
             .section = "Server",
             .key = "address",
-            .val.s = app.server.addr
+            .val.s = conf->addr
         },
         {
             .type = FM_CONFIG_STR,
             .section = "Server",
             .key = "port",
-            .val.s = app.server.port
+            .val.s = conf->port
+        },
+        {
+            .type = FM_CONFIG_STR,
+            .section = "Server",
+            .key = "socket",
+            .val.s = conf->socket_path
         },
         // for jing
         {
             .type = FM_CONFIG_STR,
             .section = "JingFM",
             .key = "atoken",
-            .val.s = playlist_conf.jing_atoken
+            .val.s = conf->playlist.jing_atoken
         },
         {
             .type = FM_CONFIG_STR,
             .section = "JingFM",
             .key = "rtoken",
-            .val.s = playlist_conf.jing_rtoken
+            .val.s = conf->playlist.jing_rtoken
         },
         {
             .type = FM_CONFIG_INT,
             .section = "JingFM",
             .key = "uid",
-            .val.i = &playlist_conf.jing_uid
+            .val.i = &conf->playlist.jing_uid
+        },
+        {
+            .type = FM_CONFIG_STR,
+            .section = "Log",
+            .key = "level",
+            .val.s = conf->log_level
+        },
+        {
+            .type = FM_CONFIG_INT,
+            .section = "Log",
+            .key = "size",
+            .val.i = &conf->log_size
+        },
+        // for the equalizer
+        {
+            .type = FM_CONFIG_INT,
+            .section = "Equalizer",
+            .key = "enabled",
+            .val.i = &eq_enabled
+        },
+        {
+            .type = FM_CONFIG_STR,
+            .section = "Equalizer",
+            .key = "preamp",
+            .val.s = eq_preamp
+        },
+        {
+            .type = FM_CONFIG_STR,
+            .section = "Equalizer",
+            .key = "band1",
+            .val.s = eq_bands[0]
+        },
+        {
+            .type = FM_CONFIG_STR,
+            .section = "Equalizer",
+            .key = "band2",
+            .val.s = eq_bands[1]
+        },
+        {
+            .type = FM_CONFIG_STR,
+            .section = "Equalizer",
+            .key = "band3",
+            .val.s = eq_bands[2]
+        },
+        {
+            .type = FM_CONFIG_STR,
+            .section = "Equalizer",
+            .key = "band4",
+            .val.s = eq_bands[3]
+        },
+        {
+            .type = FM_CONFIG_STR,
+            .section = "Equalizer",
+            .key = "band5",
+            .val.s = eq_bands[4]
+        },
+        {
+            .type = FM_CONFIG_STR,
+            .section = "Equalizer",
+            .key = "band6",
+            .val.s = eq_bands[5]
+        },
+        {
+            .type = FM_CONFIG_STR,
+            .section = "Equalizer",
+            .key = "band7",
+            .val.s = eq_bands[6]
+        },
+        {
+            .type = FM_CONFIG_STR,
+            .section = "Equalizer",
+            .key = "band8",
+            .val.s = eq_bands[7]
         }
     };
-    fm_config_parse(config_file, configs, sizeof(configs) / sizeof(fm_config_t));
+    if (fm_config_parse(file, configs, sizeof(configs) / sizeof(fm_config_t)) != 0)
+        return -1;
+
+    conf->player.eq.enabled = eq_enabled;
+    conf->player.eq.preamp = atof(eq_preamp);
+    for (i = 0; i < FM_EQ_MAX_BANDS; i++) {
+        if (eq_bands[i][0] != '\0')
+            fm_eq_parse_band(&conf->player.eq.bands[i], eq_bands[i]);
+    }
 
-    if (playlist_conf.music_dir[0] != '\0') {
+    if (conf->playlist.music_dir[0] != '\0') {
         // need to process the directory and pass the arguments into the configs
         wordexp_t exp_result;
-        wordexp(playlist_conf.music_dir, &exp_result, 0);
-        strcpy(playlist_conf.music_dir, exp_result.we_wordv[0]);
-        printf("The music dir path: %s\n", playlist_conf.music_dir);
-
+        wordexp(conf->playlist.music_dir, &exp_result, 0);
+        strcpy(conf->playlist.music_dir, exp_result.we_wordv[0]);
+        wordfree(&exp_result);
+    }
+    if (conf->socket_path[0] != '\0') {
+        wordexp_t exp_result;
+        wordexp(conf->socket_path, &exp_result, 0);
+        snprintf(conf->socket_path, sizeof(conf->socket_path), "%s", exp_result.we_wordv[0]);
         wordfree(&exp_result);
     }
-    return start_fmd(&playlist_conf, &player_conf);
+    return 0;
+}
+
+int main() {
+    struct passwd *pwd = getpwuid(getuid());
+    const int MAX_DIR_LEN = 128;
+    char fmd_dir[MAX_DIR_LEN];
+    char config_file[MAX_DIR_LEN];
+    char log_file[MAX_DIR_LEN];
+    char err_file[MAX_DIR_LEN];
+    fm_app_config_t conf;
+
+    strcpy(fmd_dir, pwd->pw_dir);
+    strcat(fmd_dir, "/.rpd");
+    mkdir(fmd_dir, DIR_MODE);
+
+    strcpy(config_file, pwd->pw_dir);
+    strcat(config_file, "/.rpd/rpd.conf");
+
+    strcpy(log_file, pwd->pw_dir);
+    strcat(log_file, "/.rpd/rpd.log");
+
+    strcpy(err_file, pwd->pw_dir);
+    strcat(err_file, "/.rpd/rpd.err");
+
+    daemonize(log_file, err_file);
+    // every thread started from here on inherits the mask; see signal_thread
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    if (read_config(config_file, &conf) != 0)
+        fm_log_warn("Unable to read %s; using the defaults", config_file);
+    if (fm_log_set_levels(conf.log_level) != 0)
+        fm_log_warn("Wrong log level: %s", conf.log_level);
+    fm_log_init(log_file, conf.log_size);
+    strcpy(conf.playlist.rpd_dir, fmd_dir);
+    if (conf.playlist.music_dir[0] != '\0')
+        fm_log_info("The music dir path: %s", conf.playlist.music_dir);
+    strcpy(app.server.addr, conf.addr);
+    strcpy(app.server.port, conf.port);
+    strcpy(app.server.socket_path, conf.socket_path);
+    strcpy(app.config_file, config_file);
+
+    int ret = start_fmd(&conf.playlist, &conf.player);
+    fm_log_cleanup();
+    return ret;
 }
@@ -0,0 +1,366 @@
+#define _GNU_SOURCE
+#include "archive.h"
+#include "util.h"
+#include "logger.h"
+
+#include <libavformat/avformat.h>
+#include <libavutil/dict.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define LOG_MODULE lmArchive
+
+#define DIR_MODE S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH
+// anything larger is not a cover image
+#define COVER_MAX_SIZE (8 << 20)
+
+extern char **environ;
+
+static const char *state_names[] = {
+    [arQueued] = "queued",
+    [arCover] = "cover",
+    [arTagging] = "tagging",
+    [arLyrics] = "lyrics",
+    [arDone] = "done",
+    [arFailed] = "failed",
+};
+
+const char *fm_archive_state_str(enum fm_archive_state state)
+{
+    return state_names[state];
+}
+
+static void archive_set_state(fm_archive_job_t *job, enum fm_archive_state state)
+{
+    fm_archive_t *ar = job->archive;
+    fm_archive_recent_t *r = &ar->recent[job->seq % ARCHIVE_RECENT];
+    pthread_mutex_lock(&ar->mutex);
+    // the slot may have been taken over by a newer job already
+    if (r->seq == job->seq)
+        r->state = state;
+    if (state == arDone)
+        ar->done++;
+    else if (state == arFailed)
+        ar->failed++;
+    pthread_mutex_unlock(&ar->mutex);
+}
+
+// mkdir -p for the directory containing path
+static int make_parent_dirs(const char *path)
+{
+    char dir[256], *p;
+    strcpy(dir, path);
+    if ((p = strrchr(dir, '/')) == NULL)
+        return 0;
+    *p = '\0';
+    for (p = dir + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            if (mkdir(dir, DIR_MODE) != 0 && errno != EEXIST)
+                return -1;
+            *p = '/';
+        }
+    }
+    if (mkdir(dir, DIR_MODE) != 0 && errno != EEXIST) {
+        fm_log_error("Unable to create %s: %s", dir, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// tell the image type from its magic bytes; this is all the checking the cover needs before being embedded
+static enum AVCodecID image_codec(const uint8_t *data, size_t size)
+{
+    if (size >= 3 && data[0] == 0xff && data[1] == 0xd8 && data[2] == 0xff)
+        return AV_CODEC_ID_MJPEG;
+    if (size >= 8 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0)
+        return AV_CODEC_ID_PNG;
+    if (size >= 6 && (memcmp(data, "GIF87a", 6) == 0 || memcmp(data, "GIF89a", 6) == 0))
+        return AV_CODEC_ID_GIF;
+    return AV_CODEC_ID_NONE;
+}
+
+// download the cover and read it into memory; return -1 if there is no usable image
+static int fetch_cover(fm_archive_t *ar, const char *url, uint8_t **data, size_t *size, enum AVCodecID *codec)
+{
+    char path[64];
+    struct stat st;
+    FILE *f;
+
+    if (strncmp(url, "http", 4) != 0)
+        return -1;
+    downloader_t *dl = stack_get_idle_downloader(ar->stack, dFile);
+    strcpy(path, dl->content.fbuf->filepath);
+    curl_easy_setopt(dl->curl, CURLOPT_URL, url);
+    curl_easy_setopt(dl->curl, CURLOPT_CONNECTTIMEOUT, 15);
+    curl_easy_setopt(dl->curl, CURLOPT_TIMEOUT, 60);
+    curl_easy_setopt(dl->curl, CURLOPT_FAILONERROR, 1);
+    stack_perform_until_done(ar->stack, dl);
+    stack_downloader_cleanup(ar->stack, dl);
+
+    *data = NULL;
+    if (stat(path, &st) == 0 && st.st_size > 0 && st.st_size <= COVER_MAX_SIZE && (f = fopen(path, "r"))) {
+        *size = st.st_size;
+        *data = (uint8_t *) malloc(*size);
+        if (fread(*data, 1, *size, f) != *size || (*codec = image_codec(*data, *size)) == AV_CODEC_ID_NONE) {
+            free(*data);
+            *data = NULL;
+        }
+        fclose(f);
+    }
+    unlink(path);
+    if (!*data) {
+        fm_log_warn("No usable cover at %s", url);
+        return -1;
+    }
+    return 0;
+}
+
+// remux the audio into a new file carrying the tags (and, for mp3, the cover)
+static int tag_file(fm_archive_job_t *job, const char *dest, uint8_t *cover, size_t cover_size, enum AVCodecID cover_codec)
+{
+    AVFormatContext *ic = NULL, *oc = NULL;
+    AVPacket pkt;
+    char buf[16];
+    int *map = NULL;
+    int i, naudio = 0, cover_index = -1, ret = -1;
+
+    if (avformat_open_input(&ic, job->src, NULL, NULL) < 0 || avformat_find_stream_info(ic, NULL) < 0) {
+        fm_log_error("Unable to read %s", job->src);
+        goto end;
+    }
+    if (avformat_alloc_output_context2(&oc, NULL, strcmp(job->ext, "m4a") == 0 ? "ipod" : job->ext, dest) < 0 || !oc)
+        goto end;
+    map = (int *) malloc(ic->nb_streams * sizeof(int));
+    for (i = 0; i < ic->nb_streams; i++) {
+        AVStream *in = ic->streams[i], *out;
+        map[i] = -1;
+        // any picture already in the file is left behind
+        if (in->codec->codec_type != AVMEDIA_TYPE_AUDIO || (out = avformat_new_stream(oc, NULL)) == NULL)
+            continue;
+        if (avcodec_copy_context(out->codec, in->codec) < 0)
+            goto end;
+        out->codec->codec_tag = 0;
+        out->time_base = in->time_base;
+        if (oc->oformat->flags & AVFMT_GLOBALHEADER)
+            out->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
+        map[i] = out->index;
+        naudio++;
+    }
+    if (naudio == 0)
+        goto end;
+    // the mov muxer cannot embed a cover in the libavformat versions we build against, so m4a only gets the text tags
+    if (cover && strcmp(job->ext, "mp3") == 0) {
+        AVStream *st = avformat_new_stream(oc, NULL);
+        if (st) {
+            st->codec->codec_type = AVMEDIA_TYPE_VIDEO;
+            st->codec->codec_id = cover_codec;
+            st->disposition = AV_DISPOSITION_ATTACHED_PIC;
+            cover_index = st->index;
+        }
+    }
+
+    av_dict_copy(&oc->metadata, ic->metadata, 0);
+    av_dict_set(&oc->metadata, "title", job->title, 0);
+    av_dict_set(&oc->metadata, "artist", job->artist, 0);
+    if (job->album[0] != '\0')
+        av_dict_set(&oc->metadata, "album", job->album, 0);
+    if (job->pubdate >= 1000 && job->pubdate <= 9999) {
+        sprintf(buf, "%d", job->pubdate);
+        av_dict_set(&oc->metadata, "date", buf, 0);
+    }
+    // the library picks the page url up from the comment
+    if (job->url[0] != '\0')
+        av_dict_set(&oc->metadata, "comment", job->url, 0);
+
+    if (avio_open(&oc->pb, dest, AVIO_FLAG_WRITE) < 0 || avformat_write_header(oc, NULL) < 0) {
+        fm_log_error("Unable to write %s", dest);
+        goto end;
+    }
+    if (cover_index >= 0) {
+        av_init_packet(&pkt);
+        pkt.data = cover;
+        pkt.size = cover_size;
+        pkt.pts = pkt.dts = 0;
+        pkt.stream_index = cover_index;
+        pkt.flags |= AV_PKT_FLAG_KEY;
+        if (av_write_frame(oc, &pkt) < 0)
+            goto end;
+    }
+    while (av_read_frame(ic, &pkt) >= 0) {
+        if (pkt.stream_index < ic->nb_streams && map[pkt.stream_index] >= 0) {
+            AVStream *in = ic->streams[pkt.stream_index], *out = oc->streams[map[pkt.stream_index]];
+            av_packet_rescale_ts(&pkt, in->time_base, out->time_base);
+            pkt.stream_index = out->index;
+            pkt.pos = -1;
+            if (av_interleaved_write_frame(oc, &pkt) < 0) {
+                av_free_packet(&pkt);
+                goto end;
+            }
+        }
+        av_free_packet(&pkt);
+    }
+    if (av_write_trailer(oc) == 0)
+        ret = 0;
+end:
+    if (oc) {
+        if (oc->pb)
+            avio_closep(&oc->pb);
+        avformat_free_context(oc);
+    }
+    if (ic)
+        avformat_close_input(&ic);
+    free(map);
+    return ret;
+}
+
+static void fetch_lyrics(fm_archive_job_t *job)
+{
+    char query[260], lrc[256], *dot, *p;
+    pid_t pid;
+    int status;
+
+    // slashes in the artist would be read as separate words anyway
+    snprintf(query, sizeof(query), "%s %s", job->title, job->artist);
+    for (p = query + strlen(job->title); *p; p++) {
+        if (*p == '/')
+            *p = ' ';
+    }
+    strcpy(lrc, job->dest);
+    if ((dot = strrchr(lrc, '.')) != NULL && dot > strrchr(lrc, '/'))
+        strcpy(dot, ".lrc");
+    char *argv[] = { "lrcdown", query, lrc, NULL };
+    if (posix_spawnp(&pid, "lrcdown", NULL, NULL, argv, environ) != 0) {
+        fm_log_error("Unable to run lrcdown");
+        return;
+    }
+    waitpid(pid, &status, 0);
+}
+
+static void archive_job(void *arg)
+{
+    fm_archive_job_t *job = (fm_archive_job_t *) arg;
+    fm_archive_t *ar = job->archive;
+    char part[272];
+    uint8_t *cover = NULL;
+    size_t cover_size = 0;
+    enum AVCodecID cover_codec;
+    int ok = 0;
+
+    // as before, a song whose cover cannot be fetched is not archived at all
+    archive_set_state(job, arCover);
+    if (fetch_cover(ar, job->cover, &cover, &cover_size, &cover_codec) == 0 && make_parent_dirs(job->dest) == 0) {
+        archive_set_state(job, arTagging);
+        // write next to dest and rename so that the library watcher only ever sees complete files
+        snprintf(part, sizeof(part), "%s.part", job->dest);
+        if (tag_file(job, part, cover, cover_size, cover_codec) == 0 && rename(part, job->dest) == 0) {
+            unlink(job->src);
+            ok = 1;
+        } else {
+            fm_log_error("Unable to tag %s; moving it as it is", job->dest);
+            unlink(part);
+            ok = move_file(job->src, job->dest, part) == 0;
+        }
+    }
+    free(cover);
+    if (ok && job->download_lyrics) {
+        archive_set_state(job, arLyrics);
+        fetch_lyrics(job);
+    }
+    if (!ok)
+        unlink(job->src);
+    if (ok)
+        fm_log_info("Archived %s", job->dest);
+    else
+        fm_log_error("Failed to archive %s", job->dest);
+    archive_set_state(job, ok ? arDone : arFailed);
+    free(job);
+}
+
+void fm_archive_init(fm_archive_t *ar, downloader_stack_t *stack)
+{
+    memset(ar, 0, sizeof(fm_archive_t));
+    ar->stack = stack;
+    ar->pool = task_pool_init(ARCHIVE_THREADS, ARCHIVE_QUEUE_CAPACITY);
+    pthread_mutex_init(&ar->mutex, NULL);
+}
+
+void fm_archive_cleanup(fm_archive_t *ar)
+{
+    task_pool_free(ar->pool);
+    pthread_mutex_destroy(&ar->mutex);
+}
+
+int fm_archive_submit(fm_archive_t *ar, fm_song_t *song, const char *dest, int download_lyrics)
+{
+    fm_archive_job_t *job = (fm_archive_job_t *) malloc(sizeof(fm_archive_job_t));
+    fm_archive_recent_t *r;
+    job->archive = ar;
+    strcpy(job->title, song->title);
+    strcpy(job->artist, song->artist);
+    strcpy(job->album, song->album);
+    job->pubdate = song->pubdate;
+    strcpy(job->url, song->url);
+    strcpy(job->cover, song->cover);
+    strcpy(job->ext, song->ext);
+    strcpy(job->src, song->filepath);
+    strcpy(job->dest, dest);
+    job->download_lyrics = download_lyrics;
+
+    pthread_mutex_lock(&ar->mutex);
+    job->seq = ++ar->submitted;
+    r = &ar->recent[job->seq % ARCHIVE_RECENT];
+    r->seq = job->seq;
+    if (snprintf(r->title, sizeof(r->title), "%s", song->title) >= sizeof(r->title)) {
+        // do not leave half a character behind: find the lead byte of the last character and drop it only if fewer
+        // bytes follow it than it announces
+        char *end = r->title + sizeof(r->title) - 1, *lead = end;
+        unsigned char c;
+        int len;
+        while (lead > r->title && (lead[-1] & 0xc0) == 0x80)
+            lead--;
+        if (lead > r->title) {
+            c = lead[-1];
+            len = c >= 0xf0 ? 4 : (c >= 0xe0 ? 3 : (c >= 0xc0 ? 2 : 1));
+            if (end - (lead - 1) < len)
+                end = lead - 1;
+        }
+        *end = '\0';
+    }
+    r->state = arQueued;
+    pthread_mutex_unlock(&ar->mutex);
+
+    if (task_pool_try_submit(ar->pool, NULL, archive_job, job) != 0) {
+        fm_log_warn("Queue is full; dropping %s", dest);
+        pthread_mutex_lock(&ar->mutex);
+        ar->dropped++;
+        if (r->seq == job->seq)
+            r->state = arFailed;
+        pthread_mutex_unlock(&ar->mutex);
+        free(job);
+        return -1;
+    }
+    return 0;
+}
+
+void fm_archive_get_status(fm_archive_t *ar, fm_archive_status_t *status)
+{
+    unsigned long seq;
+    task_pool_stats(ar->pool, &status->queued, &status->active);
+    pthread_mutex_lock(&ar->mutex);
+    status->done = ar->done;
+    status->failed = ar->failed;
+    status->dropped = ar->dropped;
+    status->nrecent = 0;
+    for (seq = ar->submitted; seq > 0 && status->nrecent < ARCHIVE_RECENT; seq--) {
+        status->recent[status->nrecent++] = ar->recent[seq % ARCHIVE_RECENT];
+    }
+    pthread_mutex_unlock(&ar->mutex);
+}
@@ -0,0 +1,78 @@
+#ifndef _FM_ARCHIVE_H_
+#define _FM_ARCHIVE_H_
+
+#include "playlist.h"
+#include "taskpool.h"
+#include <pthread.h>
+
+#define ARCHIVE_THREADS 2
+// liked songs beyond this many waiting to be archived are dropped instead of holding up the caller
+#define ARCHIVE_QUEUE_CAPACITY 32
+// the number of jobs whose state is kept around for the status
+#define ARCHIVE_RECENT 4
+
+enum fm_archive_state {
+    arQueued,
+    arCover,
+    arTagging,
+    arLyrics,
+    arDone,
+    arFailed,
+};
+
+// a liked song on its way from the download buffer to music_dir
+typedef struct fm_archive_job {
+    struct fm_archive *archive;
+    unsigned long seq;
+    char title[128];
+    char artist[128];
+    char album[128];
+    int pubdate;
+    char url[128];
+    char cover[128];
+    char ext[4];
+    // the downloaded file and where it should end up
+    char src[256];
+    char dest[256];
+    int download_lyrics;
+} fm_archive_job_t;
+
+typedef struct {
+    unsigned long seq;
+    char title[64];
+    enum fm_archive_state state;
+} fm_archive_recent_t;
+
+typedef struct {
+    int queued;
+    int active;
+    unsigned long done;
+    unsigned long failed;
+    unsigned long dropped;
+    int nrecent;
+    // the most recent job first
+    fm_archive_recent_t recent[ARCHIVE_RECENT];
+} fm_archive_status_t;
+
+typedef struct fm_archive {
+    // covers are fetched through the same downloaders as everything else
+    downloader_stack_t *stack;
+    task_pool_t *pool;
+    unsigned long submitted;
+    unsigned long done;
+    unsigned long failed;
+    unsigned long dropped;
+    fm_archive_recent_t recent[ARCHIVE_RECENT];
+    pthread_mutex_t mutex;
+} fm_archive_t;
+
+void fm_archive_init(fm_archive_t *ar, downloader_stack_t *stack);
+// finish the queued jobs and stop the workers
+void fm_archive_cleanup(fm_archive_t *ar);
+// queue a downloaded song to be tagged and moved to dest; the song itself can be freed right after
+// return -1 if the queue is full
+int fm_archive_submit(fm_archive_t *ar, fm_song_t *song, const char *dest, int download_lyrics);
+void fm_archive_get_status(fm_archive_t *ar, fm_archive_status_t *status);
+const char *fm_archive_state_str(enum fm_archive_state state);
+
+#endif
@@ -0,0 +1,83 @@
+#include "equalizer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+// runs interleaved 16 bit pcm through the equalizer the way the play thread does and reports how much faster than
+// real time it goes; usage: eq_bench [seconds of audio] [channels] [bands]
+
+#define BENCH_RATE 44100
+// the number of frames handed over per call; about what a decoded mp3 frame holds
+#define BENCH_CHUNK_FRAMES 1152
+
+static const char *bench_bands[FM_EQ_MAX_BANDS] = {
+    "lowshelf 80 4",
+    "peak 250 -2 1.2",
+    "peak 1000 1.5",
+    "peak 2500 -3 2",
+    "peak 4000 2",
+    "peak 8000 -1.5",
+    "highshelf 12000 3",
+    "peak 60 -4 0.8",
+};
+
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    int seconds = argc > 1 ? atoi(argv[1]) : 600;
+    int channels = argc > 2 ? atoi(argv[2]) : 2;
+    int nbands = argc > 3 ? atoi(argv[3]) : 5;
+    fm_eq_params_t params;
+    fm_equalizer_t eq;
+    int16_t *buf, *pcm;
+    long frames, done, i;
+    double start, elapsed;
+
+    if (seconds <= 0 || channels <= 0 || channels > FM_EQ_MAX_CHANNELS || nbands < 0 || nbands > FM_EQ_MAX_BANDS) {
+        fprintf(stderr, "usage: %s [seconds > 0] [channels 1-%d] [bands 0-%d]\n", argv[0], FM_EQ_MAX_CHANNELS, FM_EQ_MAX_BANDS);
+        return 1;
+    }
+    memset(&params, 0, sizeof(params));
+    params.enabled = 1;
+    params.preamp = -3;
+    for (i = 0; i < nbands; i++) {
+        fm_eq_parse_band(&params.bands[i], bench_bands[i]);
+    }
+    fm_equalizer_init(&eq, &params);
+
+    // one second of noise, copied into the working buffer before every pass so that every pass sees the same input
+    frames = BENCH_RATE;
+    pcm = (int16_t *) malloc(frames * channels * sizeof(int16_t));
+    buf = (int16_t *) malloc(frames * channels * sizeof(int16_t));
+    srand(1);
+    for (i = 0; i < frames * channels; i++) {
+        pcm[i] = (rand() % 65536) - 32768;
+    }
+
+    elapsed = 0;
+    for (i = 0; i < seconds; i++) {
+        memcpy(buf, pcm, frames * channels * sizeof(int16_t));
+        start = now_s();
+        for (done = 0; done < frames; done += BENCH_CHUNK_FRAMES) {
+            int n = frames - done < BENCH_CHUNK_FRAMES ? frames - done : BENCH_CHUNK_FRAMES;
+            fm_equalizer_process(&eq, buf + done * channels, n, channels, 16, BENCH_RATE);
+        }
+        elapsed += now_s() - start;
+    }
+
+    printf("%d s of %d channel audio through %d bands in %.3f s: %.1f Mframes/s, %.0fx real time\n",
+            seconds, channels, nbands, elapsed, seconds * (double) frames / elapsed / 1e6, seconds / elapsed);
+    fm_equalizer_destroy(&eq);
+    free(pcm);
+    free(buf);
+    return 0;
+}
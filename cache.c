@@ -0,0 +1,301 @@
+#include "cache.h"
+#include "util.h"
+#include "metrics.h"
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define LOG_MODULE lmCache
+
+#define DIR_MODE S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH
+
+static void entry_path(fm_cache_t *cache, fm_cache_entry_t *e, char *path)
+{
+    sprintf(path, "%s/%s.%s", cache->dir, e->key, e->ext);
+}
+
+static fm_cache_entry_t *cache_find(fm_cache_t *cache, const char *key)
+{
+    fm_cache_entry_t *e;
+    for (e = cache->head; e; e = e->next) {
+        if (strcmp(e->key, key) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static void list_remove(fm_cache_t *cache, fm_cache_entry_t *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        cache->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        cache->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void list_push_front(fm_cache_t *cache, fm_cache_entry_t *e)
+{
+    e->prev = NULL;
+    e->next = cache->head;
+    if (cache->head)
+        cache->head->prev = e;
+    else
+        cache->tail = e;
+    cache->head = e;
+}
+
+static void list_push_back(fm_cache_t *cache, fm_cache_entry_t *e)
+{
+    e->next = NULL;
+    e->prev = cache->tail;
+    if (cache->tail)
+        cache->tail->next = e;
+    else
+        cache->head = e;
+    cache->tail = e;
+}
+
+static void cache_drop(fm_cache_t *cache, fm_cache_entry_t *e)
+{
+    list_remove(cache, e);
+    cache->size -= e->size;
+    cache->nentries--;
+    cache->dirty = 1;
+    free(e);
+}
+
+// expects the mutex to be held
+static void cache_evict(fm_cache_t *cache)
+{
+    char path[320];
+    while (cache->size > cache->quota && cache->tail) {
+        entry_path(cache, cache->tail, path);
+        fm_log_info("Evicting %s", path);
+        unlink(path);
+        cache_drop(cache, cache->tail);
+    }
+}
+
+// expects the mutex to be held
+static void cache_save(fm_cache_t *cache)
+{
+    char tmp[280];
+    FILE *f;
+    fm_cache_entry_t *e;
+    sprintf(tmp, "%s.tmp", cache->index_path);
+    if (!(f = fopen(tmp, "w"))) {
+        fm_log_error("Unable to write %s: %s", tmp, strerror(errno));
+        return;
+    }
+    for (e = cache->head; e; e = e->next) {
+        fprintf(f, "%s %s %lld\n", e->key, e->ext, (long long) e->size);
+    }
+    if (fclose(f) == 0 && rename(tmp, cache->index_path) == 0)
+        cache->dirty = 0;
+    else
+        unlink(tmp);
+}
+
+// remove whatever is lying around in the directory without being in the index, e.g. copies interrupted by a crash
+static void cache_remove_strays(fm_cache_t *cache)
+{
+    DIR *dir;
+    struct dirent *ent;
+    char key[32], path[320], *dot;
+    fm_cache_entry_t *e;
+    if (!(dir = opendir(cache->dir)))
+        return;
+    while ((ent = readdir(dir))) {
+        if (ent->d_name[0] == '.' || strcmp(ent->d_name, "index") == 0)
+            continue;
+        e = NULL;
+        if ((dot = strrchr(ent->d_name, '.')) && dot - ent->d_name < sizeof(key)) {
+            memcpy(key, ent->d_name, dot - ent->d_name);
+            key[dot - ent->d_name] = '\0';
+            if ((e = cache_find(cache, key)) && strcmp(e->ext, dot + 1) != 0)
+                e = NULL;
+        }
+        if (!e) {
+            sprintf(path, "%s/%s", cache->dir, ent->d_name);
+            fm_log_info("Removing stray file %s", path);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+}
+
+void fm_cache_init(fm_cache_t *cache, const char *dir, int64_t quota)
+{
+    FILE *f;
+    char line[128], path[320];
+    long long size;
+    struct stat st;
+    fm_cache_entry_t *e;
+
+    memset(cache, 0, sizeof(fm_cache_t));
+    strcpy(cache->dir, dir);
+    sprintf(cache->index_path, "%s/index", dir);
+    cache->quota = quota;
+    pthread_mutex_init(&cache->mutex, NULL);
+    mkdir(dir, DIR_MODE);
+
+    if ((f = fopen(cache->index_path, "r"))) {
+        while (fgets(line, sizeof(line), f)) {
+            e = (fm_cache_entry_t *) malloc(sizeof(fm_cache_entry_t));
+            if (sscanf(line, "%31s %3s %lld", e->key, e->ext, &size) != 3 || cache_find(cache, e->key)) {
+                free(e);
+                continue;
+            }
+            e->size = size;
+            entry_path(cache, e, path);
+            // the files are ours alone, but do not hand out anything that is not as it was left
+            if (stat(path, &st) != 0 || st.st_size != e->size) {
+                unlink(path);
+                free(e);
+                cache->dirty = 1;
+                continue;
+            }
+            list_push_back(cache, e);
+            cache->size += e->size;
+            cache->nentries++;
+        }
+        fclose(f);
+    }
+    cache_remove_strays(cache);
+    // the quota might have been lowered since
+    cache_evict(cache);
+    if (cache->dirty)
+        cache_save(cache);
+    fm_log_info("%d songs (%lld bytes) in %s", cache->nentries, (long long) cache->size, cache->dir);
+}
+
+void fm_cache_cleanup(fm_cache_t *cache)
+{
+    fm_cache_entry_t *e, *next;
+    pthread_mutex_lock(&cache->mutex);
+    if (cache->dirty)
+        cache_save(cache);
+    for (e = cache->head; e; e = next) {
+        next = e->next;
+        free(e);
+    }
+    cache->head = cache->tail = NULL;
+    pthread_mutex_unlock(&cache->mutex);
+    pthread_mutex_destroy(&cache->mutex);
+}
+
+void fm_cache_set_quota(fm_cache_t *cache, int64_t quota)
+{
+    pthread_mutex_lock(&cache->mutex);
+    if (quota != cache->quota) {
+        cache->quota = quota;
+        cache_evict(cache);
+        if (cache->dirty)
+            cache_save(cache);
+    }
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+void fm_cache_key(char *key, int sid, const char *kbps)
+{
+    snprintf(key, 32, "%d-%s", sid, kbps);
+}
+
+int fm_cache_lookup(fm_cache_t *cache, const char *key, char *path)
+{
+    int ret = -1;
+    struct stat st;
+    fm_cache_entry_t *e;
+    pthread_mutex_lock(&cache->mutex);
+    if ((e = cache_find(cache, key))) {
+        entry_path(cache, e, path);
+        if (stat(path, &st) == 0 && st.st_size == e->size) {
+            list_remove(cache, e);
+            list_push_front(cache, e);
+            cache->dirty = 1;
+            ret = 0;
+        } else {
+            // somebody else has been at the directory
+            unlink(path);
+            cache_drop(cache, e);
+        }
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    fm_metrics_add(ret == 0 ? mcCacheHits : mcCacheMisses, 1);
+    return ret;
+}
+
+int fm_cache_insert(fm_cache_t *cache, const char *key, const char *ext, const char *src)
+{
+    struct stat st;
+    fm_cache_entry_t *e;
+    char path[320], part[336];
+
+    if (cache->quota <= 0 || stat(src, &st) != 0 || st.st_size > cache->quota)
+        return -1;
+    pthread_mutex_lock(&cache->mutex);
+    e = cache_find(cache, key);
+    pthread_mutex_unlock(&cache->mutex);
+    if (e)
+        return -1;
+
+    e = (fm_cache_entry_t *) malloc(sizeof(fm_cache_entry_t));
+    snprintf(e->key, sizeof(e->key), "%s", key);
+    snprintf(e->ext, sizeof(e->ext), "%s", ext);
+    e->size = st.st_size;
+    entry_path(cache, e, path);
+    sprintf(part, "%s.part", path);
+    // the copy out of /tmp can take a while, so the cache stays usable in the meantime
+    if (move_file(src, path, part) != 0) {
+        free(e);
+        return -1;
+    }
+    fm_log_info("Stored %s", path);
+
+    pthread_mutex_lock(&cache->mutex);
+    if (cache_find(cache, key)) {
+        // the same song finished twice; the file has simply been replaced
+        free(e);
+    } else {
+        list_push_front(cache, e);
+        cache->size += e->size;
+        cache->nentries++;
+    }
+    cache_evict(cache);
+    cache_save(cache);
+    pthread_mutex_unlock(&cache->mutex);
+    return 0;
+}
+
+void fm_cache_release(fm_cache_t *cache, const char *path)
+{
+    char key[32];
+    const char *name = strrchr(path, '/'), *dot;
+    fm_cache_entry_t *e;
+    if (!name || !(dot = strrchr(++name, '.')) || dot - name >= sizeof(key))
+        return;
+    memcpy(key, name, dot - name);
+    key[dot - name] = '\0';
+    pthread_mutex_lock(&cache->mutex);
+    if ((e = cache_find(cache, key))) {
+        cache_drop(cache, e);
+        cache_save(cache);
+    }
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+int fm_cache_owns(fm_cache_t *cache, const char *path)
+{
+    size_t len = strlen(cache->dir);
+    return strncmp(path, cache->dir, len) == 0 && path[len] == '/';
+}
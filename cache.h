@@ -0,0 +1,51 @@
+#ifndef _FM_CACHE_H_
+#define _FM_CACHE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+// the default quota in MB
+#define CACHE_DEFAULT_SIZE 512
+
+// a downloaded song kept around after it has been played
+// the key is the sid together with the bitrate (Jing songs always come at 255 kbps, which Douban never uses)
+typedef struct fm_cache_entry {
+    char key[32];
+    char ext[4];
+    int64_t size;
+    struct fm_cache_entry *prev;
+    struct fm_cache_entry *next;
+} fm_cache_entry_t;
+
+// songs are stored as <dir>/<key>.<ext>; the index lists them from the most to the least recently used
+typedef struct fm_cache {
+    char dir[256];
+    char index_path[272];
+    // 0 disables the cache
+    int64_t quota;
+    int64_t size;
+    int nentries;
+    // the most recently used entry comes first
+    fm_cache_entry_t *head;
+    fm_cache_entry_t *tail;
+    // whether the order changed since the index was written
+    int dirty;
+    pthread_mutex_t mutex;
+} fm_cache_t;
+
+void fm_cache_init(fm_cache_t *cache, const char *dir, int64_t quota);
+void fm_cache_cleanup(fm_cache_t *cache);
+// evict whatever no longer fits
+void fm_cache_set_quota(fm_cache_t *cache, int64_t quota);
+void fm_cache_key(char *key, int sid, const char *kbps);
+// copy the path of the cached song into path and mark it as used; return -1 if it is not cached
+int fm_cache_lookup(fm_cache_t *cache, const char *key, char *path);
+// move a complete download into the cache, evicting the least recently used songs to stay within the quota
+// return -1 (leaving src alone) if the song cannot be cached
+int fm_cache_insert(fm_cache_t *cache, const char *key, const char *ext, const char *src);
+// forget about a cached file that has been handed over to someone else
+void fm_cache_release(fm_cache_t *cache, const char *path);
+// whether the path points into the cache
+int fm_cache_owns(fm_cache_t *cache, const char *path);
+
+#endif
@@ -1,10 +1,14 @@
 #include "config.h"
 #include "util.h"
+#include "logger.h"
 
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <stdlib.h>
 
+#define LOG_MODULE lmConfig
+
 int fm_config_parse(const char *file, fm_config_t *confs, int length)
 {
     const int max_len = 64;
@@ -16,7 +20,7 @@ int fm_config_parse(const char *file, fm_config_t *confs, int length)
     int i;
 
     if ((f = fopen(file, "r")) == NULL) {
-        perror("open config file");
+        fm_log_error("Unable to open %s: %s", file, strerror(errno));
         return -1;
     }
 
@@ -34,7 +38,7 @@ int fm_config_parse(const char *file, fm_config_t *confs, int length)
             trim(val);
             for (i = 0; i < length; i++) {
                 if (strcmp(confs[i].section, section) == 0 && strcmp(confs[i].key, key) == 0) {
-                    printf("Config %s: %s => %s\n", section, key, val);
+                    fm_log_debug("Config %s: %s => %s", section, key, val);
                     switch (confs[i].type) {
                         case FM_CONFIG_INT:
                             *confs[i].val.i = atoi(val);
@@ -50,6 +54,7 @@ int fm_config_parse(const char *file, fm_config_t *confs, int length)
             }
         }
     }
+    fclose(f);
 
     return 0;
 }
@@ -1,13 +1,33 @@
 #include "downloader.h"
+#include "metrics.h"
+#include "trace.h"
+#include "logger.h"
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <pthread.h>
 
-static int tmp_count = 0;
+#define LOG_MODULE lmDownloader
 
-static void get_tmp_filepath(char *filepath)
+// open a new tmp file under a name that no other run has used, so that partial downloads survive restarts
+static FILE *open_tmp_file(char *filepath)
 {
-    sprintf(filepath, "/tmp/rpdtmp%d", tmp_count++);
+    FILE *f;
+    int fd;
+    sprintf(filepath, "%s/%sXXXXXX", DOWNLOADER_TMP_DIR, DOWNLOADER_TMP_PREFIX);
+    if ((fd = mkstemp(filepath)) < 0) {
+        fm_log_error("Unable to create a tmp file in %s", DOWNLOADER_TMP_DIR);
+        return NULL;
+    }
+    if (!(f = fdopen(fd, "w"))) {
+        fm_log_error("Unable to open %s", filepath);
+        close(fd);
+        unlink(filepath);
+    }
+    return f;
 }
 
 static void downloader_curl_reset(downloader_t *dl)
@@ -33,6 +53,7 @@ downloader_t *downloader_init()
     dl->idle = 1;
     dl->locked = 0;
     dl->data = NULL;
+    dl->first_byte = 0;
     dl->content.mbuf = NULL;
     // set the handle's private field to point to the downloader itself so that later it can be easily retrieved
     downloader_curl_reset(dl);
@@ -56,12 +77,14 @@ void downloader_free_buf(downloader_t *dl)
 {
     switch (dl->btype) {
         case bMem:
-            printf("Freeing the mbuf for downloader %p\n", dl);
+            fm_log_debug("Freeing the mbuf for downloader %p", dl);
             free(dl->content.mbuf);
             break;
         case bFile:
             // remove this part of the memory
             fdownloader_close(dl);
+            digest_stream_free(&dl->content.fbuf->digest);
+            curl_slist_free_all(dl->content.fbuf->headers);
             free(dl->content.fbuf);
             break;
         default:
@@ -77,12 +100,13 @@ static size_t append_to_buffer(char *ptr, size_t size, size_t nmemb, void *userp
     /*printf("Entered buffer appending block\n");*/
     mbuffer_t *buffer = dl->content.mbuf;
     size_t bytes = size * nmemb;
+    fm_metrics_add(mcDownloadBytes, bytes);
     if (buffer->length + bytes <= sizeof(buffer->data)) {
         memcpy(buffer->data + buffer->length, ptr, bytes);
         pthread_cond_signal(&dl->cond_new_content);
         buffer->length += bytes;
     } else {
-        fprintf(stderr, "Unable to append more data. Buffer is full.");
+        fm_log_error("Unable to append more data. Buffer is full.");
     }
     return bytes;
 }
@@ -90,6 +114,7 @@ static size_t append_to_buffer(char *ptr, size_t size, size_t nmemb, void *userp
 static size_t drop_buffer(char *ptr, size_t size, size_t nmemb, void *userp)
 {
     downloader_t *dl = (downloader_t *) userp;
+    fm_metrics_add(mcDownloadBytes, size * nmemb);
     pthread_cond_signal(&dl->cond_new_content);
     return size * nmemb;
 }
@@ -129,26 +154,167 @@ static size_t append_to_file(char *ptr, size_t size, size_t nmemb, void *userp)
     downloader_t *dl = (downloader_t *) userp;
     /*printf("Entered file appending block\n");*/
     fbuffer_t *buffer = dl->content.fbuf;
+    // there is nowhere to put the data (see open_tmp_file); returning short fails the transfer
+    if (!buffer->file)
+        return 0;
+    if (buffer->unchecked) {
+        long code = 0;
+        buffer->unchecked = 0;
+        curl_easy_getinfo(dl->curl, CURLINFO_RESPONSE_CODE, &code);
+        if (code == 200) {
+            // the file has changed since, or the server ignores ranges; either way the whole file is coming
+            fm_log_info("%s cannot be resumed; downloading it again", buffer->filepath);
+            fflush(buffer->file);
+            if (ftruncate(fileno(buffer->file), 0) != 0)
+                return 0;
+            rewind(buffer->file);
+            digest_stream_reset(&buffer->digest);
+        } else if (code == 416) {
+            // the range lies beyond the file on the server; stack_mark_idle_downloaders starts it over
+            return 0;
+        } else if (code != 206) {
+            fm_log_warn("Unexpected response %ld to resuming %s", code, buffer->filepath);
+            return 0;
+        }
+    }
     size_t s = fwrite(ptr, size, nmemb, buffer->file);
-    if (s > 0)
+    if (s > 0) {
+        fm_metrics_add(mcDownloadBytes, s * size);
+        if (!dl->first_byte)
+            dl->first_byte = fm_trace_now();
+        // hashing here means the finished file never has to be read again for validation
+        digest_stream_update(&buffer->digest, ptr, s * size);
         pthread_cond_signal(&dl->cond_new_content);
+    }
     return s * size;
 }
 
+// remember the ETag of the file
+static size_t header_of_file(char *ptr, size_t size, size_t nmemb, void *userp)
+{
+    downloader_t *dl = (downloader_t *) userp;
+    fbuffer_t *buffer = dl->content.fbuf;
+    size_t bytes = size * nmemb, len;
+    if (bytes > 5 && strncasecmp(ptr, "ETag:", 5) == 0 && !buffer->etag_set) {
+        ptr += 5;
+        bytes -= 5;
+        while (bytes > 0 && (*ptr == ' ' || *ptr == '\t')) {
+            ptr++;
+            bytes--;
+        }
+        for (len = bytes; len > 0 && (ptr[len - 1] == '\r' || ptr[len - 1] == '\n' || ptr[len - 1] == ' '); len--);
+        if (len > 0 && len < sizeof(buffer->etag)) {
+            memcpy(buffer->etag, ptr, len);
+            buffer->etag[len] = '\0';
+            __atomic_store_n(&buffer->etag_set, 1, __ATOMIC_RELEASE);
+        }
+    }
+    return size * nmemb;
+}
+
 void fdownloader_config(downloader_t *dl)
 {
     if (dl->btype != bFile) {
         downloader_free_buf(dl);
         dl->btype = bFile;
         dl->content.fbuf = (fbuffer_t *) malloc(sizeof(fbuffer_t));
-    } 
-    printf("Configuring fdownloader for %p\n", dl);
-    // requesting a new tmp file to be opened
-    get_tmp_filepath(dl->content.fbuf->filepath);
+        digest_stream_init(&dl->content.fbuf->digest);
+        dl->content.fbuf->headers = NULL;
+    } else
+        digest_stream_reset(&dl->content.fbuf->digest);
+    fm_log_debug("Configuring fdownloader for %p", dl);
+    fbuffer_t *buffer = dl->content.fbuf;
+    buffer->etag[0] = '\0';
+    buffer->etag_set = 0;
+    buffer->resumed = 0;
+    buffer->unchecked = 0;
+    curl_slist_free_all(buffer->headers);
+    buffer->headers = NULL;
     dl->mode = dFile;
     // set up the curl options
     curl_easy_setopt(dl->curl, CURLOPT_WRITEFUNCTION, append_to_file);
-    dl->content.fbuf->file = fopen(dl->content.fbuf->filepath, "w");
+    curl_easy_setopt(dl->curl, CURLOPT_HEADERFUNCTION, header_of_file);
+    curl_easy_setopt(dl->curl, CURLOPT_HEADERDATA, dl);
+    // requesting a new tmp file to be opened
+    buffer->file = open_tmp_file(buffer->filepath);
+}
+
+int fdownloader_hash_partial(const char *filepath, digest_stream_t *digest, int64_t *length)
+{
+    char data[8192];
+    size_t n;
+    int ret;
+    FILE *f = fopen(filepath, "r");
+    if (!f)
+        return -1;
+    *length = 0;
+    while ((n = fread(data, 1, sizeof(data), f)) > 0) {
+        digest_stream_update(digest, data, n);
+        *length += n;
+    }
+    ret = ferror(f) ? -1 : 0;
+    fclose(f);
+    return ret;
+}
+
+int fdownloader_resume(downloader_t *dl, const char *filepath, const char *etag, digest_stream_t *digest, int64_t length)
+{
+    fbuffer_t *buffer = dl->content.fbuf;
+    char range[32], header[160];
+    digest_stream_t swap;
+    FILE *f = fopen(filepath, "r+");
+    // anything past what has been hashed is dropped and downloaded again
+    if (!f || ftruncate(fileno(f), length) != 0 || fseek(f, 0, SEEK_END) != 0) {
+        if (f)
+            fclose(f);
+        return -1;
+    }
+    // the digest covers the whole file, so it carries on from the one of what is there already
+    swap = buffer->digest;
+    buffer->digest = *digest;
+    *digest = swap;
+    if (buffer->file) {
+        fclose(buffer->file);
+        unlink(buffer->filepath);
+    }
+    buffer->file = f;
+    snprintf(buffer->filepath, sizeof(buffer->filepath), "%s", filepath);
+    buffer->resumed = length;
+    buffer->unchecked = 1;
+    sprintf(range, "%lld-", (long long) length);
+    curl_easy_setopt(dl->curl, CURLOPT_RANGE, range);
+    // the ETag is taken from the response, which is what the file then matches
+    if (etag[0] != '\0') {
+        snprintf(header, sizeof(header), "If-Range: %s", etag);
+        buffer->headers = curl_slist_append(buffer->headers, header);
+        curl_easy_setopt(dl->curl, CURLOPT_HTTPHEADER, buffer->headers);
+    }
+    return 0;
+}
+
+void fdownloader_remove_stale(char keep[][64], int n)
+{
+    DIR *dir;
+    struct dirent *ent;
+    struct stat st;
+    char path[320];
+    int i;
+    if (!(dir = opendir(DOWNLOADER_TMP_DIR)))
+        return;
+    while ((ent = readdir(dir))) {
+        if (strncmp(ent->d_name, DOWNLOADER_TMP_PREFIX, strlen(DOWNLOADER_TMP_PREFIX)) != 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", DOWNLOADER_TMP_DIR, ent->d_name);
+        // the tmp dir is shared with everyone else
+        if (lstat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != getuid())
+            continue;
+        for (i = 0; i < n && strcmp(keep[i], path) != 0; i++);
+        if (i == n) {
+            fm_log_info("Removing stale download %s", path);
+            unlink(path);
+        }
+    }
+    closedir(dir);
 }
 
 void ddownloader_config(downloader_t *dl)
@@ -210,7 +376,7 @@ void stack_downloader_stop(downloader_stack_t *stack, downloader_t *d)
 {
     pthread_mutex_lock(&stack->mutex_elem);
     if (!d->idle) {
-        printf("Downloader %p stopped and marked to idle\n", d);
+        fm_log_debug("Downloader %p stopped and marked to idle", d);
         d->idle = 1;
         // any close action
         if (d->btype == bFile) {
@@ -224,23 +390,61 @@ void stack_downloader_stop(downloader_stack_t *stack, downloader_t *d)
     pthread_mutex_unlock(&stack->mutex_elem);
 }
 
-void stack_mark_idle_downloaders(downloader_stack_t *stack)
+// download a resumed file from the start again, on the same handle; expects mutex_op_download to be held
+static int fdownloader_restart(downloader_stack_t *stack, downloader_t *d)
+{
+    fbuffer_t *buffer = d->content.fbuf;
+    if (!buffer->file || fflush(buffer->file) != 0 || ftruncate(fileno(buffer->file), 0) != 0)
+        return -1;
+    fm_log_info("%s no longer fits the file on the server; downloading it again", buffer->filepath);
+    rewind(buffer->file);
+    digest_stream_reset(&buffer->digest);
+    buffer->resumed = 0;
+    buffer->unchecked = 0;
+    curl_easy_setopt(d->curl, CURLOPT_RANGE, NULL);
+    curl_easy_setopt(d->curl, CURLOPT_HTTPHEADER, NULL);
+    pthread_mutex_lock(&stack->mutex_elem);
+    curl_multi_remove_handle(stack->multi_handle, d->curl);
+    curl_multi_add_handle(stack->multi_handle, d->curl);
+    pthread_mutex_unlock(&stack->mutex_elem);
+    return 0;
+}
+
+// returns the number of transfers that were started over and are running again
+static int stack_mark_idle_downloaders(downloader_stack_t *stack)
 {
     CURLMsg *msg;
-    int msgs_left;
+    int msgs_left, restarted = 0;
     downloader_t *d;
     while ((msg = curl_multi_info_read(stack->multi_handle, &msgs_left))) {
         if (msg->msg == CURLMSG_DONE) {
             curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &d);
+            if (d->btype == bFile && d->content.fbuf->resumed) {
+                long code = 0;
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &code);
+                if (code == 416 && fdownloader_restart(stack, d) == 0) {
+                    restarted++;
+                    continue;
+                }
+            }
+            // only a complete transfer has a digest worth keeping
+            if (d->btype == bFile && msg->data.result == CURLE_OK)
+                digest_stream_finish(&d->content.fbuf->digest);
+            if (msg->data.result == CURLE_OK) {
+                double ttfb;
+                if (curl_easy_getinfo(msg->easy_handle, CURLINFO_STARTTRANSFER_TIME, &ttfb) == CURLE_OK)
+                    fm_metrics_observe(mhDownloadTtfb, ttfb);
+            }
             stack_downloader_stop(stack, d);
         }
     }
+    return restarted;
 }
 
 void stack_downloader_init(downloader_stack_t *stack, downloader_t *dl) 
 {
     pthread_mutex_lock(&stack->mutex_elem);
-    printf("Downloader %p on mode %d inited and added to the stack\n", dl, dl->mode);
+    fm_log_debug("Downloader %p on mode %d inited and added to the stack", dl, dl->mode);
     // set the idle attribute for the downloader
     dl->idle = 0;
     // reset the curl handle first
@@ -264,16 +468,16 @@ downloader_t *stack_perform_until_condition_met(downloader_stack_t *stack, downl
     int still_running, i;
     void *ret;
     // first add all these handles to the mix
-    printf("Adding all the handles to the multi-handle\n");
+    fm_log_debug("Adding all the handles to the multi-handle");
     for (i=0; i<length; i++) {
         stack_downloader_init(stack, start[i]);
     }
 
     pthread_mutex_lock(&stack->mutex_op_download);
     /* we start some action by calling perform right away */
-    printf("Trying with initial perform for multi-handle %p\n", stack->multi_handle);
+    fm_log_debug("Trying with initial perform for multi-handle %p", stack->multi_handle);
     while ( curl_multi_perform(stack->multi_handle, &still_running) == CURLM_CALL_MULTI_PERFORM );
-    printf("Initial perform finished\n");
+    fm_log_debug("Initial perform finished");
     pthread_mutex_unlock(&stack->mutex_op_download);
 
 
@@ -329,7 +533,9 @@ downloader_t *stack_perform_until_condition_met(downloader_stack_t *stack, downl
                 break;
         }
         /*printf("Marking the idle downloaders\n");*/
-        stack_mark_idle_downloaders(stack);
+        // a restarted transfer keeps the loop going even if the multi handle had run dry
+        if (stack_mark_idle_downloaders(stack))
+            still_running = 1;
 
         pthread_mutex_unlock(&stack->mutex_op_download);
 
@@ -401,7 +607,7 @@ void stack_get_idle_downloaders(downloader_stack_t *stack, downloader_t **start,
         default: break;
     }
     // loop through the multi_handle's message queue to get all those 'done' downloaders
-    printf("Total number of downloaders in the stack is %d; number of requested downloaders is %d\n", stack->size, length);
+    fm_log_debug("Total number of downloaders in the stack is %d; number of requested downloaders is %d", stack->size, length);
     downloader_t *idlers[stack->size], *dl;
     int idlex = 0;
     for (i=0; n < length && i<stack->size; i++) {
@@ -415,7 +621,7 @@ void stack_get_idle_downloaders(downloader_stack_t *stack, downloader_t **start,
 
     }
     for (i=0; n < length && i < idlex; i++) {
-        printf("Fallback to retrieving idle downloader %p with different modes\n", idlers[i]);
+        fm_log_debug("Fallback to retrieving idle downloader %p with different modes", idlers[i]);
         start[n++] = idlers[i];
     }
     while (n < length) {
@@ -1,5 +1,13 @@
+#ifndef _FM_DOWNLOADER_H_
+#define _FM_DOWNLOADER_H_
+
 #include <curl/curl.h>
+#include <stdint.h>
+#include "validator.h"
 #define DEFAULT_N_DOWNLOADERS 5
+// the file downloads go to mkstemp files named after this
+#define DOWNLOADER_TMP_DIR "/tmp"
+#define DOWNLOADER_TMP_PREFIX "rpdtmp"
 
 typedef struct {
     char data[8192];
@@ -9,6 +17,17 @@ typedef struct {
 typedef struct {
     char filepath[64];
     FILE *file;
+    // the sha256 of what has been written; finished once the transfer completes successfully
+    digest_stream_t digest;
+    // the ETag the server sent along with the file; only read by other threads once etag_set is
+    char etag[128];
+    int etag_set;
+    // the number of bytes already in the file when the transfer was resumed; 0 for a fresh one
+    int64_t resumed;
+    // whether the response to the resumed transfer has yet to be checked
+    int unchecked;
+    // the If-Range header of a resumed transfer
+    struct curl_slist *headers;
 } fbuffer_t;
 
 enum downloader_buffer_type {
@@ -33,6 +52,8 @@ typedef struct {
     int locked;
     // a data variable for recording custom data
     void *data;
+    // when the first byte of the current transfer arrived (see fm_trace_now); 0 until then
+    int64_t first_byte;
     // the easy curl handle responsible for the actual downloading
     CURL *curl;
     // the condition that clients can use to monitor if new content arrived
@@ -48,6 +69,16 @@ downloader_t *downloader_init();
 void downloader_free(downloader_t *dl);
 void mdownloader_config(downloader_t *dl);
 void fdownloader_config(downloader_t *dl);
+// hash the partial file at filepath into digest (initialised by the caller) and get its length; this is the slow
+// part of resuming a download, so it is done ahead of fdownloader_resume
+int fdownloader_hash_partial(const char *filepath, digest_stream_t *digest, int64_t *length);
+// carry on with the partial file at filepath (dropping the fresh one fdownloader_config set up) with a Range request
+// from length, where digest (swapped with the downloader's own) left off; should the server no longer have the same
+// file (going by the ETag, if known), it starts over
+// return -1 (leaving the downloader as it was) if the file cannot be opened
+int fdownloader_resume(downloader_t *dl, const char *filepath, const char *etag, digest_stream_t *digest, int64_t length);
+// remove the files left behind by earlier file downloads except for the n paths in keep
+void fdownloader_remove_stale(char keep[][64], int n);
 void ddownloader_config(downloader_t *dl);
 void downloader_config_mode(downloader_t *dl, enum downloader_mode m);
 
@@ -81,3 +112,5 @@ int stack_perform_until_done(downloader_stack_t *stack, downloader_t *downloader
 void stack_get_idle_downloaders(downloader_stack_t *stack, downloader_t **start, int length, enum downloader_mode mode);;
 downloader_t *stack_get_idle_downloader(downloader_stack_t *stack, enum downloader_mode mode);
 void stack_free(downloader_stack_t *stack);
+
+#endif
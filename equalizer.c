@@ -0,0 +1,306 @@
+#include "equalizer.h"
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#define LOG_MODULE lmEqualizer
+
+#define EQ_DEFAULT_Q 0.7071f
+
+static const char *band_type_names[] = {
+    [eqNone] = "none",
+    [eqPeak] = "peak",
+    [eqLowShelf] = "lowshelf",
+    [eqHighShelf] = "highshelf",
+};
+
+const char *fm_eq_band_type_str(enum fm_eq_band_type type)
+{
+    return band_type_names[type];
+}
+
+int fm_eq_parse_band(fm_eq_band_t *band, const char *spec)
+{
+    char name[16];
+    float freq, gain, q = EQ_DEFAULT_Q;
+    int n;
+    enum fm_eq_band_type type = eqPeak;
+
+    if (strcasecmp(spec, "off") == 0 || strcasecmp(spec, "none") == 0) {
+        band->type = eqNone;
+        return 0;
+    }
+    // the type is optional; a band starting with a number is a peaking filter
+    if (sscanf(spec, "%15s", name) == 1 && (name[0] < '0' || name[0] > '9')) {
+        if (strcasecmp(name, "peak") == 0)
+            type = eqPeak;
+        else if (strcasecmp(name, "lowshelf") == 0)
+            type = eqLowShelf;
+        else if (strcasecmp(name, "highshelf") == 0)
+            type = eqHighShelf;
+        else {
+            fm_log_warn("Unknown equalizer band type %s", name);
+            return -1;
+        }
+        spec += strlen(name);
+    }
+    n = sscanf(spec, "%f %f %f", &freq, &gain, &q);
+    if (n < 2 || freq <= 0 || q <= 0) {
+        fm_log_warn("Malformed equalizer band: %s", spec);
+        return -1;
+    }
+    band->type = type;
+    band->freq = freq;
+    band->gain = gain;
+    band->q = q;
+    return 0;
+}
+
+// the formulas are those from the RBJ audio eq cookbook
+static int band_coeffs(fm_eq_band_t *band, int rate, fm_eq_coeffs_t *c)
+{
+    if (band->type == eqNone || band->gain == 0 || band->freq >= rate / 2)
+        return -1;
+    double A = pow(10, band->gain / 40);
+    double w0 = 2 * M_PI * band->freq / rate;
+    double cs = cos(w0);
+    double alpha = sin(w0) / (2 * band->q);
+    double sa = 2 * sqrt(A) * alpha;
+    double b0, b1, b2, a0, a1, a2;
+
+    switch (band->type) {
+        case eqPeak:
+            b0 = 1 + alpha * A;
+            b1 = -2 * cs;
+            b2 = 1 - alpha * A;
+            a0 = 1 + alpha / A;
+            a1 = -2 * cs;
+            a2 = 1 - alpha / A;
+            break;
+        case eqLowShelf:
+            b0 = A * ((A + 1) - (A - 1) * cs + sa);
+            b1 = 2 * A * ((A - 1) - (A + 1) * cs);
+            b2 = A * ((A + 1) - (A - 1) * cs - sa);
+            a0 = (A + 1) + (A - 1) * cs + sa;
+            a1 = -2 * ((A - 1) + (A + 1) * cs);
+            a2 = (A + 1) + (A - 1) * cs - sa;
+            break;
+        case eqHighShelf:
+            b0 = A * ((A + 1) + (A - 1) * cs + sa);
+            b1 = -2 * A * ((A - 1) + (A + 1) * cs);
+            b2 = A * ((A + 1) + (A - 1) * cs - sa);
+            a0 = (A + 1) - (A - 1) * cs + sa;
+            a1 = 2 * ((A - 1) - (A + 1) * cs);
+            a2 = (A + 1) - (A - 1) * cs - sa;
+            break;
+        default:
+            return -1;
+    }
+    c->b0 = b0 / a0;
+    c->b1 = b1 / a0;
+    c->b2 = b2 / a0;
+    c->a1 = a1 / a0;
+    c->a2 = a2 / a0;
+    return 0;
+}
+
+void fm_equalizer_init(fm_equalizer_t *eq, fm_eq_params_t *params)
+{
+    memset(eq, 0, sizeof(fm_equalizer_t));
+    atomic_init(&eq->seq, 2);
+    pthread_mutex_init(&eq->mutex_write, NULL);
+    if (params)
+        eq->params = *params;
+    // force the audio side to pick up the parameters on the first block
+    eq->active_seq = 0;
+}
+
+void fm_equalizer_destroy(fm_equalizer_t *eq)
+{
+    pthread_mutex_destroy(&eq->mutex_write);
+}
+
+void fm_equalizer_get(fm_equalizer_t *eq, fm_eq_params_t *params)
+{
+    pthread_mutex_lock(&eq->mutex_write);
+    *params = eq->params;
+    pthread_mutex_unlock(&eq->mutex_write);
+}
+
+void fm_equalizer_set(fm_equalizer_t *eq, fm_eq_params_t *params)
+{
+    pthread_mutex_lock(&eq->mutex_write);
+    unsigned seq = atomic_load_explicit(&eq->seq, memory_order_relaxed);
+    atomic_store_explicit(&eq->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    eq->params = *params;
+    atomic_store_explicit(&eq->seq, seq + 2, memory_order_release);
+    pthread_mutex_unlock(&eq->mutex_write);
+}
+
+void fm_equalizer_reset(fm_equalizer_t *eq)
+{
+    memset(eq->state, 0, sizeof(eq->state));
+}
+
+// pick up new parameters (if any) without ever waiting on the writer; a write in progress is simply retried on the next block
+static void eq_refresh(fm_equalizer_t *eq, int rate)
+{
+    unsigned seq = atomic_load_explicit(&eq->seq, memory_order_acquire);
+    if (seq != eq->active_seq && !(seq & 1)) {
+        fm_eq_params_t params;
+        memcpy(&params, &eq->params, sizeof(params));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&eq->seq, memory_order_relaxed) == seq) {
+            // the history left over from before the equalizer was turned off belongs to some other audio
+            if (params.enabled && !eq->active.enabled)
+                fm_equalizer_reset(eq);
+            eq->active = params;
+            eq->active_seq = seq;
+            // recompute the coefficients below
+            eq->rate = 0;
+        }
+    }
+    if (eq->rate != rate) {
+        fm_eq_coeffs_t c;
+        int stages[FM_EQ_MAX_BANDS];
+        int i, n = 0, s = 0, was_on;
+        eq->rate = rate;
+        for (i = 0; i < FM_EQ_MAX_BANDS; i++) {
+            was_on = s < eq->nstages && eq->stages[s] == i;
+            if (was_on)
+                s++;
+            if (band_coeffs(&eq->active.bands[i], rate, &c) != 0)
+                continue;
+            // a filter that is new or has changed starts from silence rather than from the history of another one
+            if (!was_on || memcmp(&c, &eq->coeffs[i], sizeof(c)) != 0) {
+                memset(eq->state[i], 0, sizeof(eq->state[i]));
+                eq->coeffs[i] = c;
+            }
+            stages[n++] = i;
+        }
+        memcpy(eq->stages, stages, n * sizeof(int));
+        eq->nstages = n;
+        eq->preamp = powf(10, eq->active.preamp / 20);
+    }
+}
+
+static void load_block(fm_equalizer_t *eq, void *buf, int offset, int n, int channels, int first, int lanes, int bits)
+{
+    int i, l;
+    float scale = eq->preamp;
+    memset(eq->block, 0, sizeof(float) * FM_EQ_LANES * n);
+    switch (bits) {
+        case 8: {
+            uint8_t *p = (uint8_t *) buf + offset * channels + first;
+            scale /= 128.0f;
+            for (i = 0; i < n; i++, p += channels)
+                for (l = 0; l < lanes; l++)
+                    eq->block[i][l] = ((int) p[l] - 128) * scale;
+            break;
+        }
+        case 16: {
+            int16_t *p = (int16_t *) buf + offset * channels + first;
+            scale /= 32768.0f;
+            for (i = 0; i < n; i++, p += channels)
+                for (l = 0; l < lanes; l++)
+                    eq->block[i][l] = p[l] * scale;
+            break;
+        }
+        case 32: {
+            int32_t *p = (int32_t *) buf + offset * channels + first;
+            scale /= 2147483648.0f;
+            for (i = 0; i < n; i++, p += channels)
+                for (l = 0; l < lanes; l++)
+                    eq->block[i][l] = p[l] * scale;
+            break;
+        }
+    }
+}
+
+static inline float clampf(float x, float lo, float hi)
+{
+    return x < lo ? lo : (x > hi ? hi : x);
+}
+
+static void store_block(fm_equalizer_t *eq, void *buf, int offset, int n, int channels, int first, int lanes, int bits)
+{
+    int i, l;
+    switch (bits) {
+        case 8: {
+            uint8_t *p = (uint8_t *) buf + offset * channels + first;
+            for (i = 0; i < n; i++, p += channels)
+                for (l = 0; l < lanes; l++)
+                    p[l] = lrintf(clampf(eq->block[i][l] * 128.0f, -128.0f, 127.0f)) + 128;
+            break;
+        }
+        case 16: {
+            int16_t *p = (int16_t *) buf + offset * channels + first;
+            for (i = 0; i < n; i++, p += channels)
+                for (l = 0; l < lanes; l++)
+                    p[l] = lrintf(clampf(eq->block[i][l] * 32768.0f, -32768.0f, 32767.0f));
+            break;
+        }
+        case 32: {
+            int32_t *p = (int32_t *) buf + offset * channels + first;
+            // 2147483520 is the largest float below 2^31
+            for (i = 0; i < n; i++, p += channels)
+                for (l = 0; l < lanes; l++)
+                    p[l] = (int32_t) clampf(eq->block[i][l] * 2147483648.0f, -2147483648.0f, 2147483520.0f);
+            break;
+        }
+    }
+}
+
+// run one biquad (transposed direct form II) over the whole block; keeping the stage outermost leaves
+// its coefficients in registers while the block streams through L1, and the lane loop maps onto one vector op
+static void run_stage(const fm_eq_coeffs_t *c, fm_eq_state_t *st, float (*block)[FM_EQ_LANES], int n)
+{
+    const float b0 = c->b0, b1 = c->b1, b2 = c->b2, a1 = c->a1, a2 = c->a2;
+    float z1[FM_EQ_LANES], z2[FM_EQ_LANES];
+    int i, l;
+    memcpy(z1, st->z1, sizeof(z1));
+    memcpy(z2, st->z2, sizeof(z2));
+    for (i = 0; i < n; i++) {
+        for (l = 0; l < FM_EQ_LANES; l++) {
+            float x = block[i][l];
+            float y = b0 * x + z1[l];
+            z1[l] = b1 * x - a1 * y + z2[l];
+            z2[l] = b2 * x - a2 * y;
+            block[i][l] = y;
+        }
+    }
+    memcpy(st->z1, z1, sizeof(z1));
+    memcpy(st->z2, z2, sizeof(z2));
+}
+
+void fm_equalizer_process(fm_equalizer_t *eq, void *buf, int frames, int channels, int bits, int rate)
+{
+    int offset, n, g, s;
+
+    eq_refresh(eq, rate);
+    if (!eq->active.enabled || channels > FM_EQ_MAX_CHANNELS)
+        return;
+    if (bits != 8 && bits != 16 && bits != 32)
+        return;
+    if (eq->nstages == 0 && eq->preamp == 1.0f)
+        return;
+
+    for (offset = 0; offset < frames; offset += n) {
+        n = frames - offset;
+        if (n > FM_EQ_BLOCK_FRAMES)
+            n = FM_EQ_BLOCK_FRAMES;
+        for (g = 0; g * FM_EQ_LANES < channels; g++) {
+            int first = g * FM_EQ_LANES;
+            int lanes = channels - first < FM_EQ_LANES ? channels - first : FM_EQ_LANES;
+            load_block(eq, buf, offset, n, channels, first, lanes, bits);
+            for (s = 0; s < eq->nstages; s++)
+                run_stage(&eq->coeffs[eq->stages[s]], &eq->state[eq->stages[s]][g], eq->block, n);
+            store_block(eq, buf, offset, n, channels, first, lanes, bits);
+        }
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef _FM_EQUALIZER_H_
+#define _FM_EQUALIZER_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define FM_EQ_MAX_BANDS 8
+// number of channels processed side by side; the inner loop runs over the lanes so that the compiler can vectorize it
+#define FM_EQ_LANES 4
+#define FM_EQ_MAX_CHANNELS 8
+#define FM_EQ_GROUPS (FM_EQ_MAX_CHANNELS / FM_EQ_LANES)
+// number of frames converted to float and run through the chain at once; small enough to stay in L1
+#define FM_EQ_BLOCK_FRAMES 256
+
+enum fm_eq_band_type {
+    eqNone,
+    eqPeak,
+    eqLowShelf,
+    eqHighShelf
+};
+
+typedef struct {
+    enum fm_eq_band_type type;
+    // center (or corner) frequency in Hz
+    float freq;
+    // gain in dB
+    float gain;
+    float q;
+} fm_eq_band_t;
+
+typedef struct {
+    int enabled;
+    // gain applied before the filters, in dB
+    float preamp;
+    fm_eq_band_t bands[FM_EQ_MAX_BANDS];
+} fm_eq_params_t;
+
+typedef struct {
+    float b0, b1, b2, a1, a2;
+} fm_eq_coeffs_t;
+
+typedef struct {
+    float z1[FM_EQ_LANES];
+    float z2[FM_EQ_LANES];
+} fm_eq_state_t;
+
+typedef struct {
+    //// control side
+    // the parameters are published with a sequence lock: odd while being written
+    atomic_uint seq;
+    fm_eq_params_t params;
+    // serializes the writers; the audio thread never takes it
+    pthread_mutex_t mutex_write;
+
+    //// audio side (only touched by the play thread)
+    unsigned active_seq;
+    int rate;
+    // the band slots that have a filter, in order
+    int stages[FM_EQ_MAX_BANDS];
+    int nstages;
+    float preamp;
+    fm_eq_params_t active;
+    // the coefficients and the history are kept per band slot, so that a band switched off or on leaves the others
+    // running on their own history
+    fm_eq_coeffs_t coeffs[FM_EQ_MAX_BANDS];
+    fm_eq_state_t state[FM_EQ_MAX_BANDS][FM_EQ_GROUPS];
+    float block[FM_EQ_BLOCK_FRAMES][FM_EQ_LANES];
+} fm_equalizer_t;
+
+// parse a band specification of the form "[peak|lowshelf|highshelf] <freq> <gain> [q]"
+// return 0 on success
+int fm_eq_parse_band(fm_eq_band_t *band, const char *spec);
+const char *fm_eq_band_type_str(enum fm_eq_band_type type);
+
+void fm_equalizer_init(fm_equalizer_t *eq, fm_eq_params_t *params);
+void fm_equalizer_destroy(fm_equalizer_t *eq);
+// these can be called from any thread while the audio is playing
+void fm_equalizer_get(fm_equalizer_t *eq, fm_eq_params_t *params);
+void fm_equalizer_set(fm_equalizer_t *eq, fm_eq_params_t *params);
+// reset the filter history; call it when a new song starts
+void fm_equalizer_reset(fm_equalizer_t *eq);
+// process interleaved integer pcm in place; bits can be 8 (unsigned), 16 or 32 (signed)
+void fm_equalizer_process(fm_equalizer_t *eq, void *buf, int frames, int channels, int bits, int rate);
+
+#endif
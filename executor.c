@@ -0,0 +1,174 @@
+#include "executor.h"
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#define LOG_MODULE lmApp
+
+static fm_request_t *queue_pop(fm_executor_t *ex)
+{
+    fm_request_t *req;
+    pthread_mutex_lock(&ex->mutex);
+    if ((req = ex->head)) {
+        ex->head = req->job_next;
+        if (!ex->head)
+            ex->tail = NULL;
+    }
+    pthread_mutex_unlock(&ex->mutex);
+    return req;
+}
+
+static fm_executor_event_t *event_pop(fm_executor_t *ex)
+{
+    fm_executor_event_t *event;
+    pthread_mutex_lock(&ex->mutex);
+    if ((event = ex->events)) {
+        ex->events = event->next;
+        if (!ex->events)
+            ex->events_tail = NULL;
+    }
+    pthread_mutex_unlock(&ex->mutex);
+    return event;
+}
+
+static void executor_wake(int fd)
+{
+    uint64_t one = 1;
+    write(fd, &one, sizeof(one));
+}
+
+static int64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *executor_thread(void *data)
+{
+    fm_executor_t *ex = (fm_executor_t *) data;
+    struct pollfd fds[2] = {
+        { .fd = ex->queue_fd, .events = POLLIN },
+        { .fd = ex->event_fd, .events = POLLIN }
+    };
+    uint64_t count;
+    fm_request_t *req;
+    fm_executor_event_t *event;
+    int64_t now, next_tick = now_ms() + EXECUTOR_TICK;
+    int ret;
+
+    while (!ex->should_quit) {
+        // the tick keeps its pace however busy the requests and the events keep the thread
+        now = now_ms();
+        ret = poll(fds, 2, next_tick > now ? next_tick - now : 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            fm_log_error("Unable to wait for requests: %s", strerror(errno));
+            break;
+        }
+        if (ex->should_quit)
+            break;
+        // the events come first; e.g. the requests queued after a song has ended expect the next song to be on already
+        if (fds[1].revents & POLLIN) {
+            read(ex->event_fd, &count, sizeof(count));
+            while (!ex->should_quit && (event = event_pop(ex))) {
+                ex->event(ex->data, event);
+                free(event);
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            read(ex->queue_fd, &count, sizeof(count));
+            while (!ex->should_quit && (req = queue_pop(ex))) {
+                ex->handle(ex->data, req);
+                fm_server_reply(ex->server, req);
+            }
+        }
+        if (!ex->should_quit && (now = now_ms()) >= next_tick) {
+            ex->tick(ex->data);
+            next_tick = now + EXECUTOR_TICK;
+        }
+    }
+    return data;
+}
+
+int fm_executor_init(fm_executor_t *ex, fm_server_t *server, executor_handle handle, executor_event event, executor_callback tick, void *data)
+{
+    ex->server = server;
+    ex->handle = handle;
+    ex->event = event;
+    ex->tick = tick;
+    ex->data = data;
+    ex->head = ex->tail = NULL;
+    ex->events = ex->events_tail = NULL;
+    ex->should_quit = 0;
+    if ((ex->queue_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        return -1;
+    if ((ex->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        close(ex->queue_fd);
+        return -1;
+    }
+    pthread_mutex_init(&ex->mutex, NULL);
+    if (pthread_create(&ex->tid, NULL, executor_thread, ex) != 0) {
+        close(ex->queue_fd);
+        close(ex->event_fd);
+        pthread_mutex_destroy(&ex->mutex);
+        return -1;
+    }
+    return 0;
+}
+
+void fm_executor_cleanup(fm_executor_t *ex)
+{
+    fm_request_t *req;
+    fm_executor_event_t *event;
+    ex->should_quit = 1;
+    executor_wake(ex->event_fd);
+    pthread_join(ex->tid, NULL);
+    // nobody is waiting for these any more
+    while ((req = queue_pop(ex)))
+        fm_server_reply(ex->server, req);
+    while ((event = event_pop(ex)))
+        free(event);
+    close(ex->queue_fd);
+    close(ex->event_fd);
+    pthread_mutex_destroy(&ex->mutex);
+}
+
+void fm_executor_submit(fm_executor_t *ex, fm_request_t *req)
+{
+    req->job_next = NULL;
+    pthread_mutex_lock(&ex->mutex);
+    if (ex->tail)
+        ex->tail->job_next = req;
+    else
+        ex->head = req;
+    ex->tail = req;
+    pthread_mutex_unlock(&ex->mutex);
+    executor_wake(ex->queue_fd);
+}
+
+void fm_executor_post(fm_executor_t *ex, int kind, unsigned long arg)
+{
+    fm_executor_event_t *event = (fm_executor_event_t *) malloc(sizeof(fm_executor_event_t));
+    event->kind = kind;
+    event->arg = arg;
+    clock_gettime(CLOCK_MONOTONIC, &event->posted);
+    event->next = NULL;
+    pthread_mutex_lock(&ex->mutex);
+    if (ex->events_tail)
+        ex->events_tail->next = event;
+    else
+        ex->events = event;
+    ex->events_tail = event;
+    pthread_mutex_unlock(&ex->mutex);
+    executor_wake(ex->event_fd);
+}
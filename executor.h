@@ -0,0 +1,59 @@
+#ifndef _FM_EXECUTOR_H_
+#define _FM_EXECUTOR_H_
+
+#include "server.h"
+#include <pthread.h>
+#include <time.h>
+
+// how often (in milliseconds) the tick callback runs while nothing else is going on
+#define EXECUTOR_TICK 1000
+
+// something that happened outside of any request, e.g. a song coming to its end
+typedef struct fm_executor_event {
+    // what kind of event it is and whatever goes with it; both are up to the poster
+    int kind;
+    unsigned long arg;
+    // when the event was posted (CLOCK_MONOTONIC)
+    struct timespec posted;
+    struct fm_executor_event *next;
+} fm_executor_event_t;
+
+// runs a request and leaves the reply in req->output
+typedef void (*executor_handle)(void *ptr, fm_request_t *req);
+// runs an event posted by fm_executor_post
+typedef void (*executor_event)(void *ptr, const fm_executor_event_t *event);
+// called on every tick
+typedef void (*executor_callback)(void *ptr);
+
+// a single thread that runs the requests one after another, in the order they were submitted
+// whatever state the handlers touch is owned by this thread, so they need no locking among themselves
+typedef struct {
+    fm_server_t *server;
+    executor_handle handle;
+    executor_event event;
+    executor_callback tick;
+    void *data;
+
+    fm_request_t *head;
+    fm_request_t *tail;
+    // counts the submitted requests
+    int queue_fd;
+    fm_executor_event_t *events;
+    fm_executor_event_t *events_tail;
+    // counts the posted events
+    int event_fd;
+
+    int should_quit;
+    pthread_t tid;
+    pthread_mutex_t mutex;
+} fm_executor_t;
+
+int fm_executor_init(fm_executor_t *ex, fm_server_t *server, executor_handle handle, executor_event event, executor_callback tick, void *data);
+// finish the request being run and drop the rest, events included
+void fm_executor_cleanup(fm_executor_t *ex);
+// the reply goes back through fm_server_reply once the request has run
+void fm_executor_submit(fm_executor_t *ex, fm_request_t *req);
+// queue an event; the events run in the order they were posted, each one before the requests waiting alongside it
+void fm_executor_post(fm_executor_t *ex, int kind, unsigned long arg);
+
+#endif
@@ -0,0 +1,187 @@
+#include "json.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void reserve(fm_json_t *w, size_t n)
+{
+    size_t cap;
+    if (w->len + n + 1 <= w->cap)
+        return;
+    cap = w->cap ? w->cap : 256;
+    while (cap < w->len + n + 1)
+        cap *= 2;
+    w->buf = (char *) realloc(w->buf, cap);
+    w->cap = cap;
+}
+
+static void append(fm_json_t *w, const char *s, size_t n)
+{
+    reserve(w, n);
+    memcpy(w->buf + w->len, s, n);
+    w->len += n;
+    w->buf[w->len] = '\0';
+}
+
+// put down the comma in front of a value unless it is the first at its level or follows its key
+static void separate(fm_json_t *w)
+{
+    if (w->after_key) {
+        w->after_key = 0;
+        return;
+    }
+    if (w->depth > 0 && w->depth <= JSON_MAX_DEPTH) {
+        if (w->filled[w->depth - 1])
+            append(w, ",", 1);
+        w->filled[w->depth - 1] = 1;
+    }
+}
+
+static void open_level(fm_json_t *w, char c)
+{
+    separate(w);
+    append(w, &c, 1);
+    if (w->depth < JSON_MAX_DEPTH)
+        w->filled[w->depth] = 0;
+    w->depth++;
+}
+
+static void close_level(fm_json_t *w, char c)
+{
+    append(w, &c, 1);
+    w->depth--;
+}
+
+static void escape(fm_json_t *w, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *p = (const unsigned char *) s;
+    const unsigned char *run = p;
+    char esc[6];
+
+    append(w, "\"", 1);
+    for (; *p; p++) {
+        if (*p >= 0x20 && *p != '"' && *p != '\\')
+            continue;
+        // copy the plain bytes in one go
+        append(w, (const char *) run, p - run);
+        run = p + 1;
+        switch (*p) {
+            case '"': append(w, "\\\"", 2); break;
+            case '\\': append(w, "\\\\", 2); break;
+            case '\b': append(w, "\\b", 2); break;
+            case '\f': append(w, "\\f", 2); break;
+            case '\n': append(w, "\\n", 2); break;
+            case '\r': append(w, "\\r", 2); break;
+            case '\t': append(w, "\\t", 2); break;
+            default:
+                memcpy(esc, "\\u00", 4);
+                esc[4] = hex[*p >> 4];
+                esc[5] = hex[*p & 0xf];
+                append(w, esc, 6);
+        }
+    }
+    append(w, (const char *) run, p - run);
+    append(w, "\"", 1);
+}
+
+void fm_json_init(fm_json_t *w)
+{
+    memset(w, 0, sizeof(fm_json_t));
+}
+
+void fm_json_free(fm_json_t *w)
+{
+    free(w->buf);
+    fm_json_init(w);
+}
+
+void fm_json_reset(fm_json_t *w)
+{
+    w->len = 0;
+    w->depth = 0;
+    w->after_key = 0;
+    if (w->buf)
+        w->buf[0] = '\0';
+}
+
+void fm_json_object(fm_json_t *w)
+{
+    open_level(w, '{');
+}
+
+void fm_json_object_end(fm_json_t *w)
+{
+    close_level(w, '}');
+}
+
+void fm_json_array(fm_json_t *w)
+{
+    open_level(w, '[');
+}
+
+void fm_json_array_end(fm_json_t *w)
+{
+    close_level(w, ']');
+}
+
+void fm_json_key(fm_json_t *w, const char *key)
+{
+    separate(w);
+    escape(w, key);
+    append(w, ":", 1);
+    w->after_key = 1;
+}
+
+void fm_json_str(fm_json_t *w, const char *s)
+{
+    separate(w);
+    escape(w, s ? s : "");
+}
+
+void fm_json_int(fm_json_t *w, long long v)
+{
+    separate(w);
+    reserve(w, 24);
+    w->len += sprintf(w->buf + w->len, "%lld", v);
+}
+
+void fm_json_double(fm_json_t *w, double v, int precision)
+{
+    separate(w);
+    reserve(w, 32);
+    // JSON has no room for inf or nan, and nothing reported comes anywhere near this
+    if (v != v || v > 1e15 || v < -1e15)
+        v = 0;
+    w->len += snprintf(w->buf + w->len, 32, "%.*f", precision, v);
+}
+
+void fm_json_raw(fm_json_t *w, const char *json, size_t len)
+{
+    separate(w);
+    append(w, json, len);
+}
+
+void fm_json_text(fm_json_t *w, const char *s, size_t len)
+{
+    append(w, s, len);
+}
+
+void fm_json_kstr(fm_json_t *w, const char *key, const char *s)
+{
+    fm_json_key(w, key);
+    fm_json_str(w, s);
+}
+
+void fm_json_kint(fm_json_t *w, const char *key, long long v)
+{
+    fm_json_key(w, key);
+    fm_json_int(w, v);
+}
+
+void fm_json_kdouble(fm_json_t *w, const char *key, double v, int precision)
+{
+    fm_json_key(w, key);
+    fm_json_double(w, v, precision);
+}
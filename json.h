@@ -0,0 +1,45 @@
+#ifndef _FM_JSON_H_
+#define _FM_JSON_H_
+
+#include <stddef.h>
+
+// how deep objects and arrays can be nested
+#define JSON_MAX_DEPTH 8
+
+// writes JSON into a buffer that grows as needed and is kept across resets, so a writer that is reused stops allocating
+// the commas between members are taken care of; the buffer is always NUL-terminated
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int depth;
+    // whether something has been written at each level already
+    unsigned char filled[JSON_MAX_DEPTH];
+    // a key has just been written and its value follows
+    int after_key;
+} fm_json_t;
+
+void fm_json_init(fm_json_t *w);
+void fm_json_free(fm_json_t *w);
+// start over, keeping the buffer
+void fm_json_reset(fm_json_t *w);
+
+void fm_json_object(fm_json_t *w);
+void fm_json_object_end(fm_json_t *w);
+void fm_json_array(fm_json_t *w);
+void fm_json_array_end(fm_json_t *w);
+void fm_json_key(fm_json_t *w, const char *key);
+// escaped as RFC 8259 requires; UTF-8 passes through as it is
+void fm_json_str(fm_json_t *w, const char *s);
+void fm_json_int(fm_json_t *w, long long v);
+void fm_json_double(fm_json_t *w, double v, int precision);
+// a value that is JSON already
+void fm_json_raw(fm_json_t *w, const char *json, size_t len);
+// plain text, for the few responses that are not JSON at all
+void fm_json_text(fm_json_t *w, const char *s, size_t len);
+
+void fm_json_kstr(fm_json_t *w, const char *key, const char *s);
+void fm_json_kint(fm_json_t *w, const char *key, long long v);
+void fm_json_kdouble(fm_json_t *w, const char *key, double v, int precision);
+
+#endif
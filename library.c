@@ -0,0 +1,1219 @@
+#include "library.h"
+#include "logger.h"
+
+#include <libavformat/avformat.h>
+#include <libavutil/dict.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <poll.h>
+#include <errno.h>
+
+#define LOG_MODULE lmLibrary
+
+#define DIRENT_BUF_SIZE 32768
+#define HASH_EMPTY 0
+#define HASH_TOMBSTONE UINT32_MAX
+#define HASH_MIN_SIZE 1024
+// string offsets with this bit set point into the in-memory string table instead of the mapped one
+#define STR_OVERLAY 0x80000000u
+// new files are picked up once they are closed after writing (or moved in), never on creation
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ONLYDIR)
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// the state shared by all the tasks of one scan
+typedef struct {
+    fm_library_t *lib;
+    task_pool_t *pool;
+    task_group_t group;
+    time_t now;
+    // the records that existed before the scan and were found unchanged
+    uint8_t *seen;
+    uint32_t nseen;
+    // the directories that existed before the scan and need to be listed again
+    uint8_t *changed;
+    uint32_t nchanged;
+} scan_ctx_t;
+
+typedef struct {
+    scan_ctx_t *ctx;
+    uint32_t dir;
+    int64_t mtime;
+    int64_t size;
+    char path[256];
+} scan_task_t;
+
+typedef const char *(*hash_key_fun)(fm_library_t *lib, uint32_t id);
+
+static const char *audio_exts[] = { "mp3", "m4a" };
+
+static const char *audio_ext(const char *name)
+{
+    const char *dot = strrchr(name, '.');
+    int i;
+    if (!dot)
+        return NULL;
+    for (i = 0; i < sizeof(audio_exts) / sizeof(audio_exts[0]); i++) {
+        if (strcasecmp(dot + 1, audio_exts[i]) == 0)
+            return audio_exts[i];
+    }
+    return NULL;
+}
+
+static int64_t stat_mtime(struct stat *st)
+{
+    return (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+//// records and strings
+
+static const char *lib_str(fm_library_t *lib, uint32_t off)
+{
+    return off & STR_OVERLAY ? lib->strtab + (off & ~STR_OVERLAY) : lib->base_strtab + off;
+}
+
+static const fm_library_record_t *lib_record(fm_library_t *lib, uint32_t id)
+{
+    return id < lib->nbase ? &lib->base[id] : &lib->records[id - lib->nbase];
+}
+
+static uint32_t lib_total(fm_library_t *lib)
+{
+    return lib->nbase + lib->nrecords;
+}
+
+static const char *record_key(fm_library_t *lib, uint32_t id)
+{
+    return lib_str(lib, lib_record(lib, id)->path);
+}
+
+static const char *dir_key(fm_library_t *lib, uint32_t id)
+{
+    return lib->dirs[id].path;
+}
+
+static uint32_t strtab_add(char **tab, uint32_t *size, uint32_t *capacity, const char *str)
+{
+    uint32_t len = strlen(str) + 1;
+    uint32_t off = *size;
+    if (*size + len > *capacity) {
+        while (*size + len > *capacity)
+            *capacity = *capacity ? *capacity * 2 : 65536;
+        *tab = (char *) realloc(*tab, *capacity);
+    }
+    memcpy(*tab + off, str, len);
+    *size += len;
+    return off;
+}
+
+static void record_to_song(fm_library_t *lib, const fm_library_record_t *r, fm_song_t *song)
+{
+    snprintf(song->filepath, sizeof(song->filepath), "%s", lib_str(lib, r->path));
+    snprintf(song->title, sizeof(song->title), "%s", lib_str(lib, r->title));
+    snprintf(song->artist, sizeof(song->artist), "%s", lib_str(lib, r->artist));
+    snprintf(song->album, sizeof(song->album), "%s", lib_str(lib, r->album));
+    snprintf(song->url, sizeof(song->url), "%s", lib_str(lib, r->url));
+    snprintf(song->ext, sizeof(song->ext), "%.3s", r->ext);
+    snprintf(song->kbps, sizeof(song->kbps), "%d", r->kbps);
+    song->pubdate = r->pubdate;
+    song->length = r->length;
+}
+
+//// path hashes
+
+static uint32_t hash_str(const char *str)
+{
+    uint32_t h = 2166136261u;
+    while (*str) {
+        h ^= (unsigned char) *str++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void hash_clear(fm_library_hash_t *h)
+{
+    free(h->slots);
+    h->slots = NULL;
+    h->size = h->used = 0;
+}
+
+static void hash_put(fm_library_t *lib, fm_library_hash_t *h, hash_key_fun key, uint32_t id);
+
+static void hash_grow(fm_library_t *lib, fm_library_hash_t *h, hash_key_fun key)
+{
+    uint32_t *old = h->slots;
+    uint32_t old_size = h->size, live = 0, i;
+    for (i = 0; i < old_size; i++) {
+        if (old[i] != HASH_EMPTY && old[i] != HASH_TOMBSTONE)
+            live++;
+    }
+    // dropping the tombstones may be enough; otherwise keep the load under a quarter
+    h->size = HASH_MIN_SIZE;
+    while (h->size < live * 4)
+        h->size *= 2;
+    h->slots = (uint32_t *) calloc(h->size, sizeof(uint32_t));
+    h->used = 0;
+    for (i = 0; i < old_size; i++) {
+        if (old[i] != HASH_EMPTY && old[i] != HASH_TOMBSTONE)
+            hash_put(lib, h, key, old[i] - 1);
+    }
+    free(old);
+}
+
+static void hash_put(fm_library_t *lib, fm_library_hash_t *h, hash_key_fun key, uint32_t id)
+{
+    uint32_t i;
+    if ((h->used + 1) * 2 > h->size)
+        hash_grow(lib, h, key);
+    i = hash_str(key(lib, id)) & (h->size - 1);
+    while (h->slots[i] != HASH_EMPTY && h->slots[i] != HASH_TOMBSTONE)
+        i = (i + 1) & (h->size - 1);
+    if (h->slots[i] == HASH_EMPTY)
+        h->used++;
+    h->slots[i] = id + 1;
+}
+
+static int64_t hash_find(fm_library_t *lib, fm_library_hash_t *h, hash_key_fun key, const char *path)
+{
+    uint32_t i;
+    if (h->size == 0)
+        return -1;
+    i = hash_str(path) & (h->size - 1);
+    while (h->slots[i] != HASH_EMPTY) {
+        if (h->slots[i] != HASH_TOMBSTONE && strcmp(key(lib, h->slots[i] - 1), path) == 0)
+            return h->slots[i] - 1;
+        i = (i + 1) & (h->size - 1);
+    }
+    return -1;
+}
+
+static void hash_del(fm_library_t *lib, fm_library_hash_t *h, hash_key_fun key, uint32_t id)
+{
+    uint32_t i;
+    if (h->size == 0)
+        return;
+    i = hash_str(key(lib, id)) & (h->size - 1);
+    while (h->slots[i] != HASH_EMPTY) {
+        if (h->slots[i] == id + 1) {
+            h->slots[i] = HASH_TOMBSTONE;
+            return;
+        }
+        i = (i + 1) & (h->size - 1);
+    }
+}
+
+//// mutations; all of them expect the library mutex to be held
+
+static uint32_t library_add_dir(fm_library_t *lib, const char *path, int64_t mtime)
+{
+    if (lib->ndirs == lib->dirs_capacity) {
+        lib->dirs_capacity = lib->dirs_capacity ? lib->dirs_capacity * 2 : 256;
+        lib->dirs = (fm_library_dir_t *) realloc(lib->dirs, lib->dirs_capacity * sizeof(fm_library_dir_t));
+    }
+    fm_library_dir_t *d = &lib->dirs[lib->ndirs];
+    d->path = strdup(path);
+    d->mtime = mtime;
+    d->deleted = 0;
+    hash_put(lib, &lib->dir_paths, dir_key, lib->ndirs);
+    lib->dirty = 1;
+    return lib->ndirs++;
+}
+
+static void library_delete_dir(fm_library_t *lib, uint32_t id)
+{
+    if (!lib->dirs[id].deleted) {
+        hash_del(lib, &lib->dir_paths, dir_key, id);
+        lib->dirs[id].deleted = 1;
+        lib->dirty = 1;
+    }
+}
+
+static uint32_t library_add(fm_library_t *lib, fm_song_t *song, uint32_t dir, int64_t mtime, int64_t size)
+{
+    uint32_t id = lib_total(lib);
+    if (lib->nrecords == lib->records_capacity) {
+        lib->records_capacity = lib->records_capacity ? lib->records_capacity * 2 : 256;
+        lib->records = (fm_library_record_t *) realloc(lib->records, lib->records_capacity * sizeof(fm_library_record_t));
+        lib->deleted = (uint8_t *) realloc(lib->deleted, lib->nbase + lib->records_capacity);
+        lib->order = (uint32_t *) realloc(lib->order, (lib->nbase + lib->records_capacity) * sizeof(uint32_t));
+        lib->order_pos = (uint32_t *) realloc(lib->order_pos, (lib->nbase + lib->records_capacity) * sizeof(uint32_t));
+    }
+    fm_library_record_t *r = &lib->records[lib->nrecords++];
+    r->path = strtab_add(&lib->strtab, &lib->strtab_size, &lib->strtab_capacity, song->filepath) | STR_OVERLAY;
+    r->title = strtab_add(&lib->strtab, &lib->strtab_size, &lib->strtab_capacity, song->title) | STR_OVERLAY;
+    r->artist = strtab_add(&lib->strtab, &lib->strtab_size, &lib->strtab_capacity, song->artist) | STR_OVERLAY;
+    r->album = strtab_add(&lib->strtab, &lib->strtab_size, &lib->strtab_capacity, song->album) | STR_OVERLAY;
+    r->url = strtab_add(&lib->strtab, &lib->strtab_size, &lib->strtab_capacity, song->url) | STR_OVERLAY;
+    r->dir = dir;
+    r->mtime = mtime;
+    r->size = size;
+    r->pubdate = song->pubdate;
+    r->length = song->length;
+    r->kbps = atoi(song->kbps);
+    memset(r->ext, 0, sizeof(r->ext));
+    strncpy(r->ext, song->ext, sizeof(r->ext) - 1);
+    lib->deleted[id] = 0;
+    lib->nlive++;
+    // a new song joins the part of the round still to come
+    lib->order[lib->norder] = id;
+    lib->order_pos[id] = lib->norder++;
+    hash_put(lib, &lib->paths, record_key, id);
+    lib->dirty = 1;
+    return id;
+}
+
+static void order_move(fm_library_t *lib, uint32_t from, uint32_t to)
+{
+    lib->order[to] = lib->order[from];
+    lib->order_pos[lib->order[to]] = to;
+}
+
+static void order_swap(fm_library_t *lib, uint32_t a, uint32_t b)
+{
+    uint32_t id = lib->order[a];
+    order_move(lib, b, a);
+    lib->order[b] = id;
+    lib->order_pos[id] = b;
+}
+
+// take a record out of the shuffle order without disturbing the rest of it
+static void order_remove(fm_library_t *lib, uint32_t id)
+{
+    uint32_t p = lib->order_pos[id];
+    if (p < lib->cursor) {
+        // fill the hole with the last drawn song so that the drawn ones stay in front
+        order_move(lib, lib->cursor - 1, p);
+        p = --lib->cursor;
+    }
+    order_move(lib, lib->norder - 1, p);
+    lib->norder--;
+}
+
+static void library_delete(fm_library_t *lib, uint32_t id)
+{
+    if (!lib->deleted[id]) {
+        order_remove(lib, id);
+        hash_del(lib, &lib->paths, record_key, id);
+        lib->deleted[id] = 1;
+        lib->nlive--;
+        lib->dirty = 1;
+    }
+}
+
+//// the index file
+
+static void library_release(fm_library_t *lib)
+{
+    uint32_t i;
+    if (lib->map)
+        munmap(lib->map, lib->map_size);
+    lib->map = NULL;
+    lib->map_size = 0;
+    lib->base = NULL;
+    lib->nbase = 0;
+    lib->base_strtab = NULL;
+    free(lib->records);
+    lib->records = NULL;
+    lib->nrecords = lib->records_capacity = 0;
+    free(lib->strtab);
+    lib->strtab = NULL;
+    lib->strtab_size = lib->strtab_capacity = 0;
+    free(lib->deleted);
+    lib->deleted = NULL;
+    lib->nlive = 0;
+    free(lib->order);
+    free(lib->order_pos);
+    lib->order = lib->order_pos = NULL;
+    lib->norder = lib->cursor = 0;
+    for (i = 0; i < lib->ndirs; i++) {
+        free(lib->dirs[i].path);
+    }
+    free(lib->dirs);
+    lib->dirs = NULL;
+    lib->ndirs = lib->dirs_capacity = 0;
+    hash_clear(&lib->paths);
+    hash_clear(&lib->dir_paths);
+    lib->dirty = 0;
+}
+
+// map the index for lib->music_dir; leave the library empty if there is none or it does not check out
+static void library_load(fm_library_t *lib)
+{
+    struct stat st;
+    const fm_library_header_t *h;
+    const fm_library_dir_record_t *dirs;
+    const uint32_t *order;
+    uint32_t i, strtab_size;
+    void *map;
+    int fd;
+
+    if ((fd = open(lib->index_path, O_RDONLY | O_CLOEXEC)) < 0)
+        return;
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(fm_library_header_t)) {
+        close(fd);
+        return;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fm_log_error("Unable to map %s: %s", lib->index_path, strerror(errno));
+        return;
+    }
+    h = (const fm_library_header_t *) map;
+    strtab_size = h->strtab_size;
+    if (h->magic != LIBRARY_INDEX_MAGIC || h->version != LIBRARY_INDEX_VERSION ||
+            st.st_size != sizeof(fm_library_header_t) + (uint64_t) h->nrecords * sizeof(fm_library_record_t) +
+            (uint64_t) h->ndirs * sizeof(fm_library_dir_record_t) + (uint64_t) h->nrecords * sizeof(uint32_t) + strtab_size ||
+            strtab_size == 0 || h->root >= strtab_size || ((const char *) map)[st.st_size - 1] != '\0') {
+        fm_log_warn("Ignoring malformed or outdated index %s", lib->index_path);
+        munmap(map, st.st_size);
+        return;
+    }
+    lib->map = map;
+    lib->map_size = st.st_size;
+    lib->base = (const fm_library_record_t *) (h + 1);
+    dirs = (const fm_library_dir_record_t *) (lib->base + h->nrecords);
+    order = (const uint32_t *) (dirs + h->ndirs);
+    lib->base_strtab = (const char *) (order + h->nrecords);
+    if (strcmp(lib->base_strtab + h->root, lib->music_dir) != 0) {
+        fm_log_info("Index was built for %s; starting over", lib->base_strtab + h->root);
+        library_release(lib);
+        return;
+    }
+    for (i = 0; i < h->ndirs; i++) {
+        if (dirs[i].path >= strtab_size)
+            break;
+        library_add_dir(lib, lib->base_strtab + dirs[i].path, dirs[i].mtime);
+    }
+    for (i = 0; i < h->nrecords; i++) {
+        const fm_library_record_t *r = &lib->base[i];
+        if (r->path >= strtab_size || r->title >= strtab_size || r->artist >= strtab_size ||
+                r->album >= strtab_size || r->url >= strtab_size || r->dir >= lib->ndirs)
+            break;
+    }
+    if (lib->ndirs != h->ndirs || i != h->nrecords) {
+        fm_log_warn("Index %s has out of range entries; starting over", lib->index_path);
+        library_release(lib);
+        return;
+    }
+    lib->nbase = h->nrecords;
+    lib->deleted = (uint8_t *) calloc(lib->nbase + 1, 1);
+    lib->nlive = lib->nbase;
+    // the order is copied out since it changes with every draw
+    lib->order = (uint32_t *) malloc((lib->nbase + 1) * sizeof(uint32_t));
+    lib->order_pos = (uint32_t *) malloc((lib->nbase + 1) * sizeof(uint32_t));
+    memset(lib->order_pos, 0xff, (lib->nbase + 1) * sizeof(uint32_t));
+    for (i = 0; i < lib->nbase && order[i] < lib->nbase && lib->order_pos[order[i]] == UINT32_MAX; i++) {
+        lib->order[i] = order[i];
+        lib->order_pos[order[i]] = i;
+    }
+    lib->norder = lib->nbase;
+    lib->cursor = h->cursor;
+    if (i != lib->nbase || lib->cursor > lib->norder) {
+        // not a permutation; any order is a valid start for a fresh round since the rest is drawn at random
+        fm_log_warn("Index %s has a broken shuffle order; starting a new round", lib->index_path);
+        for (i = 0; i < lib->nbase; i++) {
+            lib->order[i] = lib->order_pos[i] = i;
+        }
+        lib->cursor = 0;
+    }
+    for (i = 0; i < lib->nbase; i++) {
+        hash_put(lib, &lib->paths, record_key, i);
+    }
+    lib->dirty = 0;
+    fm_log_info("Mapped index %s with %d songs in %d directories", lib->index_path, lib->nbase, lib->ndirs);
+}
+
+// write the live records to a new index and map it; expects the mutex to be held
+static int library_write(fm_library_t *lib)
+{
+    fm_library_header_t h;
+    fm_library_record_t *records;
+    fm_library_dir_record_t *dirs;
+    uint32_t *dir_remap, *record_remap, *order;
+    char *strtab = NULL;
+    uint32_t strtab_size = 0, strtab_capacity = 0;
+    uint32_t i, n = 0, nd = 0, no, total = lib_total(lib);
+    char tmp_path[272];
+    FILE *f;
+    int ret = 0;
+
+    records = (fm_library_record_t *) malloc((lib->nlive + 1) * sizeof(fm_library_record_t));
+    dirs = (fm_library_dir_record_t *) malloc((lib->ndirs + 1) * sizeof(fm_library_dir_record_t));
+    dir_remap = (uint32_t *) malloc((lib->ndirs + 1) * sizeof(uint32_t));
+    record_remap = (uint32_t *) malloc((total + 1) * sizeof(uint32_t));
+    order = (uint32_t *) malloc((lib->norder + 1) * sizeof(uint32_t));
+
+    h.magic = LIBRARY_INDEX_MAGIC;
+    h.version = LIBRARY_INDEX_VERSION;
+    h.root = strtab_add(&strtab, &strtab_size, &strtab_capacity, lib->music_dir);
+    h.cursor = 0;
+    h.reserved = 0;
+    h.created = time(NULL);
+    for (i = 0; i < lib->ndirs; i++) {
+        if (lib->dirs[i].deleted)
+            continue;
+        dir_remap[i] = nd;
+        dirs[nd].path = strtab_add(&strtab, &strtab_size, &strtab_capacity, lib->dirs[i].path);
+        dirs[nd].reserved = 0;
+        dirs[nd].mtime = lib->dirs[i].mtime;
+        nd++;
+    }
+    for (i = 0; i < total; i++) {
+        const fm_library_record_t *r = lib_record(lib, i);
+        record_remap[i] = UINT32_MAX;
+        if (lib->deleted[i] || lib->dirs[r->dir].deleted)
+            continue;
+        record_remap[i] = n;
+        records[n] = *r;
+        records[n].path = strtab_add(&strtab, &strtab_size, &strtab_capacity, lib_str(lib, r->path));
+        records[n].title = strtab_add(&strtab, &strtab_size, &strtab_capacity, lib_str(lib, r->title));
+        records[n].artist = strtab_add(&strtab, &strtab_size, &strtab_capacity, lib_str(lib, r->artist));
+        records[n].album = strtab_add(&strtab, &strtab_size, &strtab_capacity, lib_str(lib, r->album));
+        records[n].url = strtab_add(&strtab, &strtab_size, &strtab_capacity, lib_str(lib, r->url));
+        records[n].dir = dir_remap[r->dir];
+        n++;
+    }
+    // the compacted order keeps the drawn songs in front
+    for (i = 0, no = 0; i < lib->norder; i++) {
+        if (record_remap[lib->order[i]] == UINT32_MAX)
+            continue;
+        order[no++] = record_remap[lib->order[i]];
+        if (i < lib->cursor)
+            h.cursor++;
+    }
+    h.nrecords = n;
+    h.ndirs = nd;
+    h.strtab_size = strtab_size;
+
+    // write a new file and rename it over the old one so that readers never see a partial index
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", lib->index_path);
+    if ((f = fopen(tmp_path, "w")) == NULL ||
+            fwrite(&h, sizeof(h), 1, f) != 1 ||
+            fwrite(records, sizeof(fm_library_record_t), n, f) != n ||
+            fwrite(dirs, sizeof(fm_library_dir_record_t), nd, f) != nd ||
+            fwrite(order, sizeof(uint32_t), no, f) != no ||
+            fwrite(strtab, 1, strtab_size, f) != strtab_size) {
+        fm_log_error("Unable to write %s: %s", tmp_path, strerror(errno));
+        ret = -1;
+    }
+    if (f && fclose(f) != 0)
+        ret = -1;
+    if (ret == 0 && rename(tmp_path, lib->index_path) != 0) {
+        fm_log_error("Unable to rename %s: %s", tmp_path, strerror(errno));
+        ret = -1;
+    }
+    free(records);
+    free(dirs);
+    free(dir_remap);
+    free(record_remap);
+    free(order);
+    free(strtab);
+
+    if (ret == 0) {
+        fm_log_info("Wrote index with %d songs in %d directories", n, nd);
+        library_release(lib);
+        library_load(lib);
+    } else {
+        unlink(tmp_path);
+    }
+    return ret;
+}
+
+//// scanning
+
+static int dict_copy(AVDictionary *metadata, const char *key, char *dst, size_t size)
+{
+    AVDictionaryEntry *e = av_dict_get(metadata, key, NULL, 0);
+    if (!e || !e->value || e->value[0] == '\0')
+        return -1;
+    strncpy(dst, e->value, size - 1);
+    dst[size - 1] = '\0';
+    return 0;
+}
+
+// read the tags with libavformat; only the container is opened, no decoder is involved
+static int read_tags(fm_song_t *song)
+{
+    AVFormatContext *fc = NULL;
+    char buf[128];
+
+    if (avformat_open_input(&fc, song->filepath, NULL, NULL) < 0) {
+        fm_log_error("Unable to open %s", song->filepath);
+        return -1;
+    }
+    dict_copy(fc->metadata, "title", song->title, sizeof(song->title));
+    dict_copy(fc->metadata, "artist", song->artist, sizeof(song->artist));
+    dict_copy(fc->metadata, "album", song->album, sizeof(song->album));
+    if (dict_copy(fc->metadata, "date", buf, sizeof(buf)) == 0)
+        song->pubdate = atoi(buf);
+    // the page url is stored in WORS by mutagen; the archiver keeps it as a url (or comment) tag
+    if (dict_copy(fc->metadata, "url", song->url, sizeof(song->url)) != 0 &&
+            dict_copy(fc->metadata, "WORS", song->url, sizeof(song->url)) != 0 &&
+            (dict_copy(fc->metadata, "comment", song->url, sizeof(song->url)) != 0 || strncmp(song->url, "http", 4) != 0))
+        song->url[0] = '\0';
+    if (fc->duration != AV_NOPTS_VALUE)
+        song->length = fc->duration / AV_TIME_BASE;
+    if (fc->bit_rate > 0)
+        snprintf(song->kbps, sizeof(song->kbps), "%d", (int) (fc->bit_rate / 1000));
+    avformat_close_input(&fc);
+
+    // fall back to the artist/title.ext layout used when archiving
+    char path[256], *name;
+    strcpy(path, song->filepath);
+    name = strrchr(path, '/');
+    if (name && song->title[0] == '\0') {
+        strncpy(song->title, name + 1, sizeof(song->title) - 1);
+        char *dot = strrchr(song->title, '.');
+        if (dot)
+            *dot = '\0';
+    }
+    if (name && song->artist[0] == '\0') {
+        *name = '\0';
+        name = strrchr(path, '/');
+        strncpy(song->artist, name ? name + 1 : path, sizeof(song->artist) - 1);
+    }
+    return 0;
+}
+
+static void scan_submit(scan_ctx_t *ctx, task_fun_t fun, uint32_t dir, const char *path, int64_t mtime, int64_t size)
+{
+    scan_task_t *task = (scan_task_t *) malloc(sizeof(scan_task_t));
+    task->ctx = ctx;
+    task->dir = dir;
+    task->mtime = mtime;
+    task->size = size;
+    strcpy(task->path, path);
+    task_pool_submit(ctx->pool, &ctx->group, fun, task);
+}
+
+static void scan_file(void *arg)
+{
+    scan_task_t *task = (scan_task_t *) arg;
+    fm_library_t *lib = task->ctx->lib;
+    fm_song_t song;
+    int64_t old;
+
+    memset(&song, 0, sizeof(song));
+    strcpy(song.filepath, task->path);
+    strcpy(song.ext, audio_ext(task->path));
+    if (read_tags(&song) == 0) {
+        pthread_mutex_lock(&lib->mutex);
+        if ((old = hash_find(lib, &lib->paths, record_key, task->path)) >= 0)
+            library_delete(lib, old);
+        library_add(lib, &song, task->dir, task->mtime, task->size);
+        pthread_mutex_unlock(&lib->mutex);
+    }
+    free(task);
+}
+
+// list a directory that is new or changed since the index was written
+static void scan_dir(void *arg)
+{
+    scan_task_t *task = (scan_task_t *) arg;
+    scan_ctx_t *ctx = task->ctx;
+    fm_library_t *lib = ctx->lib;
+    char buf[DIRENT_BUF_SIZE];
+    char path[256];
+    struct stat st;
+    int64_t dir_mtime, id;
+    long n, off;
+    int fd, young = 0;
+
+    fd = openat(AT_FDCWD, task->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fm_log_error("Unable to open %s: %s", task->path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        free(task);
+        return;
+    }
+    // taken before listing so that anything changing in the meantime is picked up next time
+    dir_mtime = stat_mtime(&st);
+    while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+        for (off = 0; off < n; ) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *) (buf + off);
+            unsigned char type = d->d_type;
+            off += d->d_reclen;
+            if (d->d_name[0] == '.')
+                continue;
+            if (snprintf(path, sizeof(path), "%s/%s", task->path, d->d_name) >= sizeof(path)) {
+                fm_log_warn("Path too long under %s", task->path);
+                continue;
+            }
+            if (type == DT_UNKNOWN) {
+                if (fstatat(fd, d->d_name, &st, 0) != 0)
+                    continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : (S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN);
+            }
+            if (type == DT_DIR) {
+                // known subdirectories are revalidated on their own
+                pthread_mutex_lock(&lib->mutex);
+                if (hash_find(lib, &lib->dir_paths, dir_key, path) < 0) {
+                    uint32_t sub = library_add_dir(lib, path, 0);
+                    pthread_mutex_unlock(&lib->mutex);
+                    scan_submit(ctx, scan_dir, sub, path, 0, 0);
+                } else
+                    pthread_mutex_unlock(&lib->mutex);
+            } else if (type == DT_REG && audio_ext(d->d_name) && fstatat(fd, d->d_name, &st, 0) == 0) {
+                if (ctx->now - st.st_mtime < LIBRARY_MIN_AGE) {
+                    young = 1;
+                    continue;
+                }
+                pthread_mutex_lock(&lib->mutex);
+                id = hash_find(lib, &lib->paths, record_key, path);
+                if (id >= 0 && lib_record(lib, id)->mtime == stat_mtime(&st) && lib_record(lib, id)->size == st.st_size) {
+                    if (id < ctx->nseen)
+                        ctx->seen[id] = 1;
+                    id = -2;
+                }
+                pthread_mutex_unlock(&lib->mutex);
+                if (id != -2)
+                    scan_submit(ctx, scan_file, task->dir, path, stat_mtime(&st), st.st_size);
+            }
+        }
+    }
+    close(fd);
+    pthread_mutex_lock(&lib->mutex);
+    // a directory holding files too young to be indexed has to be listed again next time
+    lib->dirs[task->dir].mtime = young ? 0 : dir_mtime;
+    lib->dirty = 1;
+    pthread_mutex_unlock(&lib->mutex);
+    free(task);
+}
+
+//// watching
+
+typedef struct {
+    char path[256];
+    int64_t due;
+} watch_pending_t;
+
+static int64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// (re)read a single file and put it in the library in place of any older record for the same path
+static void watch_update_file(fm_library_t *lib, const char *path)
+{
+    fm_song_t song;
+    struct stat st;
+    char dir[256], *slash;
+    int64_t id;
+
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+        return;
+    memset(&song, 0, sizeof(song));
+    strcpy(song.filepath, path);
+    strcpy(song.ext, audio_ext(path));
+    if (read_tags(&song) != 0)
+        return;
+    strcpy(dir, path);
+    slash = strrchr(dir, '/');
+    *slash = '\0';
+
+    pthread_mutex_lock(&lib->mutex);
+    if ((id = hash_find(lib, &lib->paths, record_key, path)) >= 0)
+        library_delete(lib, id);
+    // a zero mtime makes the next startup list the directory again instead of trusting the index
+    if ((id = hash_find(lib, &lib->dir_paths, dir_key, dir)) < 0)
+        id = library_add_dir(lib, dir, 0);
+    else
+        lib->dirs[id].mtime = 0;
+    library_add(lib, &song, id, stat_mtime(&st), st.st_size);
+    pthread_mutex_unlock(&lib->mutex);
+    fm_log_debug("Updated %s", path);
+}
+
+// forget about a directory and everything below it
+static void watch_remove_tree(fm_library_t *lib, const char *path)
+{
+    size_t len = strlen(path);
+    uint32_t i, total;
+    const char *p;
+
+    pthread_mutex_lock(&lib->mutex);
+    for (i = 0; i < lib->ndirs; i++) {
+        p = lib->dirs[i].path;
+        if (!lib->dirs[i].deleted && strncmp(p, path, len) == 0 && (p[len] == '\0' || p[len] == '/'))
+            library_delete_dir(lib, i);
+    }
+    total = lib_total(lib);
+    for (i = 0; i < total; i++) {
+        if (lib->deleted[i])
+            continue;
+        p = lib_str(lib, lib_record(lib, i)->path);
+        if (strncmp(p, path, len) == 0 && p[len] == '/')
+            library_delete(lib, i);
+    }
+    pthread_mutex_unlock(&lib->mutex);
+    fm_log_debug("Removed %s", path);
+}
+
+static void watch_unwatch_tree(fm_library_t *lib, const char *path)
+{
+    size_t len = strlen(path);
+    int i;
+    for (i = 0; i < lib->watch_paths_capacity; i++) {
+        const char *p = lib->watch_paths[i];
+        if (p && strncmp(p, path, len) == 0 && (p[len] == '\0' || p[len] == '/'))
+            // the path itself is freed once IN_IGNORED comes through
+            inotify_rm_watch(lib->watch_fd, i);
+    }
+}
+
+// watch a directory; a directory that appeared while running is also listed (recursively) since files may have been
+// moved in together with it or written before the watch was in place
+static void watch_dir(fm_library_t *lib, const char *path, int list)
+{
+    char sub[256];
+    struct dirent *e;
+    struct stat st;
+    DIR *d;
+    int wd;
+
+    if ((wd = inotify_add_watch(lib->watch_fd, path, WATCH_MASK)) < 0) {
+        if (errno == ENOSPC)
+            fm_log_warn("Out of inotify watches (see fs.inotify.max_user_watches), not watching %s", path);
+        else
+            fm_log_error("Unable to watch %s: %s", path, strerror(errno));
+        return;
+    }
+    if (wd >= lib->watch_paths_capacity) {
+        int n = lib->watch_paths_capacity ? lib->watch_paths_capacity : 256;
+        while (n <= wd)
+            n *= 2;
+        lib->watch_paths = (char **) realloc(lib->watch_paths, n * sizeof(char *));
+        memset(lib->watch_paths + lib->watch_paths_capacity, 0, (n - lib->watch_paths_capacity) * sizeof(char *));
+        lib->watch_paths_capacity = n;
+    }
+    free(lib->watch_paths[wd]);
+    lib->watch_paths[wd] = strdup(path);
+    if (!list)
+        return;
+
+    pthread_mutex_lock(&lib->mutex);
+    if (hash_find(lib, &lib->dir_paths, dir_key, path) < 0)
+        library_add_dir(lib, path, 0);
+    pthread_mutex_unlock(&lib->mutex);
+    if ((d = opendir(path)) == NULL)
+        return;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.' || snprintf(sub, sizeof(sub), "%s/%s", path, e->d_name) >= sizeof(sub))
+            continue;
+        if (stat(sub, &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode))
+            watch_dir(lib, sub, 1);
+        else if (S_ISREG(st.st_mode) && audio_ext(e->d_name))
+            watch_update_file(lib, sub);
+    }
+    closedir(d);
+}
+
+// watch every directory the library knows about
+static void watch_all(fm_library_t *lib)
+{
+    char **paths;
+    uint32_t i, n = 0;
+
+    pthread_mutex_lock(&lib->mutex);
+    paths = (char **) malloc((lib->ndirs + 1) * sizeof(char *));
+    for (i = 0; i < lib->ndirs; i++) {
+        if (!lib->dirs[i].deleted)
+            paths[n++] = strdup(lib->dirs[i].path);
+    }
+    pthread_mutex_unlock(&lib->mutex);
+    for (i = 0; i < n; i++) {
+        watch_dir(lib, paths[i], 0);
+        free(paths[i]);
+    }
+    free(paths);
+}
+
+static void pending_put(watch_pending_t **pending, int *npending, int *capacity, const char *path, int64_t due)
+{
+    int i;
+    for (i = 0; i < *npending && strcmp((*pending)[i].path, path) != 0; i++);
+    if (i == *npending) {
+        if (*npending == *capacity) {
+            *capacity = *capacity ? *capacity * 2 : 64;
+            *pending = (watch_pending_t *) realloc(*pending, *capacity * sizeof(watch_pending_t));
+        }
+        strcpy((*pending)[i].path, path);
+        (*npending)++;
+    }
+    // every further write pushes the file back
+    (*pending)[i].due = due;
+}
+
+static void pending_drop(watch_pending_t *pending, int *npending, const char *path)
+{
+    int i;
+    for (i = 0; i < *npending; i++) {
+        if (strcmp(pending[i].path, path) == 0) {
+            pending[i] = pending[--(*npending)];
+            return;
+        }
+    }
+}
+
+// runs on the rescan pool
+static void watch_rescan(void *data)
+{
+    fm_library_t *lib = (fm_library_t *) data;
+    char music_dir[128];
+    pthread_mutex_lock(&lib->mutex);
+    strcpy(music_dir, lib->music_dir);
+    pthread_mutex_unlock(&lib->mutex);
+    fm_library_scan(lib, music_dir);
+    // the directories the scan found are watched by the watcher itself
+    write(lib->watch_quit_fd[1], "r", 1);
+}
+
+static void *watch_thread(void *data)
+{
+    fm_library_t *lib = (fm_library_t *) data;
+    char buf[8192] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    char path[256], cmd;
+    struct pollfd fds[2];
+    watch_pending_t *pending = NULL;
+    int npending = 0, pending_capacity = 0;
+    int64_t now, next, save_due = 0;
+    int i, timeout, changed, rescanning = 0, rescan_again = 0;
+    ssize_t len;
+    char *p;
+
+    fds[0].fd = lib->watch_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = lib->watch_quit_fd[0];
+    fds[1].events = POLLIN;
+    while (1) {
+        now = now_ms();
+        next = save_due;
+        for (i = 0; i < npending; i++) {
+            if (next == 0 || pending[i].due < next)
+                next = pending[i].due;
+        }
+        timeout = next == 0 ? -1 : (next > now ? next - now : 0);
+        if (poll(fds, 2, timeout) < 0 && errno != EINTR) {
+            fm_log_error("Unable to wait for changes: %s", strerror(errno));
+            break;
+        }
+        if (fds[1].revents) {
+            if (read(lib->watch_quit_fd[0], &cmd, 1) != 1 || cmd == 'q')
+                break;
+            watch_all(lib);
+            rescanning = 0;
+            // more events were lost while the last rescan was running
+            if (rescan_again) {
+                rescan_again = 0;
+                rescanning = 1;
+                task_pool_submit(lib->rescan_pool, NULL, watch_rescan, lib);
+            }
+        }
+        changed = 0;
+
+        if (fds[0].revents & POLLIN) {
+            len = read(lib->watch_fd, buf, sizeof(buf));
+            for (p = buf; len > 0 && p < buf + len; ) {
+                struct inotify_event *ev = (struct inotify_event *) p;
+                p += sizeof(struct inotify_event) + ev->len;
+
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    // events were lost; fall back to a regular scan, which only lists the changed directories
+                    fm_log_warn("Inotify queue overflowed, rescanning");
+                    npending = 0;
+                    if (rescanning)
+                        rescan_again = 1;
+                    else {
+                        rescanning = 1;
+                        task_pool_submit(lib->rescan_pool, NULL, watch_rescan, lib);
+                    }
+                    continue;
+                }
+                if (ev->wd < 0 || ev->wd >= lib->watch_paths_capacity || !lib->watch_paths[ev->wd])
+                    continue;
+                if (ev->mask & IN_IGNORED) {
+                    free(lib->watch_paths[ev->wd]);
+                    lib->watch_paths[ev->wd] = NULL;
+                    continue;
+                }
+                if (ev->len == 0 || ev->name[0] == '.' ||
+                        snprintf(path, sizeof(path), "%s/%s", lib->watch_paths[ev->wd], ev->name) >= sizeof(path))
+                    continue;
+
+                if (ev->mask & IN_ISDIR) {
+                    if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+                        watch_dir(lib, path, 1);
+                    else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                        // the watches of a deleted directory go away by themselves but those of a moved one stay
+                        if (ev->mask & IN_MOVED_FROM)
+                            watch_unwatch_tree(lib, path);
+                        watch_remove_tree(lib, path);
+                    }
+                    changed = 1;
+                } else if (audio_ext(ev->name)) {
+                    if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+                        pending_put(&pending, &npending, &pending_capacity, path, now_ms() + LIBRARY_WATCH_DELAY);
+                    else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                        pending_drop(pending, &npending, path);
+                        fm_library_remove(lib, path);
+                        changed = 1;
+                    }
+                }
+            }
+        }
+
+        now = now_ms();
+        for (i = 0; i < npending; ) {
+            if (pending[i].due <= now) {
+                watch_update_file(lib, pending[i].path);
+                pending[i] = pending[--npending];
+                changed = 1;
+            } else
+                i++;
+        }
+        if (changed)
+            save_due = now + LIBRARY_WATCH_SAVE_DELAY;
+        else if (save_due && save_due <= now) {
+            fm_library_save(lib);
+            save_due = 0;
+        }
+    }
+    free(pending);
+    return lib;
+}
+
+void fm_library_init(fm_library_t *lib, const char *index_path)
+{
+    memset(lib, 0, sizeof(fm_library_t));
+    strcpy(lib->index_path, index_path);
+    lib->watch_fd = -1;
+    pthread_mutex_init(&lib->mutex, NULL);
+    srand(time(NULL));
+}
+
+void fm_library_cleanup(fm_library_t *lib)
+{
+    fm_library_unwatch(lib);
+    fm_library_save(lib);
+    library_release(lib);
+    pthread_mutex_destroy(&lib->mutex);
+}
+
+int fm_library_scan(fm_library_t *lib, const char *music_dir)
+{
+    scan_ctx_t ctx;
+    struct stat st;
+    uint32_t i, total, ndirs;
+    char **paths;
+    // the mtime of each known directory, or -1 once it is gone
+    int64_t *mtimes;
+    int n;
+
+    if (access(music_dir, R_OK | X_OK) != 0) {
+        fm_log_error("Unable to read %s: %s", music_dir, strerror(errno));
+        return -1;
+    }
+    ctx.lib = lib;
+    ctx.now = time(NULL);
+    task_group_init(&ctx.group);
+    ctx.pool = task_pool_init(LIBRARY_SCAN_THREADS, 0);
+
+    pthread_mutex_lock(&lib->mutex);
+    lib->scanning++;
+    if (strcmp(lib->music_dir, music_dir) != 0) {
+        library_release(lib);
+        strcpy(lib->music_dir, music_dir);
+        library_load(lib);
+    }
+    ctx.nseen = lib_total(lib);
+    ctx.seen = (uint8_t *) calloc(ctx.nseen + 1, 1);
+    ndirs = ctx.nchanged = lib->ndirs;
+    ctx.changed = (uint8_t *) calloc(ctx.nchanged + 1, 1);
+    paths = (char **) calloc(ndirs + 1, sizeof(char *));
+    for (i = 0; i < ndirs; i++) {
+        if (!lib->dirs[i].deleted)
+            paths[i] = strdup(lib->dirs[i].path);
+    }
+    pthread_mutex_unlock(&lib->mutex);
+
+    // a large tree takes a while to stat, and the watcher and the refills should not be held up meanwhile
+    mtimes = (int64_t *) malloc((ndirs + 1) * sizeof(int64_t));
+    for (i = 0; i < ndirs; i++) {
+        if (paths[i])
+            mtimes[i] = stat(paths[i], &st) != 0 || !S_ISDIR(st.st_mode) ? -1 : stat_mtime(&st);
+    }
+
+    pthread_mutex_lock(&lib->mutex);
+    // only the directories whose mtime moved (files added, removed or renamed) need to be listed
+    for (i = 0; i < ndirs; i++) {
+        fm_library_dir_t *d = &lib->dirs[i];
+        // the watcher may have dropped it in the meantime
+        if (!paths[i] || d->deleted)
+            continue;
+        if (mtimes[i] < 0) {
+            ctx.changed[i] = 1;
+            library_delete_dir(lib, i);
+        } else if (mtimes[i] != d->mtime) {
+            ctx.changed[i] = 1;
+            scan_submit(&ctx, scan_dir, i, d->path, 0, 0);
+        }
+    }
+    if (lib->ndirs == 0)
+        scan_submit(&ctx, scan_dir, library_add_dir(lib, music_dir, 0), music_dir, 0, 0);
+    pthread_mutex_unlock(&lib->mutex);
+    for (i = 0; i < ndirs; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+    free(mtimes);
+
+    task_group_wait(&ctx.group);
+    task_pool_free(ctx.pool);
+    task_group_destroy(&ctx.group);
+
+    pthread_mutex_lock(&lib->mutex);
+    // whatever was in a changed directory and has not been seen again is gone
+    total = ctx.nseen;
+    for (i = 0; i < total; i++) {
+        if (!lib->deleted[i] && ctx.changed[lib_record(lib, i)->dir] && !ctx.seen[i])
+            library_delete(lib, i);
+    }
+    lib->scanned = 1;
+    lib->scanning--;
+    n = lib->nlive;
+    pthread_mutex_unlock(&lib->mutex);
+    free(ctx.seen);
+    free(ctx.changed);
+
+    fm_library_save(lib);
+    fm_log_info("%d songs in %s", n, music_dir);
+    return n;
+}
+
+int fm_library_save(fm_library_t *lib)
+{
+    int ret = 0;
+    pthread_mutex_lock(&lib->mutex);
+    if (lib->dirty && !lib->scanning && lib->music_dir[0] != '\0')
+        ret = library_write(lib);
+    pthread_mutex_unlock(&lib->mutex);
+    return ret;
+}
+
+int fm_library_draw(fm_library_t *lib, fm_song_t **songs, int n)
+{
+    int i, k;
+    uint32_t id, picked[N_LOCAL_CHANNEL_FETCH];
+    if (n > N_LOCAL_CHANNEL_FETCH)
+        n = N_LOCAL_CHANNEL_FETCH;
+    pthread_mutex_lock(&lib->mutex);
+    if (n > lib->nlive)
+        n = lib->nlive;
+    if (n <= 0) {
+        pthread_mutex_unlock(&lib->mutex);
+        return 0;
+    }
+    for (i = 0; i < n; ) {
+        if (lib->cursor >= lib->norder) {
+            fm_log_info("Every song has been drawn; starting a new round");
+            lib->cursor = 0;
+            // the songs of this batch count as drawn in the new round so that it never holds the same song twice
+            for (k = 0; k < i; k++) {
+                order_swap(lib, lib->order_pos[picked[k]], lib->cursor++);
+            }
+        }
+        // one step of Fisher-Yates: pick any of the songs left in this round and move it behind the cursor
+        order_swap(lib, lib->cursor, lib->cursor + rand() % (lib->norder - lib->cursor));
+        id = lib->order[lib->cursor++];
+        if (lib->dirs[lib_record(lib, id)->dir].deleted) {
+            library_delete(lib, id);
+            if (n > lib->nlive)
+                n = lib->nlive;
+            continue;
+        }
+        picked[i] = id;
+        record_to_song(lib, lib_record(lib, id), songs[i++]);
+    }
+    // the cursor is part of the index
+    lib->dirty = 1;
+    pthread_mutex_unlock(&lib->mutex);
+    return n;
+}
+
+void fm_library_remove(fm_library_t *lib, const char *path)
+{
+    int64_t id;
+    pthread_mutex_lock(&lib->mutex);
+    if ((id = hash_find(lib, &lib->paths, record_key, path)) >= 0)
+        library_delete(lib, id);
+    pthread_mutex_unlock(&lib->mutex);
+}
+
+int fm_library_watch(fm_library_t *lib)
+{
+    if (lib->watching)
+        return 0;
+    if ((lib->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        fm_log_error("Unable to start watching: %s", strerror(errno));
+        return -1;
+    }
+    if (pipe(lib->watch_quit_fd) != 0) {
+        fm_log_error("Unable to start watching: %s", strerror(errno));
+        close(lib->watch_fd);
+        lib->watch_fd = -1;
+        return -1;
+    }
+    watch_all(lib);
+    lib->rescan_pool = task_pool_init(1, 0);
+    lib->watching = 1;
+    pthread_create(&lib->watch_thread, NULL, watch_thread, lib);
+    fm_log_info("Watching %s", lib->music_dir);
+    return 0;
+}
+
+void fm_library_unwatch(fm_library_t *lib)
+{
+    int i;
+    if (!lib->watching)
+        return;
+    write(lib->watch_quit_fd[1], "q", 1);
+    pthread_join(lib->watch_thread, NULL);
+    // waits for a rescan still running, which writes to the pipe when done
+    task_pool_free(lib->rescan_pool);
+    lib->rescan_pool = NULL;
+    close(lib->watch_quit_fd[0]);
+    close(lib->watch_quit_fd[1]);
+    close(lib->watch_fd);
+    lib->watch_fd = -1;
+    for (i = 0; i < lib->watch_paths_capacity; i++) {
+        free(lib->watch_paths[i]);
+    }
+    free(lib->watch_paths);
+    lib->watch_paths = NULL;
+    lib->watch_paths_capacity = 0;
+    lib->watching = 0;
+}
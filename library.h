@@ -0,0 +1,154 @@
+#ifndef _FM_LIBRARY_H_
+#define _FM_LIBRARY_H_
+
+#include "playlist.h"
+#include "taskpool.h"
+#include <stdint.h>
+#include <pthread.h>
+
+#define LIBRARY_SCAN_THREADS 4
+// files modified more recently than this (in seconds) are skipped since they may still be being written
+#define LIBRARY_MIN_AGE 120
+
+// how long (in ms) a written file has to stay untouched before it is read; taggers tend to close a file more than once
+#define LIBRARY_WATCH_DELAY 1000
+// how long (in ms) to wait after the last change picked up by the watcher before writing the index
+#define LIBRARY_WATCH_SAVE_DELAY 30000
+
+#define LIBRARY_INDEX_MAGIC 0x58444950
+#define LIBRARY_INDEX_VERSION 2
+
+//// the on-disk index: header, records, directories, shuffle order and then the string table
+// all the strings are stored as offsets into the string table
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nrecords;
+    uint32_t ndirs;
+    uint32_t strtab_size;
+    // the music_dir the index was built for
+    uint32_t root;
+    // the position in the shuffle order
+    uint32_t cursor;
+    uint32_t reserved;
+    int64_t created;
+} fm_library_header_t;
+
+typedef struct {
+    uint32_t path;
+    uint32_t title;
+    uint32_t artist;
+    uint32_t album;
+    uint32_t url;
+    // the index of the containing directory
+    uint32_t dir;
+    // st_mtim in nanoseconds; together with the path and size this decides whether the tags need to be read again
+    int64_t mtime;
+    int64_t size;
+    int32_t pubdate;
+    int32_t length;
+    int32_t kbps;
+    char ext[4];
+} fm_library_record_t;
+
+typedef struct {
+    uint32_t path;
+    uint32_t reserved;
+    int64_t mtime;
+} fm_library_dir_record_t;
+
+typedef struct {
+    char *path;
+    int64_t mtime;
+    int deleted;
+} fm_library_dir_t;
+
+// an open addressing table from path to record (or directory) id
+typedef struct {
+    uint32_t *slots;
+    uint32_t size;
+    uint32_t used;
+} fm_library_hash_t;
+
+// the local music library
+// records are identified by their position: the ones from the mapped index come first, followed by the ones
+// added since; removed records are only flagged until the index is written again
+typedef struct fm_library {
+    char music_dir[128];
+    char index_path[256];
+
+    // the memory mapped index
+    void *map;
+    size_t map_size;
+    const fm_library_record_t *base;
+    uint32_t nbase;
+    const char *base_strtab;
+
+    // records added since the index was mapped, with their own string table
+    fm_library_record_t *records;
+    uint32_t nrecords;
+    uint32_t records_capacity;
+    char *strtab;
+    uint32_t strtab_size;
+    uint32_t strtab_capacity;
+
+    // one flag per record id
+    uint8_t *deleted;
+    uint32_t nlive;
+
+    // the shuffle order over the live records, a Fisher-Yates permutation built lazily: order[0, cursor) has been
+    // drawn in this round and order[cursor, norder) is still to come, in no particular order
+    uint32_t *order;
+    // the position of each record id in order
+    uint32_t *order_pos;
+    uint32_t norder;
+    uint32_t cursor;
+
+    fm_library_dir_t *dirs;
+    uint32_t ndirs;
+    uint32_t dirs_capacity;
+
+    fm_library_hash_t paths;
+    fm_library_hash_t dir_paths;
+
+    // whether the library is in sync with music_dir
+    int scanned;
+    // whether there are changes not yet written to the index
+    int dirty;
+    // the number of scans in progress; the index is not rewritten while one is running since that renumbers the records
+    int scanning;
+    pthread_mutex_t mutex;
+
+    // the inotify watcher keeping the library in sync while rpd is running
+    int watching;
+    int watch_fd;
+    // written to with 'q' to stop the watcher, or with 'r' once a rescan has finished
+    int watch_quit_fd[2];
+    pthread_t watch_thread;
+    // runs the rescans after the inotify queue overflowed, so that the watcher carries on meanwhile
+    task_pool_t *rescan_pool;
+    // the directory behind each watch descriptor; only touched by the watcher thread
+    char **watch_paths;
+    int watch_paths_capacity;
+} fm_library_t;
+
+void fm_library_init(fm_library_t *lib, const char *index_path);
+// write any pending changes to the index and release everything
+void fm_library_cleanup(fm_library_t *lib);
+// bring the library in sync with music_dir; the index is mapped on first use and only the directories that
+// changed since it was written are read again. return the number of songs or -1
+int fm_library_scan(fm_library_t *lib, const char *music_dir);
+// write the index if there are pending changes
+int fm_library_save(fm_library_t *lib);
+// copy the metadata of the next n songs in the shuffle order into the given (initialized) songs
+// every song is drawn once before any of them is drawn again; at most N_LOCAL_CHANNEL_FETCH songs are drawn at a time
+// return the number of songs filled
+int fm_library_draw(fm_library_t *lib, fm_song_t **songs, int n);
+// watch music_dir with inotify and apply new, moved and deleted songs to the library as they happen
+// the library has to be scanned first; calling it again while watching does nothing
+int fm_library_watch(fm_library_t *lib);
+void fm_library_unwatch(fm_library_t *lib);
+// forget about a file (e.g. after it has been removed from the disk)
+void fm_library_remove(fm_library_t *lib, const char *path);
+
+#endif
@@ -0,0 +1,258 @@
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define LOG_FILE_MODE S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH
+
+// a slot is free for the record at position p when seq == p, and holds it once seq == p + 1
+typedef struct {
+    uint64_t seq;
+    struct timespec at;
+    int module;
+    int level;
+    char message[LOGGER_LINE_MAX];
+} log_record_t;
+
+static const char *level_names[llLevels] = {
+    [llError] = "error",
+    [llWarn] = "warn",
+    [llInfo] = "info",
+    [llDebug] = "debug",
+};
+
+static const char *module_names[lmModules] = {
+    [lmApp] = "app",
+    [lmServer] = "server",
+    [lmPlayer] = "player",
+    [lmPlaylist] = "playlist",
+    [lmDownloader] = "downloader",
+    [lmCache] = "cache",
+    [lmLibrary] = "library",
+    [lmArchive] = "archive",
+    [lmReport] = "report",
+    [lmConfig] = "config",
+    [lmEqualizer] = "equalizer",
+    [lmValidator] = "validator",
+};
+
+int fm_log_levels[lmModules] = {
+    [0 ... lmModules - 1] = llInfo
+};
+
+static log_record_t ring[LOGGER_RING_SIZE];
+// the next position to be claimed by a producer
+static uint64_t ring_head = 0;
+// the next position to be written out; only touched by the writer
+static uint64_t ring_tail = 0;
+static uint64_t dropped = 0;
+
+static char log_path[256];
+static int64_t log_max_size;
+static int64_t log_size;
+static int should_quit = 0;
+static int running = 0;
+static pthread_t writer_tid;
+
+// records can be logged before fm_log_init; they are written out once the writer starts
+__attribute__((constructor)) static void ring_init()
+{
+    uint64_t i;
+    for (i = 0; i < LOGGER_RING_SIZE; i++)
+        ring[i].seq = i;
+}
+
+// move the log out of the way and carry on with a fresh one in its place
+static void log_rotate()
+{
+    char from[272], to[272];
+    int i, fd;
+    for (i = LOGGER_KEEP - 1; i >= 1; i--) {
+        sprintf(from, "%s.%d", log_path, i);
+        sprintf(to, "%s.%d", log_path, i + 1);
+        rename(from, to);
+    }
+    sprintf(to, "%s.1", log_path);
+    if (rename(log_path, to) != 0)
+        return;
+    if ((fd = open(log_path, O_WRONLY | O_APPEND | O_CREAT, LOG_FILE_MODE)) < 0)
+        return;
+    // whatever else ends up on stdout (e.g. from the libraries) follows along
+    fflush(stdout);
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+    log_size = 0;
+}
+
+static void log_flush(const char *buf, size_t len)
+{
+    ssize_t n;
+    while (len > 0 && (n = write(STDOUT_FILENO, buf, len)) > 0) {
+        buf += n;
+        len -= n;
+        log_size += n;
+    }
+    if (log_max_size > 0 && log_size >= log_max_size)
+        log_rotate();
+}
+
+// write out every record that is ready; return how many there were
+static int log_drain()
+{
+    char buf[16384];
+    size_t len = 0;
+    int n = 0;
+    uint64_t lost;
+    log_record_t *r;
+    struct tm tm;
+
+    if ((lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED)) > 0)
+        len += snprintf(buf, sizeof(buf), "%llu log records dropped\n", (unsigned long long) lost);
+    for (;;) {
+        r = &ring[ring_tail % LOGGER_RING_SIZE];
+        if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != ring_tail + 1)
+            break;
+        if (sizeof(buf) - len < LOGGER_LINE_MAX + 64) {
+            log_flush(buf, len);
+            len = 0;
+        }
+        localtime_r(&r->at.tv_sec, &tm);
+        len += strftime(buf + len, sizeof(buf) - len, "%Y-%m-%d %H:%M:%S", &tm);
+        len += snprintf(buf + len, sizeof(buf) - len, ".%03ld %-5s %s: %s\n", r->at.tv_nsec / 1000000, level_names[r->level], module_names[r->module], r->message);
+        // hand the slot over to the producer that comes around the ring next
+        __atomic_store_n(&r->seq, ring_tail + LOGGER_RING_SIZE, __ATOMIC_RELEASE);
+        ring_tail++;
+        n++;
+    }
+    if (len > 0)
+        log_flush(buf, len);
+    return n;
+}
+
+static void *writer_thread(void *data)
+{
+    struct timespec interval = { 0, LOGGER_FLUSH_INTERVAL * 1000000L };
+    while (!__atomic_load_n(&should_quit, __ATOMIC_ACQUIRE)) {
+        if (log_drain() == 0)
+            nanosleep(&interval, NULL);
+    }
+    log_drain();
+    return data;
+}
+
+void fm_log_init(const char *path, int max_size)
+{
+    struct stat st;
+    snprintf(log_path, sizeof(log_path), "%s", path);
+    log_max_size = (int64_t) max_size * 1024 * 1024;
+    log_size = 0;
+    // a terminal or a pipe is never rotated
+    if (fstat(STDOUT_FILENO, &st) == 0 && S_ISREG(st.st_mode))
+        log_size = st.st_size;
+    else
+        log_max_size = 0;
+    should_quit = 0;
+    if (pthread_create(&writer_tid, NULL, writer_thread, NULL) == 0)
+        running = 1;
+}
+
+void fm_log_cleanup()
+{
+    if (!running)
+        return;
+    __atomic_store_n(&should_quit, 1, __ATOMIC_RELEASE);
+    pthread_join(writer_tid, NULL);
+    running = 0;
+}
+
+void fm_log_write(enum fm_log_module module, enum fm_log_level level, const char *format, ...)
+{
+    uint64_t pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    log_record_t *r;
+    int64_t diff;
+    va_list args;
+    size_t len;
+
+    for (;;) {
+        r = &ring[pos % LOGGER_RING_SIZE];
+        diff = (int64_t) (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            // the writer is a whole ring behind; losing the record beats stalling the caller
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else
+            pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    }
+    clock_gettime(CLOCK_REALTIME, &r->at);
+    r->module = module;
+    r->level = level;
+    va_start(args, format);
+    vsnprintf(r->message, sizeof(r->message), format, args);
+    va_end(args);
+    // the messages that came from printf still end with a newline of their own
+    len = strlen(r->message);
+    if (len > 0 && r->message[len - 1] == '\n')
+        r->message[len - 1] = '\0';
+    __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static int find_name(const char **names, int n, const char *name, size_t len)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        if (strlen(names[i]) == len && strncmp(names[i], name, len) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int fm_log_set_levels(const char *spec)
+{
+    int levels[lmModules];
+    int i, module, level;
+    const char *p, *eq;
+    size_t len;
+
+    // work on a copy so that a typo changes nothing
+    memcpy(levels, fm_log_levels, sizeof(levels));
+    for (p = spec; *p; p += len) {
+        p += strspn(p, " ,");
+        if (!(len = strcspn(p, " ,")))
+            break;
+        if ((eq = memchr(p, '=', len))) {
+            module = find_name(module_names, lmModules, p, eq - p);
+            level = find_name(level_names, llLevels, eq + 1, p + len - eq - 1);
+            if (module < 0 || level < 0)
+                return -1;
+            levels[module] = level;
+        } else {
+            if ((level = find_name(level_names, llLevels, p, len)) < 0)
+                return -1;
+            for (i = 0; i < lmModules; i++)
+                levels[i] = level;
+        }
+    }
+    for (i = 0; i < lmModules; i++)
+        __atomic_store_n(&fm_log_levels[i], levels[i], __ATOMIC_RELAXED);
+    return 0;
+}
+
+void fm_log_get_levels(fm_json_t *out)
+{
+    int i;
+    fm_json_object(out);
+    for (i = 0; i < lmModules; i++)
+        fm_json_kstr(out, module_names[i], level_names[__atomic_load_n(&fm_log_levels[i], __ATOMIC_RELAXED)]);
+    fm_json_object_end(out);
+}
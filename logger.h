@@ -0,0 +1,64 @@
+#ifndef _FM_LOGGER_H_
+#define _FM_LOGGER_H_
+
+#include "json.h"
+
+// the number of records the ring holds; records logged while it is full are dropped (and counted)
+#define LOGGER_RING_SIZE 4096
+// longer messages are cut short
+#define LOGGER_LINE_MAX 256
+// how long (in milliseconds) the writer sleeps once it has caught up
+#define LOGGER_FLUSH_INTERVAL 50
+// the default size (in MB) at which the log is rotated
+#define LOGGER_DEFAULT_SIZE 4
+// the number of rotated logs kept around as <path>.1 (the newest) to <path>.<n>
+#define LOGGER_KEEP 3
+
+enum fm_log_level {
+    llError,
+    llWarn,
+    llInfo,
+    llDebug,
+    llLevels
+};
+
+enum fm_log_module {
+    lmApp,
+    lmServer,
+    lmPlayer,
+    lmPlaylist,
+    lmDownloader,
+    lmCache,
+    lmLibrary,
+    lmArchive,
+    lmReport,
+    lmConfig,
+    lmEqualizer,
+    lmValidator,
+    lmModules
+};
+
+// the most verbose level logged for each module; read without locking on every record
+extern int fm_log_levels[lmModules];
+
+// every file sets LOG_MODULE to its own module before logging
+#define fm_log(level, ...) do { \
+    if (__atomic_load_n(&fm_log_levels[LOG_MODULE], __ATOMIC_RELAXED) >= (level)) \
+        fm_log_write(LOG_MODULE, level, __VA_ARGS__); \
+} while (0)
+#define fm_log_error(...) fm_log(llError, __VA_ARGS__)
+#define fm_log_warn(...) fm_log(llWarn, __VA_ARGS__)
+#define fm_log_info(...) fm_log(llInfo, __VA_ARGS__)
+#define fm_log_debug(...) fm_log(llDebug, __VA_ARGS__)
+
+// the records go to stdout, which is expected to be the log at path; it is rotated once it grows beyond max_size MB
+void fm_log_init(const char *path, int max_size);
+// write out whatever is left
+void fm_log_cleanup();
+// never blocks: formats the message into the ring and leaves the writing to the writer thread
+void fm_log_write(enum fm_log_module module, enum fm_log_level level, const char *format, ...) __attribute__((format(printf, 3, 4)));
+// a level (for every module) or <module>=<level>, any number of them separated by spaces or commas; return -1 on anything unknown
+int fm_log_set_levels(const char *spec);
+void fm_log_get_levels(fm_json_t *out);
+
+#endif
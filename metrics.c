@@ -0,0 +1,207 @@
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+typedef struct fm_metrics_shard {
+    uint64_t counters[mcCounters];
+    uint64_t buckets[mhHistograms][METRICS_BUCKETS + 1];
+    // in microseconds
+    uint64_t sums[mhHistograms];
+    // not owned by any thread; its counts have gone to retired
+    int idle;
+    struct fm_metrics_shard *next;
+} fm_metrics_shard_t;
+
+typedef struct {
+    const char *name;
+    const char *labels;
+    const char *help;
+    // what a unit of the counter is worth
+    double scale;
+} fm_metric_desc_t;
+
+static const fm_metric_desc_t counter_descs[mcCounters] = {
+    [mcDownloadBytes] = { "rpd_download_bytes_total", NULL, "Bytes received by the downloaders", 1 },
+    [mcPlayerUnderruns] = { "rpd_player_underruns_total", NULL, "Times playback had to wait for the download to catch up", 1 },
+    [mcDecodeCpu] = { "rpd_decode_cpu_seconds_total", NULL, "CPU time spent decoding audio", 1e-6 },
+    [mcCacheHits] = { "rpd_cache_lookups_total", "result=\"hit\"", "Song cache lookups", 1 },
+    [mcCacheMisses] = { "rpd_cache_lookups_total", "result=\"miss\"", "Song cache lookups", 1 },
+};
+
+static const fm_metric_desc_t histogram_descs[mhHistograms] = {
+    [mhDownloadTtfb] = { "rpd_download_ttfb_seconds", NULL, "Time until the first byte of a finished download arrived" },
+    [mhFirstAudio] = { "rpd_player_first_audio_seconds", NULL, "Time from starting a song to its first audio" },
+    [mhRefillLocal] = { "rpd_playlist_refill_seconds", "mode=\"local\"", "Time taken by a background playlist refill" },
+    [mhRefillDouban] = { "rpd_playlist_refill_seconds", "mode=\"douban\"", "Time taken by a background playlist refill" },
+    [mhRefillJing] = { "rpd_playlist_refill_seconds", "mode=\"jing\"", "Time taken by a background playlist refill" },
+    [mhCommand] = { "rpd_server_command_seconds", NULL, "Time from receiving a command to its reply being ready" },
+    [mhSongTransition] = { "rpd_player_transition_seconds", NULL, "Time from a song running out to the next one playing" },
+};
+
+static const double bucket_bounds[METRICS_BUCKETS] = METRICS_BUCKET_BOUNDS;
+
+// one shard per running thread; the play and download threads come and go with the songs, so a thread hands its
+// shard back on exit: the counts are folded into retired and the shard is reused by the next thread
+// the list only grows to the largest number of threads that have been counting at the same time
+static fm_metrics_shard_t *shards = NULL;
+static fm_metrics_shard_t retired;
+// guards the list, the idle flags and retired; never taken on the recording path once a thread has its shard
+static pthread_mutex_t mutex_shards = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t key_shard;
+static pthread_once_t once_key = PTHREAD_ONCE_INIT;
+static __thread fm_metrics_shard_t *local = NULL;
+
+static void shard_retire(void *data)
+{
+    fm_metrics_shard_t *shard = (fm_metrics_shard_t *) data;
+    int i, j;
+    pthread_mutex_lock(&mutex_shards);
+    for (i = 0; i < mcCounters; i++)
+        retired.counters[i] += shard->counters[i];
+    for (i = 0; i < mhHistograms; i++) {
+        for (j = 0; j <= METRICS_BUCKETS; j++)
+            retired.buckets[i][j] += shard->buckets[i][j];
+        retired.sums[i] += shard->sums[i];
+    }
+    memset(shard->counters, 0, sizeof(shard->counters));
+    memset(shard->buckets, 0, sizeof(shard->buckets));
+    memset(shard->sums, 0, sizeof(shard->sums));
+    shard->idle = 1;
+    pthread_mutex_unlock(&mutex_shards);
+    local = NULL;
+}
+
+static void key_init()
+{
+    pthread_key_create(&key_shard, shard_retire);
+}
+
+static fm_metrics_shard_t *shard_get()
+{
+    fm_metrics_shard_t *shard = local;
+    if (!shard) {
+        pthread_once(&once_key, key_init);
+        pthread_mutex_lock(&mutex_shards);
+        for (shard = shards; shard && !shard->idle; shard = shard->next)
+            ;
+        if (shard)
+            shard->idle = 0;
+        else {
+            shard = (fm_metrics_shard_t *) calloc(1, sizeof(fm_metrics_shard_t));
+            shard->next = shards;
+            shards = shard;
+        }
+        pthread_mutex_unlock(&mutex_shards);
+        // the destructor hands the shard back when the thread exits
+        pthread_setspecific(key_shard, shard);
+        local = shard;
+    }
+    return shard;
+}
+
+// only the owning thread writes, so the add does not need to be atomic; the store is, for the sake of the readers
+static inline void bump(uint64_t *p, uint64_t v)
+{
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+void fm_metrics_add(enum fm_metric_counter c, uint64_t v)
+{
+    bump(&shard_get()->counters[c], v);
+}
+
+void fm_metrics_observe(enum fm_metric_histogram h, double seconds)
+{
+    fm_metrics_shard_t *shard = shard_get();
+    int i;
+    if (seconds < 0)
+        seconds = 0;
+    for (i = 0; i < METRICS_BUCKETS && seconds > bucket_bounds[i]; i++)
+        ;
+    bump(&shard->buckets[h][i], 1);
+    bump(&shard->sums[h], (uint64_t) (seconds * 1e6));
+}
+
+static void write_line(fm_json_t *out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void write_line(fm_json_t *out, const char *fmt, ...)
+{
+    char line[256];
+    va_list ap;
+    int n;
+    va_start(ap, fmt);
+    n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n >= (int) sizeof(line))
+        n = sizeof(line) - 1;
+    fm_json_text(out, line, n);
+}
+
+// the help and type lines go once in front of each family
+static void write_header(fm_json_t *out, const fm_metric_desc_t *desc, const fm_metric_desc_t *prev, const char *type)
+{
+    if (prev && strcmp(prev->name, desc->name) == 0)
+        return;
+    write_line(out, "# HELP %s %s\n# TYPE %s %s\n", desc->name, desc->help, desc->name, type);
+}
+
+void fm_metrics_write(fm_json_t *out)
+{
+    uint64_t counters[mcCounters];
+    uint64_t buckets[mhHistograms][METRICS_BUCKETS + 1];
+    uint64_t sums[mhHistograms];
+    fm_metrics_shard_t *shard;
+    const fm_metric_desc_t *d;
+    uint64_t cumulative;
+    int i, j;
+
+    // retired is only ever added to under the lock, and an idle shard holds nothing, so no count is seen twice
+    pthread_mutex_lock(&mutex_shards);
+    memcpy(counters, retired.counters, sizeof(counters));
+    memcpy(buckets, retired.buckets, sizeof(buckets));
+    memcpy(sums, retired.sums, sizeof(sums));
+    for (shard = shards; shard; shard = shard->next) {
+        for (i = 0; i < mcCounters; i++)
+            counters[i] += __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED);
+        for (i = 0; i < mhHistograms; i++) {
+            for (j = 0; j <= METRICS_BUCKETS; j++)
+                buckets[i][j] += __atomic_load_n(&shard->buckets[i][j], __ATOMIC_RELAXED);
+            sums[i] += __atomic_load_n(&shard->sums[i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&mutex_shards);
+
+    for (i = 0; i < mcCounters; i++) {
+        d = &counter_descs[i];
+        write_header(out, d, i ? &counter_descs[i - 1] : NULL, "counter");
+        if (d->labels)
+            write_line(out, "%s{%s} %.15g\n", d->name, d->labels, counters[i] * d->scale);
+        else
+            write_line(out, "%s %.15g\n", d->name, counters[i] * d->scale);
+    }
+    for (i = 0; i < mhHistograms; i++) {
+        d = &histogram_descs[i];
+        write_header(out, d, i ? &histogram_descs[i - 1] : NULL, "histogram");
+        cumulative = 0;
+        for (j = 0; j <= METRICS_BUCKETS; j++) {
+            cumulative += buckets[i][j];
+            if (j < METRICS_BUCKETS)
+                write_line(out, "%s_bucket{%s%sle=\"%g\"} %llu\n", d->name, d->labels ? d->labels : "", d->labels ? "," : "",
+                        bucket_bounds[j], (unsigned long long) cumulative);
+            else
+                write_line(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", d->name, d->labels ? d->labels : "", d->labels ? "," : "",
+                        (unsigned long long) cumulative);
+        }
+        if (d->labels) {
+            write_line(out, "%s_sum{%s} %.6f\n", d->name, d->labels, sums[i] / 1e6);
+            write_line(out, "%s_count{%s} %llu\n", d->name, d->labels, (unsigned long long) cumulative);
+        } else {
+            write_line(out, "%s_sum %.6f\n", d->name, sums[i] / 1e6);
+            write_line(out, "%s_count %llu\n", d->name, (unsigned long long) cumulative);
+        }
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef _FM_METRICS_H_
+#define _FM_METRICS_H_
+
+#include "json.h"
+#include <stdint.h>
+
+// the upper bounds (in seconds) of the histogram buckets; one more bucket takes everything beyond
+#define METRICS_BUCKETS 11
+#define METRICS_BUCKET_BOUNDS { 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 }
+
+enum fm_metric_counter {
+    mcDownloadBytes,
+    mcPlayerUnderruns,
+    // in microseconds
+    mcDecodeCpu,
+    mcCacheHits,
+    mcCacheMisses,
+    mcCounters
+};
+
+enum fm_metric_histogram {
+    mhDownloadTtfb,
+    mhFirstAudio,
+    mhRefillLocal,
+    mhRefillDouban,
+    mhRefillJing,
+    mhCommand,
+    mhSongTransition,
+    mhHistograms
+};
+
+// every thread counts into its own shard, so recording is a plain add without locks or atomic read-modify-writes
+// the shards are only summed up when the metrics are asked for
+void fm_metrics_add(enum fm_metric_counter c, uint64_t v);
+void fm_metrics_observe(enum fm_metric_histogram h, double seconds);
+// the Prometheus text format
+void fm_metrics_write(fm_json_t *out);
+
+#endif
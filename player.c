@@ -1,13 +1,17 @@
 #include "player.h"
 #include "util.h"
+#include "metrics.h"
+#include "logger.h"
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <signal.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <libgen.h>
 #include <unistd.h>
+#include <time.h>
+
+#define LOG_MODULE lmPlayer
 
 #define PLAYER_DURATION_MARGIN 2
 
@@ -39,7 +43,7 @@ static SwrFormat get_dest_sample_fmt_from_sample_fmt(struct SwrContext **swr_ctx
     if (!*swr_ctx) {
         *swr_ctx = swr_alloc();
         if (!*swr_ctx) {
-            printf("Could not allocate resampler context\n");
+            fm_log_error("Could not allocate resampler context");
             return dest;
         }
     }
@@ -54,7 +58,7 @@ static SwrFormat get_dest_sample_fmt_from_sample_fmt(struct SwrContext **swr_ctx
 
     /* initialize the resampling context */
     if ((ret = swr_init(*swr_ctx)) < 0) {
-        printf("Failed to initialize the resampling context\n");
+        fm_log_error("Failed to initialize the resampling context");
         return dest;
     }
     return dest;
@@ -75,22 +79,24 @@ static int wait_new_content(fm_player_t *pl)
     int ret = 0;
     pthread_mutex_lock(pl->song->mutex_downloader);
     if (pl->song->downloader) {
-        printf("Waiting for some new content to arrive\n");
+        // running out of data after the song has started is what the listener notices
+        if (pl->info.duration > 0)
+            fm_metrics_add(mcPlayerUnderruns, 1);
+        fm_log_debug("Waiting for some new content to arrive");
         pthread_cond_wait(&pl->song->downloader->cond_new_content, pl->song->mutex_downloader);
-        printf("Wait finished\n");
+        fm_log_debug("Wait finished");
     } else {
         // there is no more downloader associated with this song
         // check if the current song is already complete
         int pos = fm_player_pos(pl);
         int len = fm_player_length(pl);
         if (len - pos >= PLAYER_DURATION_MARGIN) {
-            printf("Incomplete song ended with current pos %d / %d\n", pos, len);
+            fm_log_warn("Incomplete song ended with current pos %d / %d", pos, len);
             // unmark the like field to make sure that this song is removed
             pl->song->like = 0;
         }
-        if (pl->tid_ack > 0) {
-            pthread_kill(pl->tid_ack, pl->sig_ack);
-        }
+        if (pl->on_end)
+            pl->on_end(pl->on_end_data, pl->serial);
         ret = -1;
     }
     pthread_mutex_unlock(pl->song->mutex_downloader);
@@ -99,26 +105,27 @@ static int wait_new_content(fm_player_t *pl)
 
 static int open_song(fm_player_t *pl)
 {
-    printf("Attempting to open the input\n");
+    fm_log_debug("Attempting to open the input");
     if (avformat_open_input(&pl->format_context, pl->song->filepath, NULL, NULL) < 0) {
-        printf("Failure on opening the input stream\n");
+        fm_log_error("Failure on opening the input stream");
         return -1;
     } else 
-        printf("Opened format input\n");
+        fm_log_debug("Opened format input");
 
     // seek to the beginning of the file to avoid problem
-    printf("Attempting to find the stream info\n");
+    fm_log_debug("Attempting to find the stream info");
     if (avformat_find_stream_info(pl->format_context, NULL) < 0) {
-        printf("Cannot find stream info\n");
+        fm_log_error("Cannot find stream info");
         return -1;
     }
+    fm_trace_mark(&pl->song->trace, tsProbed);
 
-    printf("Attempting to find the best stream\n");
-    printf("Number of streams available: %d\n", pl->format_context->nb_streams);
+    fm_log_debug("Attempting to find the best stream");
+    fm_log_debug("Number of streams available: %d", pl->format_context->nb_streams);
     pl->audio_stream_idx = av_find_best_stream(pl->format_context, AVMEDIA_TYPE_AUDIO, -1, -1, &pl->codec, 0);
 
     if (pl->audio_stream_idx < 0) {
-        printf("Couldn't find stream information\n");
+        fm_log_error("Couldn't find stream information");
         return -1;
     }
 
@@ -131,9 +138,9 @@ static int open_song(fm_player_t *pl)
     pl->info.time_base = stream->time_base;
     pl->context = stream->codec;
 
-    printf("Attempting to open the codec\n");
+    fm_log_debug("Attempting to open the codec");
     if (avcodec_open2(pl->context, pl->codec, NULL) < 0) {
-        printf("Could not open codec\n");
+        fm_log_error("Could not open codec");
         return -1;
     }
 
@@ -141,7 +148,7 @@ static int open_song(fm_player_t *pl)
     ao_sample_format ao_fmt;
     
     // adjusting for resampling
-    printf("Attempting to adjusting for resampling\n");
+    fm_log_debug("Attempting to adjusting for resampling");
     pl->src_swr_format.sample_fmt = pl->context->sample_fmt;
     pl->src_swr_format.channel_layout = pl->context->channel_layout;
     pl->src_swr_format.sample_rate = pl->context->sample_rate;
@@ -156,30 +163,45 @@ static int open_song(fm_player_t *pl)
         case AV_SAMPLE_FMT_S32P: ao_fmt.bits = 32; pl->resampled = 0; break;
         default: 
             pl->resampled = 1;
-            printf("Resampling needs to be done\n"); 
+            fm_log_debug("Resampling needs to be done"); 
             pl->dest_swr_format = get_dest_sample_fmt_from_sample_fmt(&pl->swr_context, pl->src_swr_format);
             if (!pl->swr_context) {
-                printf("Cannot resample the data in the specified stream. Sample fmt is %d\n", pl->src_swr_format.sample_fmt);
+                fm_log_error("Cannot resample the data in the specified stream. Sample fmt is %d", pl->src_swr_format.sample_fmt);
                 return -1;
             }
             ao_fmt.bits = pl->dest_swr_format.bits;
             break;
     }
 
-    printf("ao setup: bits is %d\n", ao_fmt.bits);
+    fm_log_debug("ao setup: bits is %d", ao_fmt.bits);
     ao_fmt.channels = pl->context->channels;
-    printf("ao setup: channels is %d\n", ao_fmt.channels);
+    fm_log_debug("ao setup: channels is %d", ao_fmt.channels);
     ao_fmt.rate = pl->context->sample_rate;
-    printf("ao setup: sampling rate is %d\n", ao_fmt.rate);
+    fm_log_debug("ao setup: sampling rate is %d", ao_fmt.rate);
     ao_fmt.byte_format = AO_FMT_NATIVE;
     ao_fmt.matrix = 0;
+    pthread_mutex_lock(&pl->mutex_output);
     pl->dev = ao_open_live(pl->driver, &ao_fmt, pl->ao_options);
+    pthread_mutex_unlock(&pl->mutex_output);
     if (pl->dev == NULL) {
-        printf("Failed to open the ao device.\n");
+        fm_log_error("Failed to open the ao device.");
         return -1;
     }
+    fm_trace_mark(&pl->song->trace, tsDeviceOpened);
+
+    // a new song starts with a clean filter history
+    fm_equalizer_reset(&pl->eq);
+
+    if (pl->start > 0) {
+        int64_t ts = (int64_t) pl->start * pl->info.time_base.den / pl->info.time_base.num;
+        if (av_seek_frame(pl->format_context, pl->audio_stream_idx, ts, AVSEEK_FLAG_BACKWARD) >= 0)
+            pl->info.duration = ts;
+        else
+            fm_log_warn("Unable to seek to %d seconds; starting from the beginning", pl->start);
+        pl->start = 0;
+    }
 
-    printf("Song openning process finished.\n");
+    fm_log_debug("Song openning process finished.");
     return 0;
 }
 
@@ -219,7 +241,7 @@ static void close_song(fm_player_t *pl)
 
 static void* play_thread(void *data)
 {
-    printf("Entered play thread\n");
+    fm_log_debug("Entered play thread");
     fm_player_t *pl = (fm_player_t*) data;
 
     int ret;
@@ -237,6 +259,11 @@ static void* play_thread(void *data)
     char *ao_buf;
     int ao_size;
 
+    // for the metrics
+    struct timespec started, now, cpu_start, cpu_end;
+    int heard = 0;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
     // first conditions to satisfy (importance ordered from high to low
     // 1. the play state is not STOP
     // 2. the filepath is not nil
@@ -260,13 +287,15 @@ static void* play_thread(void *data)
         if (!pl->context) {
             // wait for the file to grow at least to a considerable size
             struct stat st;
-            stat(pl->song->filepath, &st);
+            // the file is missing if its download could not even start
+            if (stat(pl->song->filepath, &st) != 0)
+                st.st_size = 0;
             if (st.st_size < HEADERBUF_SIZE) {
-                printf("Blocking on waiting for the file to have some initial size\n");
+                fm_log_debug("Blocking on waiting for the file to have some initial size");
                 if (wait_new_content(pl) == 0) continue;
                 else return pl;
             } else if (open_song(pl) != 0) {
-                printf("Opening song failed. Retry again.\n");
+                fm_log_warn("Opening song failed. Retry again.");
                 close_song(pl);
                 // we should wait as well, since the natural reason for not able to open the song should be not enough data
                 if (wait_new_content(pl) == 0) continue;
@@ -280,16 +309,19 @@ static void* play_thread(void *data)
             // free the packet first
             av_free_packet(&pl->avpkt);
             // couldn't decode the frame
-            printf("Could not read the frame\n");
+            fm_log_debug("Could not read the frame");
             if (wait_new_content(pl) == 0) continue;
             else return pl;
         }
         if (pl->avpkt.stream_index == pl->audio_stream_idx) {
             avcodec_get_frame_defaults(pl->frame);
             /*printf("Attempting to decode the music\n");*/
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
             ret = avcodec_decode_audio4(pl->context, pl->frame, &got_frame, &pl->avpkt);
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+            fm_metrics_add(mcDecodeCpu, (cpu_end.tv_sec - cpu_start.tv_sec) * 1000000LL + (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1000);
             if (ret < 0) {
-                printf("Error decoding audio\n");
+                fm_log_error("Error decoding audio");
             } else if (got_frame) {
                 /*printf("Got frame to play\n");*/
                 ao_size = av_samples_get_buffer_size(NULL, pl->frame->channels, pl->frame->nb_samples, pl->frame->format, 1);
@@ -299,11 +331,11 @@ static void* play_thread(void *data)
                 if (pl->resampled) {
                     dest_nb_samples = av_rescale_rnd(swr_get_delay(pl->swr_context, pl->src_swr_format.sample_rate) + pl->frame->nb_samples, pl->src_swr_format.sample_rate, pl->src_swr_format.sample_rate, AV_ROUND_UP);
                     if (dest_nb_samples > pl->dest_swr_nb_samples) {
-                        printf("dest_nb_samples %d exceeding current nb %d. Reallocating the resampling buffer\n", dest_nb_samples, pl->dest_swr_nb_samples);
+                        fm_log_debug("dest_nb_samples %d exceeding current nb %d. Reallocating the resampling buffer", dest_nb_samples, pl->dest_swr_nb_samples);
                         if (pl->swr_buf)
                             av_freep(pl->swr_buf);
                         if (av_samples_alloc_array_and_samples(&pl->swr_buf, pl->frame->linesize, pl->frame->channels, dest_nb_samples, pl->dest_swr_format.sample_fmt, 0) < 0) {
-                            printf("Could not allocate destination samples\n");
+                            fm_log_error("Could not allocate destination samples");
                             exit(-1);
                         }
                         pl->dest_swr_nb_samples = dest_nb_samples;
@@ -311,7 +343,7 @@ static void* play_thread(void *data)
                     // covert to destination format
                     ret = swr_convert(pl->swr_context, pl->swr_buf, dest_nb_samples, (const uint8_t **) pl->frame->extended_data, pl->frame->nb_samples);
                     if (ret < 0) {
-                        printf("Could not resample the audio\n");
+                        fm_log_error("Could not resample the audio");
                         exit(-1);
                     } 
                     // get the resampled buffer size
@@ -323,13 +355,13 @@ static void* play_thread(void *data)
                     unsigned sample_size = av_get_bytes_per_sample(pl->dest_swr_format.sample_fmt);
                     // printf("Copying multiple channels\n");
                     if(pl->interweave_buf_size < ao_size) {
-                        printf("buf size %d exceeding current interweave buf size %d. Reallocating the interweave buffer\n", ao_size, pl->interweave_buf_size);
+                        fm_log_debug("buf size %d exceeding current interweave buf size %d. Reallocating the interweave buffer", ao_size, pl->interweave_buf_size);
                         if (pl->interweave_buf)
                             av_freep(&pl->interweave_buf);
                         pl->interweave_buf = av_malloc(ao_size);
                         if (!pl->interweave_buf) {
                             // Not enough memory - shouldn't happen 
-                            printf("Unable to allocate the buffer\n");
+                            fm_log_error("Unable to allocate the buffer");
                         }
                         pl->interweave_buf_size = ao_size;
                     }
@@ -343,6 +375,15 @@ static void* play_thread(void *data)
                     }
                     ao_buf = (char *) pl->interweave_buf;
                 }
+                // equalize the interleaved samples in place
+                int sample_bytes = av_get_bytes_per_sample(pl->dest_swr_format.sample_fmt);
+                fm_equalizer_process(&pl->eq, ao_buf, ao_size / (sample_bytes * pl->frame->channels), pl->frame->channels, sample_bytes * 8, pl->context->sample_rate);
+                if (!heard) {
+                    clock_gettime(CLOCK_MONOTONIC, &now);
+                    fm_metrics_observe(mhFirstAudio, (now.tv_sec - started.tv_sec) + (now.tv_nsec - started.tv_nsec) / 1e9);
+                    fm_trace_mark(&pl->song->trace, tsFirstAudio);
+                    heard = 1;
+                }
                 ao_play(pl->dev, ao_buf, ao_size);
                 // add the duration to the info
                 pl->info.duration += pl->avpkt.duration;
@@ -364,18 +405,24 @@ int fm_player_open(fm_player_t *pl, fm_player_config_t *config)
     }
 
     ao_info *driver_info = ao_driver_info(pl->driver);
-    printf("Player audio driver: %s\n", driver_info->name);
+    fm_log_info("Player audio driver: %s", driver_info->name);
     pl->ao_options = NULL;
     if (config->dev[0] != '\0') {
         ao_append_option(&pl->ao_options, "dev", config->dev);
     }
     pl->dev = NULL;
 
-    pl->tid_ack = 0;
+    pl->serial = 0;
+    pl->start = 0;
+    pl->on_end = NULL;
+    pl->on_end_data = NULL;
 
     pthread_mutex_init(&pl->mutex_status, NULL);
+    pthread_mutex_init(&pl->mutex_output, NULL);
     pthread_cond_init(&pl->cond_play, NULL);
 
+    fm_equalizer_init(&pl->eq, &config->eq);
+
     pl->status = FM_PLAYER_STOP;
 
     pl->song = NULL;
@@ -408,8 +455,11 @@ void fm_player_close(fm_player_t *pl)
         ao_free_options(pl->ao_options);
 
     pthread_mutex_destroy(&pl->mutex_status);
+    pthread_mutex_destroy(&pl->mutex_output);
     pthread_cond_destroy(&pl->cond_play);
 
+    fm_equalizer_destroy(&pl->eq);
+
     // free the ffmpeg stuff
     av_frame_free(&pl->frame);
 }
@@ -419,35 +469,64 @@ int fm_player_set_song(fm_player_t *pl, fm_song_t *song)
     fm_player_stop(pl);
 
     if (!song) {
-        printf("No song to play\n");
+        fm_log_info("No song to play");
         return -1;
     }
 
     // set the song
     pl->song = song;
+    pl->serial++;
+    fm_trace_mark(&song->trace, tsPlay);
 
     // set the relevant properties
     pl->info.duration = 0;
     pl->info.time_base.num = pl->info.time_base.den = 1;
     pl->info.length = song->length;
+    pl->start = 0;
 
     return 0;
 }
 
-void fm_player_set_ack(fm_player_t *pl, pthread_t tid, int sig)
+void fm_player_set_start(fm_player_t *pl, int pos)
+{
+    pl->start = pos;
+}
+
+int fm_player_set_output(fm_player_t *pl, const fm_player_config_t *config)
+{
+    ao_option *options = NULL, *old;
+    int driver = ao_driver_id(config->driver);
+    if (driver == -1)
+        return -1;
+    if (config->dev[0] != '\0')
+        ao_append_option(&options, "dev", config->dev);
+    pthread_mutex_lock(&pl->mutex_output);
+    old = pl->ao_options;
+    pl->driver = driver;
+    pl->ao_options = options;
+    strcpy(pl->config.driver, config->driver);
+    strcpy(pl->config.dev, config->dev);
+    pthread_mutex_unlock(&pl->mutex_output);
+    if (old)
+        ao_free_options(old);
+    fm_log_info("Player audio driver: %s", ao_driver_info(driver)->name);
+    return 0;
+}
+
+void fm_player_set_ack(fm_player_t *pl, player_end_callback on_end, void *data)
 {
-    pl->tid_ack = tid;
-    pl->sig_ack = sig;
+    pl->on_end = on_end;
+    pl->on_end_data = data;
 }
 
 void fm_player_play(fm_player_t *pl)
 {
-    printf("Player play\n");
+    fm_log_info("Player play");
     if (pl->status == FM_PLAYER_STOP) {
         pl->status = FM_PLAYER_PLAY;
-        printf("Creating play thread\n");
+        fm_log_debug("Creating play thread");
         pthread_create(&pl->tid_play, NULL, play_thread, pl);
-        printf("Finished creating play thread\n");
+        fm_log_debug("Finished creating play thread");
     }
     else if (pl->status == FM_PLAYER_PAUSE) {
         pthread_mutex_lock(&pl->mutex_status);
@@ -459,7 +538,7 @@ void fm_player_play(fm_player_t *pl)
 
 void fm_player_pause(fm_player_t *pl)
 {
-    printf("Player pause\n");
+    fm_log_info("Player pause");
     pthread_mutex_lock(&pl->mutex_status);
     pl->status = FM_PLAYER_PAUSE;
     pthread_mutex_unlock(&pl->mutex_status);
@@ -468,12 +547,12 @@ void fm_player_pause(fm_player_t *pl)
 void fm_player_stop(fm_player_t *pl)
 {
     if (pl->status != FM_PLAYER_STOP) {
-        printf("Player stop\n");
+        fm_log_info("Player stop");
         pthread_mutex_lock(&pl->mutex_status);
         pl->status = FM_PLAYER_STOP;
         pthread_mutex_unlock(&pl->mutex_status);
         pthread_cond_signal(&pl->cond_play);
-        printf("Trying to signal cond new content\n");
+        fm_log_debug("Trying to signal cond new content");
         if (pl->song && pl->song->downloader)
             pthread_cond_signal(&pl->song->downloader->cond_new_content);
 
@@ -2,6 +2,7 @@
 #define _FM_PLAYER_H_
 
 #include "playlist.h"
+#include "equalizer.h"
 #include <ao/ao.h>
 #include <curl/curl.h>
 #include <pthread.h>
@@ -37,6 +38,7 @@ typedef struct {
     int encoding;
     char driver[16];
     char dev[16];
+    fm_eq_params_t eq;
 } fm_player_config_t;
 
 typedef struct {
@@ -46,6 +48,9 @@ typedef struct {
     int bits;
 } SwrFormat;
 
+// called on the play thread once a song has run out; serial tells which song it was (see fm_player_t)
+typedef void (*player_end_callback)(void *data, unsigned long serial);
+
 typedef struct fm_player {
     ao_device *dev;
     // the options for the ao_player
@@ -76,20 +81,35 @@ typedef struct fm_player {
     uint8_t **swr_buf;
     int dest_swr_nb_samples;
 
+    // the equalizer applied to the decoded pcm before output
+    fm_equalizer_t eq;
+
     fm_player_info_t info;
+    // where (in seconds) to start the song once it is opened
+    int start;
     fm_player_config_t config;
     enum fm_player_status status;
 
-    pthread_t tid_ack;
-    int sig_ack;
+    // counts the songs handed to the player, so that the end of an earlier song can be told apart
+    unsigned long serial;
+    player_end_callback on_end;
+    void *on_end_data;
 
     pthread_t tid_play;
     pthread_cond_t cond_play;
     pthread_mutex_t mutex_status;
+    // guards the driver and its options, which open_song reads for every song
+    pthread_mutex_t mutex_output;
 } fm_player_t;
 
 int fm_player_set_song(fm_player_t *pl, fm_song_t *song);
-void fm_player_set_ack(fm_player_t *pl, pthread_t tid, int sig);
+// switch to another driver and device from the next song on; the song playing carries on where it is
+int fm_player_set_output(fm_player_t *pl, const fm_player_config_t *config);
+// the callback must not block; it typically queues an event for another thread
+void fm_player_set_ack(fm_player_t *pl, player_end_callback on_end, void *data);
+
+// start the song set last at pos seconds instead of at the beginning; meant for songs that are already complete
+void fm_player_set_start(fm_player_t *pl, int pos);
 
 int fm_player_pos(fm_player_t *pl);
 int fm_player_length(fm_player_t *pl);
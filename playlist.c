@@ -1,5 +1,11 @@
 #include "playlist.h"
+#include "library.h"
+#include "archive.h"
+#include "cache.h"
+#include "report.h"
+#include "metrics.h"
 #include "util.h"
+#include "logger.h"
 
 #include <json-c/json.h>
 
@@ -11,20 +17,45 @@
 #include <pthread.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <time.h>
+
+#define LOG_MODULE lmPlaylist
 
 #define INVALID_FILE_CHARS "<>:\"|?*/\\"
 #define INVALID_FILE_CHARS_REP "[] '&  &&"
 
 #define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
 
+// a consistent copy of the config, which fm_playlist_reload can change under the other threads at any time
+static void config_snapshot(fm_playlist_t *pl, fm_playlist_config_t *config)
+{
+    pthread_mutex_lock(&pl->mutex_config);
+    *config = pl->config;
+    pthread_mutex_unlock(&pl->mutex_config);
+}
+
 static void song_downloader_stop(fm_playlist_t *pl, downloader_t *dl)
 {
     stack_downloader_stop(pl->stack, dl);
     // clean up the state
     pthread_mutex_lock(&pl->mutex_song_downloader);
-    fm_song_t *song = (fm_song_t *)dl->data;
-    if (song) {
-        song->downloader = NULL;
+    fm_transfer_t *t = (fm_transfer_t *)dl->data;
+    if (t) {
+        fm_song_t *song;
+        // a completed download carries the digest of the file with it
+        if (dl->btype == bFile && dl->content.fbuf->digest.hex[0] != '\0')
+            strcpy(t->digest, dl->content.fbuf->digest.hex);
+        if (dl->btype == bFile && dl->content.fbuf->etag_set)
+            strcpy(t->etag, dl->content.fbuf->etag);
+        for (song = t->songs; song; song = song->transfer_next) {
+            if (t->digest[0] != '\0')
+                validator_set_digest(&song->validator, t->digest);
+            if (dl->first_byte)
+                fm_trace_set(&song->trace, tsFirstByte, dl->first_byte);
+            fm_trace_mark(&song->trace, tsDownloaded);
+            song->downloader = NULL;
+        }
+        t->downloader = NULL;
         dl->data = NULL;
     }
     pthread_mutex_unlock(&pl->mutex_song_downloader);
@@ -45,10 +76,10 @@ static int get_file_path(char *buf, char *directory, char *artist, char *title,
 {
     // if the artist or the title is unknown, we should report an error
     if (title[0] == '\0' || artist[0] == '\0') {
-        printf("Malformatted song information\n");
+        fm_log_warn("Malformatted song information");
         return -1;
     } else if (directory[0] == '\0') {
-        printf("Music directory not set\n");
+        fm_log_warn("Music directory not set");
         return -2;
     }
     // replace all the invalid characters
@@ -61,18 +92,57 @@ static int get_file_path(char *buf, char *directory, char *artist, char *title,
         r++;
     }
     sprintf(buf, "%s/%s/%s.%s", directory, artist, title, ext);
-    printf("The obtained file path is %s\n", buf);
+    fm_log_debug("The obtained file path is %s", buf);
     return 0;
 }
 
+// keep the timeline of a song that made it to the player
+static void song_trace_commit(fm_song_t *song)
+{
+    fm_trace_record_t record;
+    if (!song->trace.at[tsPlay])
+        return;
+    fm_trace_mark(&song->trace, tsDone);
+    record.trace = song->trace;
+    record.sid = song->sid;
+    strcpy(record.artist, song->artist);
+    strcpy(record.title, song->title);
+    fm_trace_commit(&record);
+}
+
 static void fm_song_free(fm_playlist_t *pl, fm_song_t *song)
 {
-    // first notify the downloader to stop
     pthread_mutex_lock(&pl->mutex_song_downloader);
-    if (song->downloader) {
-        stack_downloader_stop(pl->stack, song->downloader);
-        stack_downloader_cleanup(pl->stack, song->downloader);
-        song->downloader->data = NULL;
+    // the downloader thread stamps the song under the same mutex
+    song_trace_commit(song);
+    fm_transfer_t *t = song->transfer;
+    if (t) {
+        fm_song_t **p = &t->songs;
+        while (*p != song)
+            p = &(*p)->transfer_next;
+        *p = song->transfer_next;
+        song->transfer = NULL;
+        if (--t->refs > 0) {
+            // the file is still needed by the other songs; the last one decides what happens to it
+            if (song->like)
+                t->liked = 1;
+            pthread_mutex_unlock(&pl->mutex_song_downloader);
+            free(song);
+            return;
+        }
+        if (t->liked)
+            song->like = 1;
+        // first notify the downloader to stop
+        if (t->downloader) {
+            stack_downloader_stop(pl->stack, t->downloader);
+            stack_downloader_cleanup(pl->stack, t->downloader);
+            t->downloader->data = NULL;
+        }
+        fm_transfer_t **q = &pl->transfers;
+        while (*q != t)
+            q = &(*q)->next;
+        *q = t->next;
+        free(t);
         song->downloader = NULL;
     }
     pthread_mutex_unlock(&pl->mutex_song_downloader);
@@ -81,60 +151,53 @@ static void fm_song_free(fm_playlist_t *pl, fm_song_t *song)
     // now check: if we should cache this song / if we should delete the tmp buffer associated with this song
     // we can run a length check to check if that matches the size given in the song
     if (song->like) {
-        printf("Liked song detected before free: %s\n", song->title);
+        fm_log_debug("Liked song detected before free: %s", song->title);
         // run a simple check on whether there are any file present in the file system
         if (song->filepath[0] != '\0') {
             struct stat sts;
             // must make sure that the tmp file exists and the dest file does not exist
             if (stat(song->filepath, &sts) == 0) {
                 char lp[256];
+                fm_playlist_config_t config;
+                config_snapshot(pl, &config);
                 // test if the music is already in the music folder; if yes then no need to do anything then
-                if (strncmp(song->filepath, pl->config.music_dir, strlen(pl->config.music_dir)) == 0)
+                if (song->local)
                     to_remove = 0;
-                else if (get_file_path(lp, pl->config.music_dir, song->artist, song->title, song->ext) == 0) {
+                else if (get_file_path(lp, config.music_dir, song->artist, song->title, song->ext) == 0) {
                     if (strcmp(song->filepath, lp) == 0)
                         to_remove = 0;
                     else if (validate(&song->validator, song->filepath) && stat(lp, &sts) == -1 && errno == ENOENT) {
-                        to_remove = 0;
-                        printf("Attempting to cache the song for path %s\n", lp);
-                        // first move the file to a secure location to avoid it being truncated later
-                        char cmd[3072], btp[256], bart[128], btitle[128], balb[128], blp[256], bcover[128], burl[128]; 
-                        sprintf(cmd, 
-                                "export LC_ALL=en_US.UTF-8;"
-                                "src=$'%s' tmpimg=\"$src.jpg\";"
-                                "(curl --connect-timeout 15 -m 60 -o \"$tmpimg\" $'%s';"
-                                // we will not proceed to tag the file if the cover image is not downloaded successfully
-                                "if [ -f \"$tmpimg\" ] && identify \"$tmpimg\"; then "
-                                    "artist=$'%s' title=$'%s' album=$'%s' date='%d' page_url=$'%s';"
-                                    "[[ \"$date\" =~ [0-9]{4} ]] && datearg=\"-Y $date\" || datearg=;"
-                                    "dest=$'%s';"
-                                    "mkdir -p \"$(dirname \"$dest\")\";"
-                                    "mv -f \"$src\" \"$dest\";" 
-                                    "mutagen -a \"$artist\" -A \"$album\" -t \"$title\" -r \"$page_url\" -c \"$tmpimg\" $datearg \"$dest\";"
-                                    // download the lyrics for the song
-                                    "(( '%d' == 1 )) && lrcdown \"$title ${artist//\\// }\" \"${dest%%.*}.lrc\";"
-                                "else "
-                                    "rm -f \"$src\";"
-                                "fi;"
-                                "rm -f \"$tmpimg\") &", 
-                                escapesh(btp, song->filepath), 
-                                escapesh(bcover, song->cover),
-                                escapesh(bart, song->artist), 
-                                escapesh(btitle, song->title), 
-                                escapesh(balb, song->album), 
-                                song->pubdate,
-                                escapesh(burl, song->url),
-                                escapesh(blp, lp),
-                                pl->config.download_lyrics);
-                        printf("Move and tag command: %s\n", cmd);
-                        system(cmd);
+                        fm_log_debug("Attempting to cache the song for path %s", lp);
+                        // tagging and moving happen on the archive workers; if they cannot keep up the song is dropped
+                        if (fm_archive_submit(pl->archive, song, lp, config.download_lyrics) == 0) {
+                            to_remove = 0;
+                            // the file now belongs to the archive
+                            if (fm_cache_owns(pl->cache, song->filepath))
+                                fm_cache_release(pl->cache, song->filepath);
+                        }
                     }                                                                   
                 }
             }
         }
     } 
+    if (to_remove && song->filepath[0] != '\0') {
+        // keep complete downloads around in case the song comes up again
+        if (fm_cache_owns(pl->cache, song->filepath))
+            to_remove = 0;
+        else if (!song->local && song->sid != 0 && validate(&song->validator, song->filepath)) {
+            char key[32];
+            fm_cache_key(key, song->sid, song->kbps);
+            if (fm_cache_insert(pl->cache, key, song->ext, song->filepath) == 0)
+                to_remove = 0;
+        }
+    }
+    // on shutdown an unfinished download is kept for the next run to pick up, or else to remove
+    if (to_remove && pl->keep_partials && !song->local && song->filepath[0] != '\0')
+        to_remove = 0;
     if (to_remove) {
         // remove the song
+        if (song->local)
+            fm_library_remove(pl->library, song->filepath);
         unlink(song->filepath);
         rmdir(dirname(song->filepath));
     }
@@ -151,17 +214,98 @@ static fm_song_t *song_init(fm_playlist_t *pl)
 {
     fm_song_t *song = (fm_song_t*) malloc(sizeof(fm_song_t));
     song->title[0] = song->artist[0] = song->kbps[0] = song->album[0] = song->cover[0] = song->url[0] = song->audio[0] = song->ext[0] = song->filepath[0] = '\0';
-    song->pubdate = song->sid = song->like = song->length = 0;
+    song->pubdate = song->sid = song->like = song->length = song->local = 0;
     song->next = NULL;
     song->downloader = NULL;
+    song->transfer = NULL;
+    song->transfer_next = NULL;
+    memset(&song->trace, 0, sizeof(fm_trace_t));
     validator_init(&song->validator);
     song->mutex_downloader = &pl->mutex_song_downloader;
     return song;
 }
 
+// where a copy of a parsed song has been found
+enum song_copy {
+    copyNone,
+    // under music_dir
+    copyLocal,
+    // in the song cache
+    copyCached,
+};
+
+typedef struct {
+    fm_playlist_t *pl;
+    fm_song_t *song;
+    enum song_copy copy;
+} local_check_t;
+
+static void local_check_task(void *arg)
+{
+    local_check_t *check = (local_check_t *) arg;
+    fm_song_t *song = check->song;
+    char key[32], path[320];
+    if (song->filepath[0] != '\0' && validate(&song->validator, song->filepath)) {
+        check->copy = copyLocal;
+        return;
+    }
+    fm_cache_key(key, song->sid, song->kbps);
+    if (fm_cache_lookup(check->pl->cache, key, path) == 0 && strlen(path) < sizeof(song->filepath)) {
+        strcpy(song->filepath, path);
+        check->copy = copyCached;
+    }
+}
+
+// check all the parsed songs for copies at once so that their stat/hash work overlaps
+// copies[i] is set to where songs[i] has been found; its filepath then points at the copy
+static void fm_playlist_check_local(fm_playlist_t *pl, fm_song_t **songs, enum song_copy *copies, int n)
+{
+    local_check_t checks[n];
+    task_group_t group;
+    int i;
+    task_group_init(&group);
+    for (i = 0; i < n; i++) {
+        checks[i].pl = pl;
+        checks[i].song = songs[i];
+        checks[i].copy = copyNone;
+        if (songs[i])
+            task_pool_submit(pl->local_check_pool, &group, local_check_task, &checks[i]);
+    }
+    task_group_wait(&group);
+    task_group_destroy(&group);
+    for (i = 0; i < n; i++) {
+        copies[i] = checks[i].copy;
+    }
+}
+
+// substitute the audio field with the path of the copy if there is one; otherwise forget about the path
+static void song_resolve_local(fm_song_t *song, enum song_copy copy)
+{
+    switch (copy) {
+        case copyLocal:
+            fm_log_info("Detected local audio file for song %s/%s. Using the file directly instead of downloading.", song->artist, song->title);
+            // we can be quite sure that this song is liked
+            if (!song->like) {
+                fm_log_info("The song is not liked; changing it to liked to indicate preference");
+                song->like = 1;
+            }
+            song->local = 1;
+            song->audio[0] = '\0';
+            break;
+        case copyCached:
+            fm_log_info("Song %s/%s found in the cache at %s", song->artist, song->title, song->filepath);
+            song->audio[0] = '\0';
+            break;
+        default:
+            song->filepath[0] = '\0';
+    }
+}
+
 static fm_song_t *fm_song_douban_parse_json(fm_playlist_t *pl, struct json_object *obj)
 {
+    fm_playlist_config_t config;
     fm_song_t *song = song_init(pl);
+    config_snapshot(pl, &config);
     song->sid = json_object_get_int(json_object_object_get(obj, "sid"));
     strcpy(song->title, json_object_get_string(json_object_object_get(obj, "title")));
     strcpy(song->artist, json_object_get_string(json_object_object_get(obj, "artist")));
@@ -182,7 +326,7 @@ static fm_song_t *fm_song_douban_parse_json(fm_playlist_t *pl, struct json_objec
     strcpy(song->ext, "mp3");
     struct json_object *kbps_obj = json_object_object_get(obj, "kbps");
     if (json_object_get_string_len(kbps_obj) == 0)
-        strcpy(song->kbps, pl->config.kbps);
+        strcpy(song->kbps, config.kbps);
     else
         strcpy(song->kbps, json_object_get_string(kbps_obj));
     song->length = json_object_get_int(json_object_object_get(obj, "length"));
@@ -196,26 +340,14 @@ static fm_song_t *fm_song_douban_parse_json(fm_playlist_t *pl, struct json_objec
             validator_init(&song->validator);
     } else
         validator_sha256_init(&song->validator, json_object_get_string(sha_obj));
-    // check if we can substitute the audio field with a local path
-    if (get_file_path(song->filepath, pl->config.music_dir, song->artist, song->title, song->ext) == 0 && validate(&song->validator, song->filepath)) {
-        printf("Detected local audio file for song %s/%s. Using the file directly instead of downloading.\n", song->artist, song->title);
-        if (!song->like) {
-            printf("The song is not liked; changing it to liked to indicate preference\n");
-            song->like = 1;
-        }
-    } else {
-        song->filepath[0] = '\0';
-        strcpy(song->audio, json_object_get_string(json_object_object_get(obj, "url")));
-        if (!valid_song_url(song->audio)) {
-            fm_song_free(pl, song);
-            song= NULL;
-        }
-    }
-    
     if (song->sid == 0) {
         fm_song_free(pl, song);
-        song = NULL;
+        return NULL;
     }
+    // the audio url is only used if there turns out to be no local copy (see song_resolve_local)
+    strcpy(song->audio, json_object_get_string(json_object_object_get(obj, "url")));
+    if (get_file_path(song->filepath, config.music_dir, song->artist, song->title, song->ext) != 0)
+        song->filepath[0] = '\0';
     return song;
 }
 
@@ -224,11 +356,11 @@ static json_object *fm_jing_parse_json_result(json_object *obj)
 {
     // here we are only going to parse the fetch_pls (conceivably)
     if (!obj) {
-        printf("Attempting to parse null object\n");
+        fm_log_debug("Attempting to parse null object");
         return NULL;
     }
     if (json_object_get_boolean(json_object_object_get(obj, "success")) == FALSE ) {
-        printf("API error: %s\n", json_object_get_string(json_object_object_get(obj, "msg")));
+        fm_log_error("API error: %s", json_object_get_string(json_object_object_get(obj, "msg")));
         return NULL;
     }
     return json_object_object_get(obj, "result");
@@ -236,13 +368,15 @@ static json_object *fm_jing_parse_json_result(json_object *obj)
 
 static fm_song_t* fm_song_jing_parse_json(fm_playlist_t *pl, struct json_object *obj)
 {
+    fm_playlist_config_t config;
     fm_song_t *song = song_init(pl);
+    config_snapshot(pl, &config);
     // for the audio link we have to perform a retrieve
     song->sid = json_object_get_int(json_object_object_get(obj, "tid")); 
     const char *str = json_object_get_string(json_object_object_get(obj, "n"));
-    printf("Jing: Song title parsed is %s\n", str);
+    fm_log_debug("Jing: Song title parsed is %s", str);
     strcpy(song->title, str);
-    printf("Jing: Song title obtained is %s\n", song->title);
+    fm_log_debug("Jing: Song title obtained is %s", song->title);
     json_object *atn_obj = json_object_object_get(obj, "atn");
     if (!atn_obj)
         atn_obj = json_object_object_get(obj, "atst");
@@ -269,19 +403,9 @@ static fm_song_t* fm_song_jing_parse_json(fm_playlist_t *pl, struct json_object
     json_object *fs_obj = json_object_object_get(obj, "fs");
     // we can do a rough estimation of the filesize based on duration and bitrate if fs is not available
     validator_filesize_init(&song->validator, fs_obj ? json_object_get_int(fs_obj) : 255000 * song->length / 8);
-    // check if we can substitute the audio field with a local path
-    if (get_file_path(song->filepath, pl->config.music_dir, song->artist, song->title, song->ext) == 0 && validate(&song->validator, song->filepath)) {
-        printf("Detected local audio file for song %s/%s. Using the file directly instead of downloading.\n", song->artist, song->title);
-        // we can be quite sure that this song is liked
-        song->like = 1;
-    } else {
+    strcpy(song->audio, json_object_get_string(json_object_object_get(obj, "mid")));
+    if (get_file_path(song->filepath, config.music_dir, song->artist, song->title, song->ext) != 0)
         song->filepath[0] = '\0';
-        strcpy(song->audio, json_object_get_string(json_object_object_get(obj, "mid")));
-        if (song->audio[0] == '\0') {
-            fm_song_free(pl, song);
-            song = NULL;
-        }
-    } 
     return song;
 }
 
@@ -289,6 +413,7 @@ static void fm_playlist_history_add(fm_playlist_t *pl, fm_song_t *song, char sta
 {
     const static int max_hist = 10;
     int len = 0;
+    pthread_mutex_lock(&pl->mutex_history);
     fm_history_t *h = pl->history;
     fm_history_t *last = NULL;
     fm_history_t *penult = NULL;
@@ -313,6 +438,7 @@ static void fm_playlist_history_add(fm_playlist_t *pl, fm_song_t *song, char sta
         last->next = pl->history;
         pl->history = last;
     }
+    pthread_mutex_unlock(&pl->mutex_history);
 }
 
 static void fm_playlist_hisotry_clear(fm_playlist_t *pl)
@@ -326,17 +452,19 @@ static void fm_playlist_hisotry_clear(fm_playlist_t *pl)
     }
 }
 
-static const char* fm_playlist_history_str(fm_playlist_t *pl)
+// the refill worker builds requests too, so the history is read under its lock into the caller's buffer
+static const char* fm_playlist_history_str(fm_playlist_t *pl, char *buffer)
 {
-    static char buffer[1024];
-    memset(buffer, 0, sizeof(buffer));
+    buffer[0] = '\0';
     char* p = buffer;
+    pthread_mutex_lock(&pl->mutex_history);
     fm_history_t *hist = pl->history;
     while (hist) {
         sprintf(p, "|%d:%c", hist->sid, hist->state);
         p += strlen(p);
         hist = hist->next;
     }
+    pthread_mutex_unlock(&pl->mutex_history);
     return buffer;
 }
 
@@ -345,13 +473,29 @@ static void fm_playlist_push_front(fm_song_t **base, fm_song_t *song)
     if (song) {
         song->next = *base;
         *base = song;
-        printf("Playlist add song %d before %p\n", song->sid, *base);
+        fm_log_debug("Playlist add song %d before %p", song->sid, *base);
     }
 }
 
+// the songs the unfinished downloads were kept for are gone
+static void partials_clear(fm_playlist_t *pl)
+{
+    fm_partial_t *p;
+    pthread_mutex_lock(&pl->mutex_song_downloader);
+    while ((p = pl->partials)) {
+        pl->partials = p->next;
+        if (!pl->keep_partials)
+            unlink(p->filepath);
+        digest_stream_free(&p->digest);
+        free(p);
+    }
+    pthread_mutex_unlock(&pl->mutex_song_downloader);
+}
+
 static void fm_playlist_clear(fm_playlist_t *pl)
 {
-    printf("Clearing old songs\n");
+    fm_log_debug("Clearing old songs");
+    pl->generation++;
     pl->fm_player_stop();
     fm_song_t *s = pl->current;
     fm_song_t *next;
@@ -361,8 +505,11 @@ static void fm_playlist_clear(fm_playlist_t *pl)
         s = next;
     }
     pl->current = NULL;
+    partials_clear(pl);
 }
 
+static void *refill_thread(void *data);
+
 int fm_playlist_init(fm_playlist_t *pl, fm_playlist_config_t *config, void (*fm_player_stop)())
 {
     pl->history = NULL;
@@ -379,6 +526,22 @@ int fm_playlist_init(fm_playlist_t *pl, fm_playlist_config_t *config, void (*fm_
 
     // set up the downloader stack
     pl->stack = stack_init();
+    pl->local_check_pool = task_pool_init(N_LOCAL_CHECK_THREADS, 0);
+    pl->archive = (fm_archive_t *) malloc(sizeof(fm_archive_t));
+    fm_archive_init(pl->archive, pl->stack);
+    char path[256];
+    sprintf(path, "%s/validation.cache", pl->config.rpd_dir);
+    validator_cache_open(path);
+    sprintf(path, "%s/reports", pl->config.rpd_dir);
+    pl->reporter = (fm_reporter_t *) malloc(sizeof(fm_reporter_t));
+    fm_reporter_init(pl->reporter, pl->stack, path);
+    sprintf(path, "%s/cache", pl->config.rpd_dir);
+    validator_cache_set_roots(pl->config.music_dir, path);
+    pl->cache = (fm_cache_t *) malloc(sizeof(fm_cache_t));
+    fm_cache_init(pl->cache, path, (int64_t) pl->config.cache_size << 20);
+    sprintf(path, "%s/library.idx", pl->config.rpd_dir);
+    pl->library = (fm_library_t *) malloc(sizeof(fm_library_t));
+    fm_library_init(pl->library, path);
     // wire up the player
     pl->fm_player_stop = fm_player_stop;
     // set up the downloader stuff
@@ -388,19 +551,55 @@ int fm_playlist_init(fm_playlist_t *pl, fm_playlist_config_t *config, void (*fm_
     pthread_mutex_init(&pl->mutex_song_download_stop, NULL);
     pthread_mutex_init(&pl->mutex_current_download, NULL);
     pthread_mutex_init(&pl->mutex_song_downloader, NULL);
+    pl->transfers = NULL;
+    pl->partials = NULL;
+    pl->keep_partials = 0;
     pthread_cond_init(&pl->cond_song_download_restart, NULL);
+    pthread_mutex_init(&pl->mutex_history, NULL);
+    pthread_mutex_init(&pl->mutex_config, NULL);
+    // set up the background refill
+    pl->generation = 0;
+    pl->refill_quit = 0;
+    pl->refill_latency = 0;
+    pl->skip_rate = 0;
+    pl->refill_retry_at = 0;
+    pthread_mutex_init(&pl->mutex_refill, NULL);
+    pthread_cond_init(&pl->cond_refill, NULL);
+    pthread_create(&pl->tid_refill, NULL, refill_thread, pl);
     return 0;
 }
 
 void fm_playlist_cleanup(fm_playlist_t *pl)
 {
+    pthread_mutex_lock(&pl->mutex_refill);
+    pl->refill_quit = 1;
+    pthread_cond_signal(&pl->cond_refill);
+    pthread_mutex_unlock(&pl->mutex_refill);
+    pthread_join(pl->tid_refill, NULL);
     fm_playlist_hisotry_clear(pl);
+    pl->keep_partials = 1;
     fm_playlist_clear(pl);
+    // the archive workers still need the downloaders for the covers
+    fm_archive_cleanup(pl->archive);
+    free(pl->archive);
+    // whatever has not been sent yet is kept on disk for the next run
+    fm_reporter_cleanup(pl->reporter);
+    free(pl->reporter);
     stack_free(pl->stack);
+    fm_library_cleanup(pl->library);
+    free(pl->library);
+    task_pool_free(pl->local_check_pool);
+    fm_cache_cleanup(pl->cache);
+    free(pl->cache);
+    validator_cache_close();
     pthread_mutex_destroy(&pl->mutex_song_download_stop);
     pthread_mutex_destroy(&pl->mutex_current_download);
     pthread_mutex_destroy(&pl->mutex_song_downloader);
     pthread_cond_destroy(&pl->cond_song_download_restart);
+    pthread_mutex_destroy(&pl->mutex_history);
+    pthread_mutex_destroy(&pl->mutex_config);
+    pthread_mutex_destroy(&pl->mutex_refill);
+    pthread_cond_destroy(&pl->cond_refill);
 }
 
 static int fm_playlist_douban_parse_json(fm_playlist_t *pl, struct json_object *obj, fm_song_t **base)
@@ -410,15 +609,27 @@ static int fm_playlist_douban_parse_json(fm_playlist_t *pl, struct json_object *
     int i;
     int ret = json_object_get_int(json_object_object_get(obj, "r"));
     if (ret != 0) {
-        printf("API error: %s\n", json_object_get_string(json_object_object_get(obj, "err")));
+        fm_log_error("API error: %s", json_object_get_string(json_object_object_get(obj, "err")));
     } else {
-        printf("Douban playlist parsing new API response\n");
+        fm_log_debug("Douban playlist parsing new API response");
         array_list *songs = json_object_get_array(json_object_object_get(obj, "song"));
-        printf("parsed song\n");
-        int number_of_songs_to_download = MIN(songs->length, N_MAX_DOUBAN_SONGS_DOWNLOAD) - 1;
-        for (i = number_of_songs_to_download; i >= 0; i--) {
-            struct json_object *o = (struct json_object*) array_list_get_idx(songs, i);
-            fm_song_t *song = fm_song_douban_parse_json(pl, o);
+        fm_log_debug("parsed song");
+        int n = MIN(songs->length, N_MAX_DOUBAN_SONGS_DOWNLOAD);
+        fm_song_t *parsed[n];
+        enum song_copy copies[n];
+        for (i = 0; i < n; i++) {
+            parsed[i] = fm_song_douban_parse_json(pl, (struct json_object*) array_list_get_idx(songs, i));
+        }
+        fm_playlist_check_local(pl, parsed, copies, n);
+        for (i = n - 1; i >= 0; i--) {
+            fm_song_t *song = parsed[i];
+            if (!song)
+                continue;
+            song_resolve_local(song, copies[i]);
+            if (song->filepath[0] == '\0' && !valid_song_url(song->audio)) {
+                fm_song_free(pl, song);
+                continue;
+            }
             fm_playlist_push_front(base, song);
         }
     }
@@ -426,20 +637,30 @@ static int fm_playlist_douban_parse_json(fm_playlist_t *pl, struct json_object *
     return ret;
 }
 
+static void fm_playlist_jing_headers(fm_playlist_t *pl, char headers[2][128])
+{
+    fm_playlist_config_t config;
+    config_snapshot(pl, &config);
+    sprintf(headers[0], "Jing-A-Token-Header:%s", config.jing_atoken);
+    sprintf(headers[1], "Jing-R-Token-Header:%s", config.jing_rtoken);
+}
+
 static void fm_playlist_curl_jing_headers_init(fm_playlist_t *pl, struct curl_slist **slist)
 {
-    char buf[128];
+    char headers[2][128];
+    fm_playlist_jing_headers(pl, headers);
     *slist = NULL;
-    sprintf(buf, "Jing-A-Token-Header:%s", pl->config.jing_atoken);
-    *slist = curl_slist_append(*slist, buf);
-    sprintf(buf, "Jing-R-Token-Header:%s", pl->config.jing_rtoken);
-    *slist = curl_slist_append(*slist, buf);
+    *slist = curl_slist_append(*slist, headers[0]);
+    *slist = curl_slist_append(*slist, headers[1]);
 }
 
-static void fm_playlist_curl_jing_config(fm_playlist_t *pl, CURL *curl, char act, struct curl_slist *slist, void *data)
+// fill in the url and the fields to post for a Jing request
+// curl is only needed for the playlist requests
+static void fm_playlist_jing_request(fm_playlist_t *pl, CURL *curl, char act, void *data, char *url, char *buf)
 {
-    // initialize the buffer
-    char buf[1024], *format;
+    fm_playlist_config_t config;
+    char *format;
+    config_snapshot(pl, &config);
     switch(act) {
         case 'm':
             // get the music url links 
@@ -448,20 +669,20 @@ static void fm_playlist_curl_jing_config(fm_playlist_t *pl, CURL *curl, char act
             sprintf(buf, "mid=%s", (char *)data);
             break;
         case 'n': case 'p': case 's':
-            if (strcmp(pl->config.channel, JING_TOP_CHANNEL) == 0) {
-                printf("Jing Top channel detected\n");
+            if (strcmp(config.channel, JING_TOP_CHANNEL) == 0) {
+                fm_log_info("Jing Top channel detected");
                 format = "%s/app/fetch_top";
                 sprintf(buf, "ps=%d", N_JING_CHANNEL_FETCH);
-            } else if (strcmp(pl->config.channel, JING_PSN_CHANNEL) == 0) {
-                printf("Jing Personal channel detected\n");
+            } else if (strcmp(config.channel, JING_PSN_CHANNEL) == 0) {
+                fm_log_info("Jing Personal channel detected");
                 format = "%s/app/fetch_psnrd";
-                sprintf(buf, "uid=%d&ps=%d", pl->config.jing_uid, N_JING_CHANNEL_FETCH);
+                sprintf(buf, "uid=%d&ps=%d", config.jing_uid, N_JING_CHANNEL_FETCH);
             } else {
-                printf("Jing Normal channel detected\n");
+                fm_log_info("Jing Normal channel detected");
                 format = "%s/search/jing/fetch_pls";
                 // escape the query
-                char *arg = curl_easy_escape(curl, pl->config.channel, 0);
-                sprintf(buf, "u=%d&q=%s&ps=%d&tid=0&mt=&ss=true", pl->config.jing_uid, arg, N_JING_CHANNEL_FETCH);
+                char *arg = curl_easy_escape(curl, config.channel, 0);
+                sprintf(buf, "u=%d&q=%s&ps=%d&tid=0&mt=&ss=true", config.jing_uid, arg, N_JING_CHANNEL_FETCH);
                 curl_free(arg);
             }
             break;
@@ -472,28 +693,41 @@ static void fm_playlist_curl_jing_config(fm_playlist_t *pl, CURL *curl, char act
             break;
         case 'r': case 'u':
             format = "%s/music/post_love_song";
-            printf("Rating song for jing: tid = %d\n", pl->current->sid);
-            sprintf(buf, "uid=%d&tid=%d", pl->config.jing_uid, pl->current->sid);
+            fm_log_debug("Rating song for jing: tid = %d", pl->current->sid);
+            sprintf(buf, "uid=%d&tid=%d", config.jing_uid, pl->current->sid);
             break;
         case 'b':
             format = "%s/music/post_hate_song";
-            sprintf(buf, "uid=%d&tid=%d", pl->config.jing_uid, pl->current->sid);
+            sprintf(buf, "uid=%d&tid=%d", config.jing_uid, pl->current->sid);
             break;
         case 'i':
             format = "%s/music/fetch_track_infos";
             // leveraging the data field; make sure the data and act are set accordingly to avoid problems
-            sprintf(buf, "uid=%d&tid=%d", pl->config.jing_uid, *(int *)data);
+            sprintf(buf, "uid=%d&tid=%d", config.jing_uid, *(int *)data);
             break;
     }
 
-    curl_easy_setopt(curl, CURLOPT_COPYPOSTFIELDS, buf);
+    sprintf(url, format, pl->jing_api);
+}
 
-    sprintf(buf,format, pl->jing_api);
-    curl_easy_setopt(curl, CURLOPT_URL, buf);
+static void fm_playlist_curl_jing_config(fm_playlist_t *pl, CURL *curl, char act, struct curl_slist *slist, void *data)
+{
+    // initialize the buffer
+    char url[256], buf[1024];
+    fm_playlist_jing_request(pl, curl, act, data, url, buf);
+    curl_easy_setopt(curl, CURLOPT_COPYPOSTFIELDS, buf);
+    curl_easy_setopt(curl, CURLOPT_URL, url);
     // set up the headers; should call init headers before this function
     curl_easy_setopt(curl, CURLOPT_HTTPHEADER, slist);
 }
 
+static void config_set_channel(fm_playlist_t *pl, const char *channel)
+{
+    pthread_mutex_lock(&pl->mutex_config);
+    strcpy(pl->config.channel, channel);
+    pthread_mutex_unlock(&pl->mutex_config);
+}
+
 int fm_playlist_update_mode(fm_playlist_t *pl, char *channel)
 {
     char *address;
@@ -502,17 +736,21 @@ int fm_playlist_update_mode(fm_playlist_t *pl, char *channel)
         // this is valid number
         if (strcmp(channel, LOCAL_CHANNEL) == 0) {
             if (pl->config.music_dir[0] == '\0') {
-                printf("Music directory is not set. Unable to use local channel.\n");
+                fm_log_error("Music directory is not set. Unable to use local channel.");
                 return -2;
             }
+            // bring the library up to date the first time the local channel is used; from then on the watcher
+            // keeps it in sync and refills are served from memory
+            if (!pl->library->watching && fm_library_scan(pl->library, pl->config.music_dir) >= 0)
+                fm_library_watch(pl->library);
             pl->mode = plLocal;
         } else
             pl->mode = plDouban;
-        strcpy(pl->config.channel, channel);
+        config_set_channel(pl, channel);
     } else {
         pl->mode = plJing;
         if (strcmp(channel, JING_RAND_CHANNEL) == 0) {
-            printf("Jing random natural language channel detected\n");
+            fm_log_info("Jing random natural language channel detected");
             // we need to retrieve a random keyword for jing
             downloader_t *d = stack_get_idle_downloader(pl->stack, dMem);
             struct curl_slist *slist;
@@ -524,26 +762,66 @@ int fm_playlist_update_mode(fm_playlist_t *pl, char *channel)
             json_object *res = fm_jing_parse_json_result(obj);
             if (res) {
                 const char *ch = json_object_get_string(json_object_object_get(array_list_get_idx(json_object_get_array(json_object_object_get(res, "items")), 0), "sw"));
-                printf("Obtained random natural language channel: %s\n", ch);
-                strcpy(pl->config.channel, ch);
+                fm_log_info("Obtained random natural language channel: %s", ch);
+                config_set_channel(pl, ch);
             }
             json_object_put(obj);
             curl_slist_free_all(slist);
             stack_downloader_cleanup(pl->stack, d);
         } else {
-            strcpy(pl->config.channel, channel);
+            config_set_channel(pl, channel);
         }
     }
     return 0;
 }
 
+void fm_playlist_set_kbps(fm_playlist_t *pl, const char *kbps)
+{
+    pthread_mutex_lock(&pl->mutex_config);
+    snprintf(pl->config.kbps, sizeof(pl->config.kbps), "%s", kbps);
+    pthread_mutex_unlock(&pl->mutex_config);
+}
+
+void fm_playlist_reload(fm_playlist_t *pl, const fm_playlist_config_t *config)
+{
+    int dir_changed;
+    pthread_mutex_lock(&pl->mutex_config);
+    dir_changed = strcmp(pl->config.music_dir, config->music_dir) != 0;
+    pl->config.douban_uid = config->douban_uid;
+    strcpy(pl->config.uname, config->uname);
+    strcpy(pl->config.douban_token, config->douban_token);
+    pl->config.expire = config->expire;
+    strcpy(pl->config.kbps, config->kbps);
+    strcpy(pl->config.music_dir, config->music_dir);
+    pl->config.download_lyrics = config->download_lyrics;
+    pl->config.cache_size = config->cache_size;
+    pl->config.jing_uid = config->jing_uid;
+    strcpy(pl->config.jing_atoken, config->jing_atoken);
+    strcpy(pl->config.jing_rtoken, config->jing_rtoken);
+    pthread_mutex_unlock(&pl->mutex_config);
+
+    fm_cache_set_quota(pl->cache, (int64_t) config->cache_size << 20);
+    if (dir_changed) {
+        char cache_dir[256];
+        fm_log_info("Music directory changed to %s", config->music_dir);
+        snprintf(cache_dir, sizeof(cache_dir), "%s/cache", pl->config.rpd_dir);
+        validator_cache_set_roots(config->music_dir, cache_dir);
+        // the songs already queued keep playing from wherever they are; the library follows the new directory
+        // right away if the local channel is on, or the next time it is switched to otherwise
+        if (pl->library->watching)
+            fm_library_unwatch(pl->library);
+        if (pl->mode == plLocal && config->music_dir[0] != '\0' && fm_library_scan(pl->library, config->music_dir) >= 0)
+            fm_library_watch(pl->library);
+    }
+}
+
 static int fm_playlist_jing_parse_json(fm_playlist_t *pl, struct json_object *obj, fm_song_t **base)
 {
     // here we are only going to parse the fetch_pls (conceivably)
     int ret = 0;
     json_object *res = fm_jing_parse_json_result(obj);
     if (res)  {
-        printf("Jing playlist parsing new API response\n");
+        fm_log_debug("Jing playlist parsing new API response");
         array_list *song_objs = json_object_get_array(json_object_object_get(res, "items"));
         if (!song_objs) {
             // then we should try the top field
@@ -551,18 +829,27 @@ static int fm_playlist_jing_parse_json(fm_playlist_t *pl, struct json_object *ob
             song_objs = json_object_get_array(json_object_object_get(res, "top"));
         }
         if (song_objs) {
-            printf("parsed song\n");
+            fm_log_debug("parsed song");
             // we should make use of a multihandle that accelerates the pulling process
             int len = song_objs->length;
-            printf("Number of songs returned is %d\n", len);
+            fm_log_debug("Number of songs returned is %d", len);
             if (len > 0) {
                 int i;
-                fm_song_t *songs[len];
+                fm_song_t *songs[len], *parsed[len];
+                enum song_copy copies[len];
                 int front = 0, end = len;
                 for (i=0; i<len; i++) {
-                    struct json_object *o = (struct json_object*) array_list_get_idx(song_objs, i);
-                    fm_song_t *s = fm_song_jing_parse_json(pl, o);
+                    parsed[i] = fm_song_jing_parse_json(pl, (struct json_object*) array_list_get_idx(song_objs, i));
+                }
+                fm_playlist_check_local(pl, parsed, copies, len);
+                for (i=0; i<len; i++) {
+                    fm_song_t *s = parsed[i];
                     if (s) {
+                        song_resolve_local(s, copies[i]);
+                        if (s->filepath[0] == '\0' && s->audio[0] == '\0') {
+                            fm_song_free(pl, s);
+                            continue;
+                        }
                         if (s->audio[0] != '\0') {
                             songs[front++] = s;
                         } else {
@@ -571,7 +858,7 @@ static int fm_playlist_jing_parse_json(fm_playlist_t *pl, struct json_object *ob
                     }
                 }
                 // get the downloaders
-                printf("Jing song parser: %d songs required to request url and like info\n", front);
+                fm_log_debug("Jing song parser: %d songs required to request url and like info", front);
                 downloader_t *dls[front * 2];
                 stack_get_idle_downloaders(pl->stack, dls, front * 2, dMem);
 
@@ -585,20 +872,20 @@ static int fm_playlist_jing_parse_json(fm_playlist_t *pl, struct json_object *ob
                 }
 
                 stack_perform_until_all_done(pl->stack, dls, front * 2);
-                printf("Jing song parsing finished\n");
+                fm_log_debug("Jing song parsing finished");
                 for (i=0; i<front; i++) {
                     json_object *o = json_tokener_parse(dls[i]->content.mbuf->data);
                     json_object *r = fm_jing_parse_json_result(o);
                     if (r) {
                         strcpy(songs[i]->audio, json_object_get_string(r));
-                        printf("Successfully retrieved the audio url %s for song title: %s\n", songs[i]->audio, songs[i]->title);
+                        fm_log_debug("Successfully retrieved the audio url %s for song title: %s", songs[i]->audio, songs[i]->title);
                     }
                     json_object_put(o);
                     o = json_tokener_parse(dls[i+front]->content.mbuf->data);
                     r = fm_jing_parse_json_result(o);
                     if (r) {
                         songs[i]->like = *json_object_get_string(json_object_object_get(r, "lvd")) == 'l' ? 1 : 0;
-                        printf("Song %s is liked? %d\n", songs[i]->title, songs[i]->like);
+                        fm_log_debug("Song %s is liked? %d", songs[i]->title, songs[i]->like);
                     }
                     if (valid_song_url(songs[i]->audio))
                         fm_playlist_push_front(base, songs[i]);
@@ -615,15 +902,15 @@ static int fm_playlist_jing_parse_json(fm_playlist_t *pl, struct json_object *ob
                 curl_slist_free_all(slist);
                 stack_downloaders_cleanup(pl->stack, dls, front * 2);
             } else {
-                printf("Jing song parser: no song available for the given channel\n");
+                fm_log_warn("Jing song parser: no song available for the given channel");
                 ret = -1;
             }  
         } else {
-            printf("No song array found\n");
+            fm_log_warn("No song array found");
             ret = -1;
         }
     } else {
-        printf("Jing song parser: no result returned from Jing.fm\n");
+        fm_log_warn("Jing song parser: no result returned from Jing.fm");
         ret = -1;
     }
 
@@ -631,147 +918,210 @@ static int fm_playlist_jing_parse_json(fm_playlist_t *pl, struct json_object *ob
     return ret;
 }
 
-static int fm_playlist_local_dump_parse_report(fm_playlist_t *pl, fm_song_t **base)
-{
-    char buf[1024];
-    sprintf(buf,
-            "export LC_ALL=en_US.UTF-8;"
-            "IFS='\n';"
-            "args=($(find $'%s' -type f -mmin +2 \\( -name '*.mp3' -o -name '*.m4a' \\) | gshuf | head -n '%d'));"
-            "mutagen -f '{path}\n{title}\n{artist}\n{wors}\n{album}\n{year}\n{kbps}\n{len}' \"${args[@]}\";"
-            , pl->config.music_dir, N_LOCAL_CHANNEL_FETCH);
-    printf("Local channel refilling command is: %s\n", buf);
-    // the field reference counter
-    FILE *fp = popen(buf, "r");
-    if (!fp) {
-        printf("Failed to open the pipe for the command to find the local music\n");
-        return -1;
+// stamp the songs that came with a playlist request sent at requested
+static void songs_trace_fetched(fm_song_t *list, int64_t requested)
+{
+    for (; list; list = list->next) {
+        fm_trace_set(&list->trace, tsRequested, requested);
+        fm_trace_mark(&list->trace, tsParsed);
     }
-    fm_song_t *song = NULL;
-    int fl = 8, fn = fl - 1;
-    char ch = '\n', *lastf = NULL;
-    int len = 0, size = 0;
-    while (1) {
-        // get the next character
-        if (ch == '\n' || ch == EOF) {
-            if (lastf) {
-                // append the 0 at the end
-                lastf[len] = '\0';
-                switch (fn) {
-                    case 0: {
-                        // if path is nil then we should break out
-                        if (lastf[0] == '\0') {
-                            if (song)
-                                fm_song_free(pl, song);
-                            printf("Empty path field for song. Stopped parsing\n");
-                            return -1;
-                        }
-                        // ext is the ext given in the filepath
-                        char *p = lastf;
-                        int exti = -1;
-                        size = sizeof(song->ext);
-                        song->ext[0] = '\0';
-                        while (*p != '\0') {
-                            if (*p == '.') {
-                                exti = 0;
-                                // clear all fields for the ext
-                                memset(song->ext, 0, size);
-                            } else if (exti >= 0 && exti < size-1) {
-                                song->ext[exti++] = *p;
-                            } 
-                            p++;
-                        }
-                        printf("Obtained extension: %s\n", song->ext);
-                        break;
-                    }
-                    case 5: song->pubdate = atoi(lastf); break;
-                    case 7: song->length = atoi(lastf); break;
-                    default: break;
-                }
-            }
-            printf("Obtained song field: %s for song %p\n", lastf, song);
-            if (fn == fl - 1) {
-                // push the last song
-                fm_playlist_push_front(base, song);
-                if (ch == EOF)
-                    break; 
-                song = song_init(pl);
-                song->like = 1;
-            }
-            fn = (fn+1) % fl;
-            // set up the last field
-            switch(fn) {
-                case 0: lastf = song->filepath; size = sizeof(song->filepath); break;
-                case 1: lastf = song->title; size = sizeof(song->title); break;
-                case 2: lastf = song->artist; size = sizeof(song->artist); break;
-                case 3: lastf = song->url; size = sizeof(song->url); break;
-                case 4: lastf = song->album; size = sizeof(song->album); break;
-                case 5: lastf = buf; size = sizeof(buf); break;
-                case 6: lastf = song->kbps; size = sizeof(song->kbps); break;
-                case 7: lastf = buf; size = sizeof(buf); break;
-            }
-            len = 0;
-        } else {
-            if (len < size - 1)
-                lastf[len++] = ch;
-            else {
-                printf("Buffer overflow for song fields. Last recorded field = %s\n", lastf);
-                return -1;
-            }
-        }
-        ch = fgetc(fp);
+}
+
+static int fm_playlist_local_fill(fm_playlist_t *pl, fm_song_t **base)
+{
+    fm_song_t *songs[N_LOCAL_CHANNEL_FETCH];
+    int64_t requested = fm_trace_now();
+    int i, n;
+    for (i = 0; i < N_LOCAL_CHANNEL_FETCH; i++) {
+        songs[i] = song_init(pl);
+        songs[i]->like = 1;
+        songs[i]->local = 1;
     }
-    pclose(fp);
-    return 0;
+    n = fm_library_draw(pl->library, songs, N_LOCAL_CHANNEL_FETCH);
+    fm_log_info("Local channel drew %d songs from the library", n);
+    for (i = 0; i < N_LOCAL_CHANNEL_FETCH; i++) {
+        if (i < n) {
+            songs_trace_fetched(songs[i], requested);
+            fm_playlist_push_front(base, songs[i]);
+        } else
+            free(songs[i]);
+    }
+    return n > 0 ? 0 : -1;
 }
 
-static void fm_playlist_curl_douban_config(fm_playlist_t *pl, CURL *curl, char act)
+// the refill worker builds requests as well, while the executor might be freeing the current song
+static int current_sid(fm_playlist_t *pl)
+{
+    int sid;
+    pthread_mutex_lock(&pl->mutex_current_download);
+    sid = pl->current ? pl->current->sid : 0;
+    pthread_mutex_unlock(&pl->mutex_current_download);
+    return sid;
+}
+
+// must not be called with mutex_current_download held
+static void fm_playlist_douban_url(fm_playlist_t *pl, char act, char *url)
 {
-    char url[1536], opt_arg[1050] = "";
+    fm_playlist_config_t config;
+    char opt_arg[1050] = "", history[1024];
+    config_snapshot(pl, &config);
     switch(act) {
         case 'r': case 'u': case 'e':
             break;
         default:
-            if (pl->config.kbps[0] == '\0') 
-                sprintf(opt_arg, "&h=%s", fm_playlist_history_str(pl));
+            if (config.kbps[0] == '\0') 
+                sprintf(opt_arg, "&h=%s", fm_playlist_history_str(pl, history));
             else
-                sprintf(opt_arg, "&h=%s&kbps=%s", fm_playlist_history_str(pl), pl->config.kbps);
+                sprintf(opt_arg, "&h=%s&kbps=%s", fm_playlist_history_str(pl, history), config.kbps);
     }
-    printf("Playlist send report: %d:%c\n", pl->config.douban_uid, act);
+    fm_log_debug("Playlist send report: %d:%c", config.douban_uid, act);
     sprintf(url, "%s?app_name=%s&version=%s&user_id=%d&expire=%d&token=%s&channel=%s&sid=%d&type=%c%s",
-            pl->douban_api, pl->app_name, pl->version, pl->config.douban_uid, pl->config.expire, pl->config.douban_token, pl->config.channel, pl->current ? pl->current->sid : 0, act, opt_arg);
-    printf("Playlist request: %s\n", url);
+            pl->douban_api, pl->app_name, pl->version, config.douban_uid, config.expire, config.douban_token, config.channel, current_sid(pl), act, opt_arg);
+    fm_log_debug("Playlist request: %s", url);
+}
 
+static void fm_playlist_curl_douban_config(fm_playlist_t *pl, CURL *curl, char act)
+{
+    char url[1536];
+    fm_playlist_douban_url(pl, act, url);
     curl_easy_setopt(curl, CURLOPT_URL, url);
 }
 
+// hand a report that nobody waits for over to the reporter, which sends it in the background
+static void fm_playlist_queue_report(fm_playlist_t *pl, char act)
+{
+    fm_report_t report;
+    memset(&report, 0, sizeof(report));
+    report.act = act;
+    report.sid = pl->current ? pl->current->sid : 0;
+    report.queued = time(NULL);
+    switch (pl->mode) {
+        case plDouban:
+            report.service = 'd';
+            fm_playlist_douban_url(pl, act, report.url);
+            break;
+        case plJing:
+            report.service = 'j';
+            fm_playlist_jing_request(pl, NULL, act, NULL, report.url, report.body);
+            fm_playlist_jing_headers(pl, report.headers);
+            break;
+        default:
+            return;
+    }
+    fm_reporter_submit(pl->reporter, &report);
+}
+
+static void transfer_key(fm_song_t *song, char *key)
+{
+    if (song->sid != 0)
+        fm_cache_key(key, song->sid, song->kbps);
+    else
+        strcpy(key, song->audio);
+}
+
+// expects mutex_song_downloader to be held
+static fm_transfer_t *transfer_find(fm_playlist_t *pl, const char *key)
+{
+    fm_transfer_t *t;
+    for (t = pl->transfers; t; t = t->next) {
+        if (strcmp(t->key, key) == 0)
+            return t;
+    }
+    return NULL;
+}
+
+// expects mutex_song_downloader to be held
+static void transfer_attach(fm_transfer_t *t, fm_song_t *s)
+{
+    strcpy(s->filepath, t->filepath);
+    s->downloader = t->downloader;
+    if (t->digest[0] != '\0')
+        validator_set_digest(&s->validator, t->digest);
+    s->transfer = t;
+    s->transfer_next = t->songs;
+    t->songs = s;
+    t->refs++;
+    fm_trace_mark(&s->trace, tsDownloadStart);
+}
+
+// expects mutex_song_downloader to be held
+static fm_partial_t *partial_take(fm_playlist_t *pl, const char *key)
+{
+    fm_partial_t **p, *partial;
+    for (p = &pl->partials; *p; p = &(*p)->next) {
+        if (strcmp((*p)->key, key) == 0) {
+            partial = *p;
+            *p = partial->next;
+            return partial;
+        }
+    }
+    return NULL;
+}
+
 // the recycle flag tells the function to reinit the states beforing proceeding
 static int song_downloader_init(fm_playlist_t *pl, downloader_t *dl, int recycle) {
     int ret = -1;
+    char key[256];
     pthread_mutex_lock(&pl->mutex_current_download);
     if (pl->current_download) {
-        fm_song_t *s = *pl->current_download;
-        while (s && !valid_song_url(s->audio)) {
-            printf("Skipped song %s with audio field %s\n", s->title, s->audio);
-            s = s->next;
+        fm_song_t **slot = pl->current_download, *s;
+        pthread_mutex_lock(&pl->mutex_song_downloader);
+        while ((s = *slot)) {
+            if (!valid_song_url(s->audio)) {
+                fm_log_warn("Skipped song %s with audio field %s", s->title, s->audio);
+            } else if (!s->transfer) {
+                fm_transfer_t *t;
+                transfer_key(s, key);
+                if (!(t = transfer_find(pl, key)))
+                    break;
+                // the same song is already being (or has been) downloaded for another entry in the playlist
+                fm_log_info("Song %s shares the download of %s", s->title, t->filepath);
+                transfer_attach(t, s);
+            }
+            slot = &s->next;
         }
         if (s) {
+            fm_partial_t *partial = partial_take(pl, key);
             ret = 0;
             if (recycle) {
                 fdownloader_config(dl);
             }
+            if (partial) {
+                if (fdownloader_resume(dl, partial->filepath, partial->etag, &partial->digest, partial->hashed) == 0)
+                    fm_log_info("Resuming the download of %s at %lld bytes", s->title, (long long) partial->hashed);
+                else
+                    unlink(partial->filepath);
+                digest_stream_free(&partial->digest);
+                free(partial);
+            }
             // set the url
             // checking for the validity of the url
-            printf("Setting the url %s(%s) for the song downloader %p\n", s->audio, s->title, dl);
+            fm_log_debug("Setting the url %s(%s) for the song downloader %p", s->audio, s->title, dl);
             curl_easy_setopt(dl->curl, CURLOPT_URL, s->audio);
-            printf("File path %s is copied to the song\n", dl->content.fbuf->filepath);
-            strcpy(s->filepath, dl->content.fbuf->filepath);
             curl_easy_setopt(dl->curl, CURLOPT_LOW_SPEED_LIMIT, 5000);
             curl_easy_setopt(dl->curl, CURLOPT_LOW_SPEED_TIME, 15);
-            s->downloader = dl;
-            dl->data = s;
+            fm_transfer_t *t = (fm_transfer_t *) malloc(sizeof(fm_transfer_t));
+            strcpy(t->key, key);
+            strcpy(t->filepath, dl->content.fbuf->filepath);
+            t->downloader = dl;
+            dl->first_byte = 0;
+            t->digest[0] = '\0';
+            t->etag[0] = '\0';
+            t->songs = NULL;
+            t->refs = 0;
+            t->liked = 0;
+            t->next = pl->transfers;
+            pl->transfers = t;
+            fm_log_debug("File path %s is copied to the song", t->filepath);
+            s->validator.digest[0] = '\0';
+            transfer_attach(t, s);
+            dl->data = t;
             pl->current_download = &s->next;
+        } else {
+            // no need to look at the songs attached so far again
+            pl->current_download = slot;
         }
+        pthread_mutex_unlock(&pl->mutex_song_downloader);
     } 
     pthread_mutex_unlock(&pl->mutex_current_download);
     return ret;
@@ -787,7 +1137,7 @@ static downloader_t *process_download(downloader_stack_t *stack, downloader_t **
     pthread_mutex_lock(&pl->mutex_song_download_stop);
     if (pl->song_download_stop) {
         pl->song_download_stop = 0;
-        printf("Download process waiting for signal of restarting\n");
+        fm_log_debug("Download process waiting for signal of restarting");
         pthread_cond_wait(&pl->cond_song_download_restart, &pl->mutex_song_download_stop);
     } 
     // perform any download if we can
@@ -810,7 +1160,7 @@ static downloader_t *process_download(downloader_stack_t *stack, downloader_t **
     pthread_mutex_unlock(&pl->mutex_song_download_stop);
     if (all_finished) {
         // simply return
-        printf("All downloads finished\n");
+        fm_log_debug("All downloads finished");
         return start[0];
     }
     return NULL;
@@ -818,85 +1168,162 @@ static downloader_t *process_download(downloader_stack_t *stack, downloader_t **
 
 static void* download_thread(void *data)
 {
-    printf("Download thread started\n");
+    fm_log_debug("Download thread started");
     fm_playlist_t *pl = (fm_playlist_t *)data;
     // first get the downloaders
     downloader_t *song_downloaders[N_SONG_DOWNLOADERS];
-    int i;
-    // initialize and lock the downloaders; doing this in the main thread to guarantee no race condition
-    printf("Getting idle song downloaders\n");
-    stack_get_idle_downloaders(pl->stack, song_downloaders, N_SONG_DOWNLOADERS, dFile);
-    for (i=0; i<N_SONG_DOWNLOADERS; i++) {
-        printf("Intializing the song downloader %p\n", song_downloaders[i]);
-        song_downloader_init(pl, song_downloaders[i], 0); 
-        // no need to call stack downloader init since when they are added first time that will be automatically called
-    }
-    printf("Start performing\n");
-    stack_perform_until_condition_met(pl->stack, song_downloaders, N_SONG_DOWNLOADERS, pl, process_download);
-    stack_downloaders_cleanup(pl->stack, song_downloaders, N_SONG_DOWNLOADERS);
-    pl->tid_download = 0;
+    int i, pending;
+    do {
+        // initialize and lock the downloaders; doing this in the main thread to guarantee no race condition
+        fm_log_debug("Getting idle song downloaders");
+        stack_get_idle_downloaders(pl->stack, song_downloaders, N_SONG_DOWNLOADERS, dFile);
+        for (i=0; i<N_SONG_DOWNLOADERS; i++) {
+            fm_log_debug("Intializing the song downloader %p", song_downloaders[i]);
+            song_downloader_init(pl, song_downloaders[i], 0); 
+            // no need to call stack downloader init since when they are added first time that will be automatically called
+        }
+        fm_log_debug("Start performing");
+        stack_perform_until_condition_met(pl->stack, song_downloaders, N_SONG_DOWNLOADERS, pl, process_download);
+        stack_downloaders_cleanup(pl->stack, song_downloaders, N_SONG_DOWNLOADERS);
+        // songs queued after the last look found this thread still running, so they are left to it
+        pthread_mutex_lock(&pl->mutex_current_download);
+        pending = pl->current_download && *pl->current_download;
+        if (!pending)
+            pl->tid_download = 0;
+        pthread_mutex_unlock(&pl->mutex_current_download);
+    } while (pending);
     return data;
 }
 
+// expects mutex_current_download to be held
 static void song_downloader_all_start(fm_playlist_t *pl)
 {
     if (!pl->tid_download) {
-        printf("Creating the download thread\n");
+        fm_log_debug("Creating the download thread");
         // need to synchronize
         // do not proceed to play the music unless you are sure that the first song has been assigned a downloader
         pthread_create(&pl->tid_download, NULL, download_thread, pl);
     }
 }
 
-// base: the base to append the result in front of (NULL if result should be discarded)
-// clear_old, whether the old songs should be cleared; only used when base is not NULL
-// fallback: whether fallback should be used (use local station when network unavailable)
-static int fm_playlist_send_report(fm_playlist_t *pl, char act, fm_song_t **base, int clear_old, int fallback)
+// the number of songs queued after the current one; expects mutex_current_download to be held
+static int fm_playlist_depth(fm_playlist_t *pl)
 {
-    if (pl->mode == plLocal) {
-        pthread_mutex_lock(&pl->mutex_current_download);
-        if (clear_old)
-            fm_playlist_clear(pl);
-        int ret = fm_playlist_local_dump_parse_report(pl, base);
-        pthread_mutex_unlock(&pl->mutex_current_download);
-        return ret;
+    int n = 0;
+    fm_song_t *s;
+    for (s = pl->current->next; s; s = s->next) {
+        n++;
     }
+    return n;
+}
+
+// how many songs to keep queued: more when refills are slow, since the queue drains while they are in flight,
+// and more when songs keep being skipped, since it then drains faster
+static int fm_playlist_refill_target(fm_playlist_t *pl)
+{
+    int target = PLAYLIST_REFILL_THRESHOLD + (int) (pl->refill_latency / 1000 + pl->skip_rate * PLAYLIST_REFILL_SKIP_DEPTH + 0.5);
+    return MIN(target, PLAYLIST_REFILL_MAX_DEPTH);
+}
 
+static void fm_playlist_refill_wake(fm_playlist_t *pl)
+{
+    pthread_mutex_lock(&pl->mutex_refill);
+    pthread_cond_signal(&pl->cond_refill);
+    pthread_mutex_unlock(&pl->mutex_refill);
+}
+
+// record a song change for the skip rate and let the refill worker top up the queue
+static void fm_playlist_refill_note(fm_playlist_t *pl, int skipped)
+{
+    pthread_mutex_lock(&pl->mutex_refill);
+    pl->skip_rate += PLAYLIST_REFILL_SMOOTHING * ((skipped ? 1 : 0) - pl->skip_rate);
+    pthread_cond_signal(&pl->cond_refill);
+    pthread_mutex_unlock(&pl->mutex_refill);
+}
+
+// fetch the songs for a playlist request into *fetched (in playing order) without touching the playlist itself
+static int fm_playlist_fetch(fm_playlist_t *pl, char act, fm_song_t **fetched)
+{
     int (*parse_fun) (fm_playlist_t *pl, json_object *obj, fm_song_t **base);
-    downloader_t *dl = stack_get_idle_downloader(pl->stack, base ? dMem : dDrop);
-    printf("### Downloader obtained for playlist retrieval is %p\n", dl);
-    printf("### playlist mode is %d\n", pl->mode);
+    int64_t requested = fm_trace_now();
+    downloader_t *dl = stack_get_idle_downloader(pl->stack, dMem);
+    fm_log_debug("### Downloader obtained for playlist retrieval is %p", dl);
+    fm_log_debug("### playlist mode is %d", pl->mode);
     switch (pl->mode) {
         case plDouban: // we should first request the downloader; obtain the curl handle and then 
-            printf("### Entered Douban playlist retieval mode\n");
+            fm_log_debug("### Entered Douban playlist retieval mode");
             fm_playlist_curl_douban_config(pl, dl->curl, act);
-            printf("### Curl config finished\n");
+            fm_log_debug("### Curl config finished");
             stack_perform_until_done(pl->stack, dl);
-            printf("### Downloader finished is %p; idle %d\n", dl, dl->idle);
+            fm_log_debug("### Downloader finished is %p; idle %d", dl, dl->idle);
             parse_fun = fm_playlist_douban_parse_json;
             break;
         case plJing: {
-            printf("### Entered Jing playlist retrieval mode\n");
+            fm_log_debug("### Entered Jing playlist retrieval mode");
             struct curl_slist *slist;
             fm_playlist_curl_jing_headers_init(pl, &slist);
             // the jing config shouldn't involve any data for the playlist. Otherwise there's some error
             fm_playlist_curl_jing_config(pl, dl->curl, act, slist, NULL);
-            printf("### Curl config finished\n");
+            fm_log_debug("### Curl config finished");
             stack_perform_until_done(pl->stack, dl);
-            printf("### Downloader finished is %p; idle %d\n", dl, dl->idle);
+            fm_log_debug("### Downloader finished is %p; idle %d", dl, dl->idle);
             curl_slist_free_all(slist);
             parse_fun = fm_playlist_jing_parse_json;
             break;
         }
-        default: return -1;
+        default:
+            stack_downloader_cleanup(pl->stack, dl);
+            return -1;
     }
-    int reset_current = clear_old || base == &pl->current;
-    if (!base)
+    fm_log_debug("Attempting to parse the output");
+    int ret = parse_fun(pl, json_tokener_parse(dl->content.mbuf->data), fetched);
+    if (ret != 0)
+        fm_log_warn("Some error occurred during the process; Maybe network is down. Output is %s", dl->content.mbuf->data);
+    else
+        songs_trace_fetched(*fetched, requested);
+    stack_downloader_cleanup(pl->stack, dl);
+    return ret;
+}
+
+// insert the songs in list in front of *base
+static void fm_playlist_splice(fm_song_t **base, fm_song_t *list)
+{
+    fm_song_t *last;
+    if (!list)
+        return;
+    for (last = list; last->next; last = last->next);
+    last->next = *base;
+    *base = list;
+}
+
+// base: the base to append the result in front of (NULL if result should be discarded)
+// clear_old, whether the old songs should be cleared; only used when base is not NULL
+// fallback: whether fallback should be used (use local station when network unavailable)
+static int fm_playlist_send_report(fm_playlist_t *pl, char act, fm_song_t **base, int clear_old, int fallback)
+{
+    if (pl->mode == plLocal) {
+        pthread_mutex_lock(&pl->mutex_current_download);
+        if (clear_old)
+            fm_playlist_clear(pl);
+        int ret = fm_playlist_local_fill(pl, base);
+        pthread_mutex_unlock(&pl->mutex_current_download);
+        fm_playlist_refill_wake(pl);
+        return ret;
+    }
+
+    if (!base) {
+        // track changes never wait for reports
+        fm_playlist_queue_report(pl, act);
         return 0;
+    }
+
+    fm_song_t *fetched = NULL;
+    int ret = fm_playlist_fetch(pl, act, &fetched);
+    int reset_current = clear_old || base == &pl->current;
     if (reset_current) {
         // stop the player first
         pl->fm_player_stop();
-        printf("Trying to stop all downloaders\n");
+        fm_log_debug("Trying to stop all downloaders");
         pthread_mutex_lock(&pl->mutex_song_download_stop);
         pl->song_download_stop = 1;
         pthread_mutex_unlock(&pl->mutex_song_download_stop);
@@ -906,12 +1333,14 @@ static int fm_playlist_send_report(fm_playlist_t *pl, char act, fm_song_t **base
     if (clear_old) {
         fm_playlist_clear(pl);
     }
-    printf("Attempting to parse the output\n");
-    int ret = parse_fun(pl, json_tokener_parse(dl->content.mbuf->data), base);
-    stack_downloader_cleanup(pl->stack, dl);
-    if (ret == 0 && reset_current) {
+    fm_playlist_splice(base, fetched);
+    if (ret == 0 && reset_current && pl->current) {
         pl->current_download = &pl->current;
-        printf("Resetting current download to %s / %s with url %s\n", (*pl->current_download)->artist, (*pl->current_download)->title, (*pl->current_download)->audio);
+        fm_log_debug("Resetting current download to %s / %s with url %s", (*pl->current_download)->artist, (*pl->current_download)->title, (*pl->current_download)->audio);
+    }
+    if (ret == 0) {
+        fm_log_debug("Starting song downloaders");
+        song_downloader_all_start(pl);
     }
     pthread_mutex_unlock(&pl->mutex_current_download);
 
@@ -924,21 +1353,84 @@ static int fm_playlist_send_report(fm_playlist_t *pl, char act, fm_song_t **base
         pthread_mutex_unlock(&pl->mutex_song_download_stop);
     }  
 
-    if (ret == 0) {
-        printf("Starting song downloaders\n");
-        song_downloader_all_start(pl);
-    } else {
-        printf("Some error occurred during the process; Maybe network is down. Output is %s\n", dl->content.mbuf->data);
+    if (ret != 0) {
         if (fallback) {
-            printf("Trying again with local channel.\n");
+            fm_log_debug("Trying again with local channel.");
             if (fm_playlist_update_mode(pl, LOCAL_CHANNEL) == 0)
                 return fm_playlist_send_report(pl, act, base, clear_old, 0);
         }
         return -1;
     }
+    fm_playlist_refill_wake(pl);
     return 0;
 }
 
+// keeps enough songs queued after the current one that changing songs does not have to wait for the network
+static void *refill_thread(void *data)
+{
+    fm_playlist_t *pl = (fm_playlist_t *) data;
+    pthread_mutex_lock(&pl->mutex_refill);
+    while (!pl->refill_quit) {
+        int depth, target = fm_playlist_refill_target(pl);
+        unsigned int generation;
+        enum fm_playlist_mode mode;
+        pthread_mutex_lock(&pl->mutex_current_download);
+        // the first songs of a channel are always fetched by whoever switches to it
+        depth = pl->current ? fm_playlist_depth(pl) : -1;
+        generation = pl->generation;
+        mode = pl->mode;
+        pthread_mutex_unlock(&pl->mutex_current_download);
+        if (depth < 0 || depth >= target) {
+            pthread_cond_wait(&pl->cond_refill, &pl->mutex_refill);
+            continue;
+        }
+        if (time(NULL) < pl->refill_retry_at) {
+            struct timespec ts = { pl->refill_retry_at, 0 };
+            pthread_cond_timedwait(&pl->cond_refill, &pl->mutex_refill, &ts);
+            continue;
+        }
+        pthread_mutex_unlock(&pl->mutex_refill);
+
+        fm_log_info("Refilling the playlist in the background: %d songs queued, aiming for %d", depth, target);
+        fm_song_t *fetched = NULL, *next;
+        struct timespec start, end;
+        int ret;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ret = mode == plLocal ? fm_playlist_local_fill(pl, &fetched) : fm_playlist_fetch(pl, 'p', &fetched);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        int failed = ret != 0 || !fetched;
+
+        pthread_mutex_lock(&pl->mutex_current_download);
+        // a refill for a channel that has been left since is of no use
+        if (ret == 0 && fetched && pl->generation == generation && pl->current) {
+            fm_song_t **tail = &pl->current;
+            while (*tail)
+                tail = &(*tail)->next;
+            fm_playlist_splice(tail, fetched);
+            fetched = NULL;
+            song_downloader_all_start(pl);
+        }
+        pthread_mutex_unlock(&pl->mutex_current_download);
+        for (; fetched; fetched = next) {
+            next = fetched->next;
+            fm_song_free(pl, fetched);
+        }
+
+        double ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+        if (!failed)
+            fm_metrics_observe(mode == plLocal ? mhRefillLocal : mode == plDouban ? mhRefillDouban : mhRefillJing, ms / 1000);
+
+        pthread_mutex_lock(&pl->mutex_refill);
+        if (mode != plLocal && !failed) {
+            pl->refill_latency += PLAYLIST_REFILL_SMOOTHING * (ms - pl->refill_latency);
+        }
+        if (failed)
+            pl->refill_retry_at = time(NULL) + PLAYLIST_REFILL_RETRY_DELAY;
+    }
+    pthread_mutex_unlock(&pl->mutex_refill);
+    return data;
+}
+
 fm_song_t* fm_playlist_current(fm_playlist_t *pl)
 {
     if (!pl->current)
@@ -947,43 +1439,32 @@ fm_song_t* fm_playlist_current(fm_playlist_t *pl)
         return pl->current;
 }
 
-static fm_song_t **playlist_end_in_number(fm_song_t **start, int n)
-{
-    while (n>0) {
-        if (!*start)
-            return start;
-        start = &(*start)->next;
-        n--;
-    }
-    return NULL;
-}
-
 // before using this method; make sure that pl->current is not NULL!
 static void fm_playlist_next_on_link(fm_playlist_t *pl)
 {
     // stop the player first
     pl->fm_player_stop();
+    // unlinking under the lock keeps the refill worker from appending to a song that is about to be freed
+    pthread_mutex_lock(&pl->mutex_current_download);
     fm_song_t *curr = pl->current;
     pl->current = curr->next;
     // we need to make sure that for the song that's going to be removed, the current download is not pointing its the next field
-    pthread_mutex_lock(&pl->mutex_current_download);
     if (pl->current_download == &curr->next) {
         pl->current_download = &pl->current;
     }
     pthread_mutex_unlock(&pl->mutex_current_download);
 
     fm_song_free(pl, curr);
-    // starts caching when the threshold is reached
-    fm_song_t **ef = playlist_end_in_number(&pl->current, PLAYLIST_REFILL_THRESHOLD);
-    if (ef) {
-        printf("Playlist going to terminate in %d hops, request more\n", PLAYLIST_REFILL_THRESHOLD);
-        fm_playlist_send_report(pl, 'p', ef, 0, 1);
+    if (!pl->current) {
+        // the refill worker could not keep up; there is nothing to do but wait for more songs
+        fm_log_info("Playlist ran out of songs, request more");
+        fm_playlist_send_report(pl, 'p', &pl->current, 0, 1);
     }
 }
 
 fm_song_t* fm_playlist_next(fm_playlist_t *pl)
 {
-    printf("Playlist next song\n");
+    fm_log_info("Playlist next song");
     if (pl->current) {
         switch (pl->mode) {
             case plLocal:case plJing:
@@ -994,9 +1475,10 @@ fm_song_t* fm_playlist_next(fm_playlist_t *pl)
                 break;
         }
         fm_playlist_next_on_link(pl);
+        fm_playlist_refill_note(pl, 0);
     }
     else {
-        printf("Playlist init empty, request new\n");
+        fm_log_info("Playlist init empty, request new");
         fm_playlist_send_report(pl, 'n', &pl->current, 0, 1);
     }
     return pl->current;
@@ -1005,7 +1487,7 @@ fm_song_t* fm_playlist_next(fm_playlist_t *pl)
 
 fm_song_t* fm_playlist_skip(fm_playlist_t *pl, int force_refresh)
 {
-    printf("Playlist skip song\n");
+    fm_log_info("Playlist skip song");
     if (pl->current) {
         switch (pl->mode) {
             case plLocal:case plJing:
@@ -1016,9 +1498,16 @@ fm_song_t* fm_playlist_skip(fm_playlist_t *pl, int force_refresh)
                 break;
             case plDouban: 
                 fm_playlist_history_add(pl, pl->current, 's');
-                fm_playlist_send_report(pl, 's', &pl->current, 1, 1);
+                if (pl->current->next) {
+                    // Douban would hand out a fresh playlist for the skip; the queued songs do just as well and
+                    // the skip itself is reported in the background
+                    fm_playlist_send_report(pl, 's', NULL, 0, 0);
+                    fm_playlist_next_on_link(pl);
+                } else
+                    fm_playlist_send_report(pl, 's', &pl->current, 1, 1);
                 break;
         }
+        fm_playlist_refill_note(pl, 1);
         return pl->current;
     }
     else
@@ -1027,7 +1516,7 @@ fm_song_t* fm_playlist_skip(fm_playlist_t *pl, int force_refresh)
 
 fm_song_t* fm_playlist_ban(fm_playlist_t *pl)
 {
-    printf("Playlist ban song\n");
+    fm_log_info("Playlist ban song");
     if (pl->current) {
         switch (pl->mode) {
             case plLocal:
@@ -1052,7 +1541,7 @@ fm_song_t* fm_playlist_ban(fm_playlist_t *pl)
 
 void fm_playlist_rate(fm_playlist_t *pl)
 {
-    printf("Playlist rate song\n");
+    fm_log_info("Playlist rate song");
     if (pl->current && !pl->current->like) {
         pl->current->like = 1;
         switch (pl->mode) {
@@ -1067,7 +1556,7 @@ void fm_playlist_rate(fm_playlist_t *pl)
 
 void fm_playlist_unrate(fm_playlist_t *pl)
 {
-    printf("Playlist unrate song\n");
+    fm_log_info("Playlist unrate song");
     if (pl->current && pl->current->like) {
         pl->current->like = 0;
         switch (pl->mode) {
@@ -1081,3 +1570,337 @@ void fm_playlist_unrate(fm_playlist_t *pl)
         }
     }
 }
+
+static void validator_save(FILE *f, const validator_t *validator)
+{
+    switch (validator->mode) {
+        case vSHA256: fprintf(f, "%d %s", vSHA256, validator->data.sha256sum); break;
+        case vFileSize: fprintf(f, "%d %d", vFileSize, validator->data.filesize); break;
+        default: fprintf(f, "%d -", vNone);
+    }
+}
+
+static void validator_restore(validator_t *validator, int mode, const char *data)
+{
+    switch (mode) {
+        case vSHA256: validator_sha256_init(validator, data); break;
+        case vFileSize: validator_filesize_init(validator, atoi(data)); break;
+        default: validator_init(validator);
+    }
+}
+
+static int validator_same(const validator_t *a, const validator_t *b)
+{
+    if (a->mode != b->mode)
+        return 0;
+    switch (a->mode) {
+        case vSHA256: return strcmp(a->data.sha256sum, b->data.sha256sum) == 0;
+        case vFileSize: return a->data.filesize == b->data.filesize;
+        default: return 1;
+    }
+}
+
+// write a tab-led field of the state file; the strings come from the services and the tags, so the tab and the
+// newline separating the fields and the lines are escaped, as is the backslash itself
+static void field_save(FILE *f, const char *str)
+{
+    fputc('\t', f);
+    for (; *str; str++) {
+        switch (*str) {
+            case '\\': fputs("\\\\", f); break;
+            case '\t': fputs("\\t", f); break;
+            case '\n': fputs("\\n", f); break;
+            case '\r': fputs("\\r", f); break;
+            default: fputc(*str, f);
+        }
+    }
+}
+
+// undo field_save in place
+static char *field_restore(char *str)
+{
+    char *from, *to;
+    for (from = to = str; *from; from++) {
+        if (*from == '\\' && from[1] != '\0') {
+            switch (*++from) {
+                case 't': *to++ = '\t'; break;
+                case 'n': *to++ = '\n'; break;
+                case 'r': *to++ = '\r'; break;
+                default: *to++ = *from;
+            }
+        } else
+            *to++ = *from;
+    }
+    *to = '\0';
+    return str;
+}
+
+static void song_save(FILE *f, fm_song_t *song)
+{
+    fprintf(f, "s %d %d %d %d %d ", song->sid, song->like, song->local, song->pubdate, song->length);
+    validator_save(f, &song->validator);
+    field_save(f, song->title);
+    field_save(f, song->artist);
+    field_save(f, song->album);
+    field_save(f, song->cover);
+    field_save(f, song->url);
+    field_save(f, song->audio);
+    field_save(f, song->kbps);
+    field_save(f, song->ext);
+    field_save(f, song->filepath);
+    fputc('\n', f);
+}
+
+static void partial_save(FILE *f, const fm_partial_t *p)
+{
+    fprintf(f, "d %lld ", (long long) p->bytes);
+    validator_save(f, &p->validator);
+    field_save(f, p->key);
+    field_save(f, p->audio);
+    field_save(f, p->filepath);
+    field_save(f, p->etag);
+    fputc('\n', f);
+}
+
+void fm_playlist_save_state(fm_playlist_t *pl, FILE *f)
+{
+    fm_playlist_config_t config;
+    fm_history_t *h;
+    fm_song_t *s;
+    fm_transfer_t *t;
+    fm_partial_t partial, *p;
+    struct stat st;
+    config_snapshot(pl, &config);
+    fputc('c', f);
+    field_save(f, config.channel);
+    fputc('\n', f);
+    pthread_mutex_lock(&pl->mutex_history);
+    for (h = pl->history; h; h = h->next) {
+        fprintf(f, "h %d %c\n", h->sid, h->state);
+    }
+    pthread_mutex_unlock(&pl->mutex_history);
+    // the refill worker appends and the download thread hands out file paths under this lock
+    pthread_mutex_lock(&pl->mutex_current_download);
+    for (s = pl->current; s; s = s->next) {
+        song_save(f, s);
+    }
+    pthread_mutex_unlock(&pl->mutex_current_download);
+    // the journal of the unfinished downloads: the ones under way or given up on, and the ones not picked up again yet
+    pthread_mutex_lock(&pl->mutex_song_downloader);
+    for (t = pl->transfers; t; t = t->next) {
+        // a complete download carries its digest
+        if (t->digest[0] != '\0' || !t->songs || stat(t->filepath, &st) != 0)
+            continue;
+        strcpy(partial.key, t->key);
+        strcpy(partial.filepath, t->filepath);
+        strcpy(partial.audio, t->songs->audio);
+        partial.validator = t->songs->validator;
+        partial.bytes = st.st_size;
+        if (t->downloader && __atomic_load_n(&t->downloader->content.fbuf->etag_set, __ATOMIC_ACQUIRE))
+            strcpy(partial.etag, t->downloader->content.fbuf->etag);
+        else
+            strcpy(partial.etag, t->etag);
+        partial_save(f, &partial);
+    }
+    for (p = pl->partials; p; p = p->next) {
+        partial_save(f, p);
+    }
+    pthread_mutex_unlock(&pl->mutex_song_downloader);
+}
+
+// parse a line written by song_save; the file path it had is copied into saved
+static fm_song_t *song_restore(fm_playlist_t *pl, char *line, char *saved)
+{
+    char *rest, *field, *fields[9], vdata[65];
+    int i, mode;
+    fm_song_t *song;
+    if (!(rest = strchr(line, '\t')))
+        return NULL;
+    *rest++ = '\0';
+    song = song_init(pl);
+    if (sscanf(line, "s %d %d %d %d %d %d %64s", &song->sid, &song->like, &song->local, &song->pubdate, &song->length, &mode, vdata) != 7) {
+        free(song);
+        return NULL;
+    }
+    for (i = 0; i < 9; i++) {
+        field = strsep(&rest, "\t");
+        fields[i] = field ? field_restore(field) : "";
+    }
+    snprintf(song->title, sizeof(song->title), "%s", fields[0]);
+    snprintf(song->artist, sizeof(song->artist), "%s", fields[1]);
+    snprintf(song->album, sizeof(song->album), "%s", fields[2]);
+    snprintf(song->cover, sizeof(song->cover), "%s", fields[3]);
+    snprintf(song->url, sizeof(song->url), "%s", fields[4]);
+    snprintf(song->audio, sizeof(song->audio), "%s", fields[5]);
+    snprintf(song->kbps, sizeof(song->kbps), "%s", fields[6]);
+    snprintf(song->ext, sizeof(song->ext), "%s", fields[7]);
+    snprintf(saved, sizeof(song->filepath), "%s", fields[8]);
+    validator_restore(&song->validator, mode, vdata);
+    return song;
+}
+
+// parse a line written by partial_save
+static fm_partial_t *partial_restore(char *line)
+{
+    char *rest, *field, *fields[4], vdata[65];
+    long long bytes;
+    int i, mode;
+    fm_partial_t *p;
+    if (!(rest = strchr(line, '\t')))
+        return NULL;
+    *rest++ = '\0';
+    if (sscanf(line, "d %lld %d %64s", &bytes, &mode, vdata) != 3)
+        return NULL;
+    p = (fm_partial_t *) malloc(sizeof(fm_partial_t));
+    p->bytes = bytes;
+    validator_restore(&p->validator, mode, vdata);
+    for (i = 0; i < 4; i++) {
+        field = strsep(&rest, "\t");
+        fields[i] = field ? field_restore(field) : "";
+    }
+    snprintf(p->key, sizeof(p->key), "%s", fields[0]);
+    snprintf(p->audio, sizeof(p->audio), "%s", fields[1]);
+    snprintf(p->filepath, sizeof(p->filepath), "%s", fields[2]);
+    snprintf(p->etag, sizeof(p->etag), "%s", fields[3]);
+    p->next = NULL;
+    return p;
+}
+
+// hand the journaled downloads of the restored songs back to the download thread and remove all the others, along
+// with whatever was left behind without making it into the journal
+static void partials_reclaim(fm_playlist_t *pl, fm_song_t *list, fm_partial_t *journal)
+{
+    char keep[PLAYLIST_STATE_MAX_SONGS * 2][64], key[256];
+    fm_partial_t *p, *next, *q, *kept = NULL;
+    fm_song_t *s;
+    struct stat st;
+    int i, n = 0;
+    for (s = list; s; s = s->next) {
+        if (s->filepath[0] != '\0' && strlen(s->filepath) < sizeof(keep[0]) && n < PLAYLIST_STATE_MAX_SONGS)
+            strcpy(keep[n++], s->filepath);
+    }
+    for (p = journal; p; p = next) {
+        next = p->next;
+        // only songs that are still to be downloaded can use it, and only if the file is as it was
+        for (s = list; s; s = s->next) {
+            if (s->local || s->filepath[0] != '\0' || !valid_song_url(s->audio) || !validator_same(&s->validator, &p->validator))
+                continue;
+            transfer_key(s, key);
+            if (strcmp(key, p->key) == 0)
+                break;
+        }
+        for (q = kept; q && strcmp(q->key, p->key) != 0; q = q->next);
+        if (s && !q && n < PLAYLIST_STATE_MAX_SONGS * 2 && stat(p->filepath, &st) == 0 && st.st_size >= p->bytes) {
+            // the download thread resumes it with both playlist locks held, so the file is read here
+            digest_stream_init(&p->digest);
+            if (fdownloader_hash_partial(p->filepath, &p->digest, &p->hashed) == 0) {
+                fm_log_info("Keeping %lld bytes of %s at %s", (long long) p->hashed, s->title, p->filepath);
+                strcpy(keep[n++], p->filepath);
+                p->next = kept;
+                kept = p;
+                continue;
+            }
+            digest_stream_free(&p->digest);
+        }
+        // a download that finished before a crash has been taken up by its song already
+        for (i = 0; i < n && strcmp(keep[i], p->filepath) != 0; i++);
+        if (i == n)
+            unlink(p->filepath);
+        free(p);
+    }
+    pthread_mutex_lock(&pl->mutex_song_downloader);
+    for (; kept; kept = next) {
+        next = kept->next;
+        kept->next = pl->partials;
+        pl->partials = kept;
+    }
+    pthread_mutex_unlock(&pl->mutex_song_downloader);
+    fdownloader_remove_stale(keep, n);
+}
+
+int fm_playlist_restore_state(fm_playlist_t *pl, FILE *f)
+{
+    char line[2048];
+    char saved[PLAYLIST_STATE_MAX_SONGS][256];
+    fm_song_t *songs[PLAYLIST_STATE_MAX_SONGS], *list = NULL;
+    fm_partial_t *journal = NULL, *p;
+    enum song_copy copies[PLAYLIST_STATE_MAX_SONGS];
+    fm_history_t *h, **tail = &pl->history;
+    fm_playlist_config_t config;
+    int64_t requested = fm_trace_now();
+    int i, n = 0, restored = 0, sid, ret = -1;
+    char state;
+
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        switch (line[0]) {
+            case 'c':
+                if (line[1] == '\t' && fm_playlist_update_mode(pl, field_restore(line + 2)) == 0)
+                    ret = 0;
+                break;
+            case 'h':
+                if (sscanf(line, "h %d %c", &sid, &state) == 2) {
+                    h = (fm_history_t *) malloc(sizeof(fm_history_t));
+                    h->sid = sid;
+                    h->state = state;
+                    h->next = NULL;
+                    *tail = h;
+                    tail = &h->next;
+                }
+                break;
+            case 's':
+                if (n < PLAYLIST_STATE_MAX_SONGS && (songs[n] = song_restore(pl, line, saved[n])))
+                    n++;
+                break;
+            case 'd':
+                if ((p = partial_restore(line))) {
+                    p->next = journal;
+                    journal = p;
+                }
+                break;
+        }
+    }
+
+    // the songs are looked up just like the ones coming with a playlist: complete downloads went into the cache on
+    // shutdown and liked ones into music_dir
+    config_snapshot(pl, &config);
+    for (i = 0; i < n; i++) {
+        if (songs[i]->local)
+            strcpy(songs[i]->filepath, saved[i]);
+        else if (get_file_path(songs[i]->filepath, config.music_dir, songs[i]->artist, songs[i]->title, songs[i]->ext) != 0)
+            songs[i]->filepath[0] = '\0';
+    }
+    fm_playlist_check_local(pl, songs, copies, n);
+    for (i = n - 1; i >= 0; i--) {
+        fm_song_t *song = songs[i];
+        song_resolve_local(song, copies[i]);
+        // after a crash the finished downloads are still lying in /tmp; an unknown size tells nothing about them though
+        if (copies[i] == copyNone && !song->local && song->validator.mode != vNone && validate(&song->validator, saved[i])) {
+            fm_log_info("Song %s/%s resumes from the download at %s", song->artist, song->title, saved[i]);
+            strcpy(song->filepath, saved[i]);
+            song->audio[0] = '\0';
+        }
+        if (ret != 0 || (song->filepath[0] == '\0' && !valid_song_url(song->audio))) {
+            fm_song_free(pl, song);
+            continue;
+        }
+        fm_playlist_push_front(&list, song);
+        restored++;
+    }
+    // nothing is downloading yet
+    partials_reclaim(pl, list, journal);
+    if (ret != 0)
+        return ret;
+    songs_trace_fetched(list, requested);
+    fm_log_info("Restored %d songs on channel %s", restored, config.channel);
+
+    pthread_mutex_lock(&pl->mutex_current_download);
+    pl->current = list;
+    if (pl->current) {
+        pl->current_download = &pl->current;
+        song_downloader_all_start(pl);
+    }
+    pthread_mutex_unlock(&pl->mutex_current_download);
+    fm_playlist_refill_wake(pl);
+    return 0;
+}
@@ -3,7 +3,11 @@
 
 #include "downloader.h"
 #include "validator.h"
+#include "taskpool.h"
+#include "trace.h"
 #include <curl/curl.h>
+#include <stdio.h>
+#include <time.h>
 // definitions of some special channels
 #define LOCAL_CHANNEL "999"
 #define JING_TOP_CHANNEL "#top"
@@ -13,9 +17,22 @@
 #define N_SONG_DOWNLOADERS 2
 #define N_MAX_DOUBAN_SONGS_DOWNLOAD 3
 #define N_LOCAL_CHANNEL_FETCH 25
+// the number of threads checking API responses for songs already in music_dir
+#define N_LOCAL_CHECK_THREADS 3
 // a threshold of 1 means that there will at least be one songs in the list AFTER the player takes the next song
 // or: it only begins downloading new songs when there is no song after the current one
 #define PLAYLIST_REFILL_THRESHOLD 2
+// the refill worker keeps at least PLAYLIST_REFILL_THRESHOLD songs queued after the current one, and up to this many
+// when refills are slow or songs keep being skipped
+#define PLAYLIST_REFILL_MAX_DEPTH 8
+// the number of extra songs to keep queued if every song is skipped
+#define PLAYLIST_REFILL_SKIP_DEPTH 4
+// the weight of the latest sample in the moving averages of the refill latency and the skip rate
+#define PLAYLIST_REFILL_SMOOTHING 0.2
+// how long (in seconds) to wait before trying again after a refill has failed
+#define PLAYLIST_REFILL_RETRY_DELAY 10
+// at most this many queued songs are restored on startup
+#define PLAYLIST_STATE_MAX_SONGS 64
 #define DOUBAN_MUSIC_WEBSITE "http://music.douban.com"
 #define N_JING_CHANNEL_FETCH 5
 
@@ -39,6 +56,8 @@ typedef struct fm_song {
     char ext[4];
     int sid;
     int like;
+    // whether the file is one of the songs under music_dir rather than a download
+    int local;
     struct fm_song *next;
     // the total length for the song (in seconds)
     int length;
@@ -48,10 +67,50 @@ typedef struct fm_song {
     char filepath[256];
     // the corresponding downloader (null if it's not being downloaded)
     downloader_t *downloader;
+    // the download this song shares with the other songs for the same audio
+    struct fm_transfer *transfer;
+    struct fm_song *transfer_next;
     // the corresponding mutex to lock the downloader
     pthread_mutex_t *mutex_downloader;
+    // when the song went through each step on its way to the speakers
+    fm_trace_t trace;
 } fm_song_t;
 
+// one download of an audio file; a song that comes up again while the file is still around simply attaches to it
+typedef struct fm_transfer {
+    // the sid and bitrate, or the audio url for songs without a sid
+    char key[256];
+    char filepath[64];
+    // null once the download has finished or stopped
+    downloader_t *downloader;
+    // the digest of the complete download
+    char digest[65];
+    // the ETag of the file once the download has stopped, if the server sent one
+    char etag[128];
+    // the attached songs, linked through transfer_next
+    fm_song_t *songs;
+    int refs;
+    // whether any of the songs that have already let go of it were liked
+    int liked;
+    struct fm_transfer *next;
+} fm_transfer_t;
+
+// a download the last run did not get to finish, waiting for its song to come up for download again
+typedef struct fm_partial {
+    // as for fm_transfer_t
+    char key[256];
+    char filepath[64];
+    char audio[256];
+    validator_t validator;
+    // the size of the file when it was journaled; it can only have grown since
+    int64_t bytes;
+    char etag[128];
+    // the sha256 of the first hashed bytes of the file, taken on restore so that resuming does not have to read it
+    digest_stream_t digest;
+    int64_t hashed;
+    struct fm_partial *next;
+} fm_partial_t;
+
 typedef struct fm_history {
     int sid;
     char state;
@@ -68,9 +127,14 @@ typedef struct {
     int expire;
     char kbps[8];
 
+    // where rpd keeps its own files (~/.rpd)
+    char rpd_dir[128];
+
     // local mode
     char music_dir[128];
     int download_lyrics;
+    // the quota of the song cache in MB
+    int cache_size;
 
     // jing mode
     int jing_uid;
@@ -85,6 +149,7 @@ typedef struct {
 
     // douban mode
     fm_history_t *history;
+    pthread_mutex_t mutex_history;
     char *douban_api;
     char *douban_channel_api;
     char *app_name;
@@ -93,11 +158,28 @@ typedef struct {
     // jing mode
     char *jing_api;
 
+    // written by the executor; the other threads read it through copies taken under mutex_config
     fm_playlist_config_t config;
+    pthread_mutex_t mutex_config;
 
     // the downloader stack will handle all the download tasks
     downloader_stack_t *stack;
 
+    // checks the songs in API responses for local copies
+    task_pool_t *local_check_pool;
+
+    // local mode: the songs found under music_dir
+    struct fm_library *library;
+
+    // played songs that are not liked, kept in case they come up again
+    struct fm_cache *cache;
+
+    // sends the reports nobody waits for (song ended, rate, unrate...) in the background
+    struct fm_reporter *reporter;
+
+    // tags and moves liked songs into music_dir in the background
+    struct fm_archive *archive;
+
     // holding a reference to the stop function; needs to be provided by the delegate
     void (*fm_player_stop)();
     //// song download section
@@ -108,13 +190,42 @@ typedef struct {
     pthread_mutex_t mutex_song_download_stop;
     pthread_mutex_t mutex_current_download;
     pthread_mutex_t mutex_song_downloader;
+    // the downloads the songs are attached to; guarded by mutex_song_downloader
+    fm_transfer_t *transfers;
+    // the unfinished downloads restored from the last run; guarded by mutex_song_downloader
+    fm_partial_t *partials;
+    // set on shutdown: the unfinished downloads of the songs let go of are kept for the next run
+    int keep_partials;
     pthread_cond_t cond_song_download_restart;
+    //// background refill section
+    pthread_t tid_refill;
+    int refill_quit;
+    // bumped whenever the playlist is cleared, so that a refill for the old channel is thrown away
+    unsigned int generation;
+    // moving averages of how long a refill takes (in ms) and of how many songs are skipped rather than finished
+    double refill_latency;
+    double skip_rate;
+    // no refill is attempted before this time after a failure
+    time_t refill_retry_at;
+    pthread_mutex_t mutex_refill;
+    pthread_cond_t cond_refill;
 } fm_playlist_t;
 
 int fm_playlist_init(fm_playlist_t *pl, fm_playlist_config_t *config, void (*fm_player_stop)());
 void fm_playlist_cleanup(fm_playlist_t *pl);
 
 int fm_playlist_update_mode(fm_playlist_t *pl, char *ch);
+// change the bitrate asked for from the next refill on; a reload goes back to the one in the config file
+void fm_playlist_set_kbps(fm_playlist_t *pl, const char *kbps);
+// swap in the credentials, the bitrate and the local settings of a freshly read config; the queued songs are left alone
+void fm_playlist_reload(fm_playlist_t *pl, const fm_playlist_config_t *config);
+// write the channel, the history, the queued songs and a journal of their unfinished downloads to f
+void fm_playlist_save_state(fm_playlist_t *pl, FILE *f);
+// switch to the channel written by fm_playlist_save_state and queue its songs again, playing whatever is still around
+// locally from there; the rest is downloaded (picking up the unfinished downloads where they were) and the queue
+// topped up in the background; the downloads that are no longer needed are removed
+// return -1 (leaving the channel as it was) if the channel cannot be set
+int fm_playlist_restore_state(fm_playlist_t *pl, FILE *f);
 fm_song_t* fm_playlist_current(fm_playlist_t *pl);
 fm_song_t* fm_playlist_next(fm_playlist_t *pl);
 fm_song_t* fm_playlist_skip(fm_playlist_t *pl, int force_refresh);
@@ -0,0 +1,255 @@
+#define _GNU_SOURCE
+#include "report.h"
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define LOG_MODULE lmReport
+
+static void queue_append(fm_reporter_t *r, fm_report_t *report)
+{
+    report->next = NULL;
+    if (r->tail)
+        r->tail->next = report;
+    else
+        r->head = report;
+    r->tail = report;
+    r->length++;
+}
+
+// remove the report following prev (or the head if prev is NULL)
+static fm_report_t *queue_remove(fm_reporter_t *r, fm_report_t *prev)
+{
+    fm_report_t *report = prev ? prev->next : r->head;
+    if (prev)
+        prev->next = report->next;
+    else
+        r->head = report->next;
+    if (r->tail == report)
+        r->tail = prev;
+    r->length--;
+    return report;
+}
+
+// a rate and an unrate of the same song cancel each other out (Jing toggles on both anyway)
+static int reports_cancel(const fm_report_t *a, const fm_report_t *b)
+{
+    return a->service == b->service && a->sid == b->sid && ((a->act == 'r' && b->act == 'u') || (a->act == 'u' && b->act == 'r'));
+}
+
+// telling the service twice that a song is liked or banned achieves nothing; a song can end more than once though
+static int reports_repeat(const fm_report_t *a, const fm_report_t *b)
+{
+    return a->service == b->service && a->sid == b->sid && a->act == b->act && a->act != 'e';
+}
+
+// expects the mutex to be held
+static void report_save(fm_reporter_t *r)
+{
+    char tmp[272];
+    FILE *f;
+    fm_report_t *report;
+    if (!r->head) {
+        unlink(r->path);
+        return;
+    }
+    sprintf(tmp, "%s.tmp", r->path);
+    if (!(f = fopen(tmp, "w"))) {
+        fm_log_error("Unable to save the reports to %s: %s", tmp, strerror(errno));
+        return;
+    }
+    for (report = r->head; report; report = report->next) {
+        fprintf(f, "%c %c %d %lld %d\t%s\t%s\t%s\t%s\n", report->service, report->act, report->sid, (long long) report->queued, report->attempts,
+                report->url, report->body, report->headers[0], report->headers[1]);
+    }
+    if (fclose(f) != 0 || rename(tmp, r->path) != 0)
+        unlink(tmp);
+}
+
+static void report_load(fm_reporter_t *r)
+{
+    FILE *f;
+    char line[4096], *rest, *field;
+    char *fields[4];
+    long long queued;
+    time_t now = time(NULL);
+    int i;
+    if (!(f = fopen(r->path, "r")))
+        return;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (!(rest = strchr(line, '\t')))
+            continue;
+        *rest++ = '\0';
+        fm_report_t *report = (fm_report_t *) calloc(1, sizeof(fm_report_t));
+        if (sscanf(line, "%c %c %d %lld %d", &report->service, &report->act, &report->sid, &queued, &report->attempts) != 5 || now - queued > REPORT_MAX_AGE) {
+            free(report);
+            continue;
+        }
+        report->queued = queued;
+        for (i = 0; i < 4; i++) {
+            field = strsep(&rest, "\t");
+            fields[i] = field ? field : "";
+        }
+        snprintf(report->url, sizeof(report->url), "%s", fields[0]);
+        snprintf(report->body, sizeof(report->body), "%s", fields[1]);
+        snprintf(report->headers[0], sizeof(report->headers[0]), "%s", fields[2]);
+        snprintf(report->headers[1], sizeof(report->headers[1]), "%s", fields[3]);
+        queue_append(r, report);
+    }
+    fclose(f);
+    fm_log_info("%d reports left over from the last run", r->length);
+}
+
+// send the batch all at once; ok[i] tells whether the service has answered report i
+static void report_send(fm_reporter_t *r, fm_report_t **batch, int n, int *ok)
+{
+    downloader_t *dls[n];
+    struct curl_slist *slists[n];
+    int i, j;
+    stack_get_idle_downloaders(r->stack, dls, n, dMem);
+    for (i = 0; i < n; i++) {
+        CURL *curl = dls[i]->curl;
+        fm_log_debug("Sending %c:%c for song %d", batch[i]->service, batch[i]->act, batch[i]->sid);
+        curl_easy_setopt(curl, CURLOPT_URL, batch[i]->url);
+        if (batch[i]->body[0] != '\0')
+            curl_easy_setopt(curl, CURLOPT_COPYPOSTFIELDS, batch[i]->body);
+        slists[i] = NULL;
+        for (j = 0; j < 2; j++) {
+            if (batch[i]->headers[j][0] != '\0')
+                slists[i] = curl_slist_append(slists[i], batch[i]->headers[j]);
+        }
+        if (slists[i])
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, slists[i]);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, REPORT_TIMEOUT);
+    }
+    stack_perform_until_all_done(r->stack, dls, n);
+    for (i = 0; i < n; i++) {
+        // an error from the service is an answer as well; sending the same report again would not change it
+        ok[i] = dls[i]->content.mbuf->length > 0;
+        curl_slist_free_all(slists[i]);
+    }
+    stack_downloaders_cleanup(r->stack, dls, n);
+}
+
+static void *report_thread(void *data)
+{
+    fm_reporter_t *r = (fm_reporter_t *) data;
+    fm_report_t *batch[REPORT_BATCH];
+    int ok[REPORT_BATCH];
+    int i, n, failed;
+    pthread_mutex_lock(&r->mutex);
+    while (!r->should_quit) {
+        if (!r->head) {
+            pthread_cond_wait(&r->cond, &r->mutex);
+            continue;
+        }
+        if (time(NULL) < r->retry_at) {
+            struct timespec ts = { r->retry_at, 0 };
+            pthread_cond_timedwait(&r->cond, &r->mutex, &ts);
+            continue;
+        }
+        for (n = 0; n < REPORT_BATCH && r->head; n++) {
+            batch[n] = queue_remove(r, NULL);
+        }
+        pthread_mutex_unlock(&r->mutex);
+
+        report_send(r, batch, n, ok);
+
+        pthread_mutex_lock(&r->mutex);
+        failed = 0;
+        // the failed ones go back to the front in their original order
+        for (i = n - 1; i >= 0; i--) {
+            batch[i]->attempts++;
+            if (ok[i]) {
+                r->sent++;
+                free(batch[i]);
+            } else if (time(NULL) - batch[i]->queued > REPORT_MAX_AGE) {
+                r->dropped++;
+                free(batch[i]);
+            } else {
+                batch[i]->next = r->head;
+                r->head = batch[i];
+                if (!r->tail)
+                    r->tail = batch[i];
+                r->length++;
+                failed++;
+            }
+        }
+        if (failed > 0) {
+            fm_log_warn("%d of %d reports failed; trying again in %d seconds", failed, n, r->retry_delay);
+            r->retry_at = time(NULL) + r->retry_delay;
+            // nothing getting through at all most likely means that we are offline
+            if (failed == n && r->retry_delay * 2 <= REPORT_RETRY_MAX_DELAY)
+                r->retry_delay *= 2;
+        } else
+            r->retry_delay = REPORT_RETRY_DELAY;
+        report_save(r);
+    }
+    pthread_mutex_unlock(&r->mutex);
+    return data;
+}
+
+void fm_reporter_init(fm_reporter_t *r, downloader_stack_t *stack, const char *path)
+{
+    memset(r, 0, sizeof(fm_reporter_t));
+    r->stack = stack;
+    strcpy(r->path, path);
+    r->retry_delay = REPORT_RETRY_DELAY;
+    pthread_mutex_init(&r->mutex, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    report_load(r);
+    pthread_create(&r->tid, NULL, report_thread, r);
+}
+
+void fm_reporter_cleanup(fm_reporter_t *r)
+{
+    fm_report_t *report;
+    pthread_mutex_lock(&r->mutex);
+    r->should_quit = 1;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->mutex);
+    pthread_join(r->tid, NULL);
+
+    report_save(r);
+    while (r->head) {
+        report = queue_remove(r, NULL);
+        free(report);
+    }
+    pthread_mutex_destroy(&r->mutex);
+    pthread_cond_destroy(&r->cond);
+}
+
+void fm_reporter_submit(fm_reporter_t *r, const fm_report_t *report)
+{
+    fm_report_t *p, *prev = NULL;
+    pthread_mutex_lock(&r->mutex);
+    // only the reports still waiting can be folded together; the ones in flight are out of reach
+    for (p = r->head; p; prev = p, p = p->next) {
+        if (reports_cancel(p, report)) {
+            fm_log_info("%c:%c for song %d cancels the queued %c", report->service, report->act, report->sid, p->act);
+            free(queue_remove(r, prev));
+            break;
+        }
+        if (reports_repeat(p, report))
+            break;
+    }
+    if (!p) {
+        if (r->length >= REPORT_QUEUE_CAPACITY) {
+            free(queue_remove(r, NULL));
+            r->dropped++;
+        }
+        fm_report_t *copy = (fm_report_t *) malloc(sizeof(fm_report_t));
+        *copy = *report;
+        queue_append(r, copy);
+        pthread_cond_signal(&r->cond);
+    }
+    // while offline the report might sit in the queue for a while
+    if (time(NULL) < r->retry_at)
+        report_save(r);
+    pthread_mutex_unlock(&r->mutex);
+}
@@ -0,0 +1,59 @@
+#ifndef _FM_REPORT_H_
+#define _FM_REPORT_H_
+
+#include "downloader.h"
+#include <time.h>
+#include <pthread.h>
+
+// the number of reports sent together
+#define REPORT_BATCH 8
+// beyond this many waiting reports the oldest ones are dropped
+#define REPORT_QUEUE_CAPACITY 512
+// the delay (in seconds) before trying again after a batch has failed; doubled on every failure in a row
+#define REPORT_RETRY_DELAY 5
+#define REPORT_RETRY_MAX_DELAY 600
+// reports older than this (in seconds) are not worth sending any more
+#define REPORT_MAX_AGE (7 * 24 * 3600)
+#define REPORT_TIMEOUT 20
+
+// a request to Douban.fm or Jing.fm whose response nobody is interested in
+// everything needed to send it is captured when it is queued, since the channel and the current song move on
+typedef struct fm_report {
+    // 'd' for Douban.fm, 'j' for Jing.fm
+    char service;
+    char act;
+    int sid;
+    time_t queued;
+    int attempts;
+    char url[1536];
+    // the fields to post; the request is a GET if there are none
+    char body[1024];
+    char headers[2][128];
+    struct fm_report *next;
+} fm_report_t;
+
+typedef struct fm_reporter {
+    downloader_stack_t *stack;
+    // where the unsent reports are kept while offline and across restarts
+    char path[256];
+    fm_report_t *head;
+    fm_report_t *tail;
+    int length;
+    // nothing is sent before this time after a failure
+    time_t retry_at;
+    int retry_delay;
+    unsigned long sent;
+    unsigned long dropped;
+    int should_quit;
+    pthread_t tid;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} fm_reporter_t;
+
+void fm_reporter_init(fm_reporter_t *r, downloader_stack_t *stack, const char *path);
+// stop sending and save whatever is left
+void fm_reporter_cleanup(fm_reporter_t *r);
+// queue a copy of the report; never blocks on the network
+void fm_reporter_submit(fm_reporter_t *r, const fm_report_t *report);
+
+#endif
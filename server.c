@@ -1,20 +1,33 @@
+#define _GNU_SOURCE
 #include "server.h"
 #include "util.h"
+#include "metrics.h"
+#include "logger.h"
 
 #include <netinet/in.h>
 #include <sys/socket.h>
-#include <arpa/inet.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <ctype.h>
 #include <errno.h>
+#include <time.h>
 
-int fm_server_setup(fm_server_t *server)
+#define LOG_MODULE lmServer
+
+static int setup_tcp(fm_server_t *server)
 {
     struct addrinfo hints, *results, *p;
 
-    printf("Server listen at %s:%s\n", server->addr, server->port);
+    fm_log_info("Server listen at %s:%s", server->addr, server->port);
 
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_INET;
@@ -26,7 +39,7 @@ int fm_server_setup(fm_server_t *server)
     }
 
     for (p = results; p != NULL; p = p->ai_next) {
-        server->listen_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        server->listen_fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
         if (server->listen_fd < 0) {
             continue;
         }
@@ -35,143 +48,719 @@ int fm_server_setup(fm_server_t *server)
         }
         close(server->listen_fd);
     }
+    freeaddrinfo(results);
     if (p == NULL) {
+        server->listen_fd = -1;
         return -1;
     }
 
-    freeaddrinfo(results);
+    return listen(server->listen_fd, 16);
+}
+
+static int setup_unix(fm_server_t *server)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd, ret;
+
+    fm_log_info("Server listen at %s", server->socket_path);
+
+    if (strlen(server->socket_path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, server->socket_path);
 
-    if (listen(server->listen_fd, 5) < 0) {
+    // a socket left behind by a crash is in the way, one that somebody still listens on is not ours to take, and
+    // anything else is most likely a mistyped path that should not be removed
+    if (lstat(server->socket_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fm_log_error("%s is in the way and not a socket", server->socket_path);
+            errno = EEXIST;
+            return -1;
+        }
+        if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+            return -1;
+        }
+        // the error of connect, or 0 if somebody answered
+        ret = connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0 ? 0 : errno;
+        close(fd);
+        if (ret == 0) {
+            errno = EADDRINUSE;
+            return -1;
+        }
+        if (ret != ECONNREFUSED) {
+            fm_log_error("Unable to tell whether %s is still in use: %s", server->socket_path, strerror(ret));
+            errno = ret;
+            return -1;
+        }
+        unlink(server->socket_path);
+    } else if (errno != ENOENT) {
         return -1;
     }
 
-    FD_ZERO(&server->fds);
-    FD_SET(server->listen_fd, &server->fds);
-    server->fd_max = server->listen_fd;
+    if ((server->unix_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        return -1;
+    }
+    if (bind(server->unix_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+            chmod(server->socket_path, S_IRUSR | S_IWUSR) < 0 ||
+            listen(server->unix_fd, 16) < 0) {
+        close(server->unix_fd);
+        server->unix_fd = -1;
+        return -1;
+    }
+    return 0;
+}
 
+int fm_server_setup(fm_server_t *server)
+{
+    struct epoll_event ev;
+
+    server->listen_fd = server->unix_fd = -1;
+    if (server->port[0] == '\0' && server->socket_path[0] == '\0') {
+        fm_log_error("Neither a port nor a socket to listen on");
+        return -1;
+    }
+    if (server->port[0] != '\0' && setup_tcp(server) < 0) {
+        return -1;
+    }
+    if (server->socket_path[0] != '\0' && setup_unix(server) < 0) {
+        return -1;
+    }
+
+    if ((server->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        return -1;
+    }
+    if ((server->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        return -1;
+    }
+    ev.events = EPOLLIN;
+    if (server->listen_fd >= 0) {
+        ev.data.ptr = &server->listen_fd;
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &ev);
+    }
+    if (server->unix_fd >= 0) {
+        ev.data.ptr = &server->unix_fd;
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->unix_fd, &ev);
+    }
+    ev.data.ptr = &server->wake_fd;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->wake_fd, &ev);
+
+    server->conns = NULL;
+    server->pending = server->pending_tail = NULL;
+    pthread_mutex_init(&server->mutex, NULL);
     server->should_quit = 0;
 
     return 0;
 }
 
-static int send_all(int fd, const char *buf, int buf_size)
+static long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// only the user running the daemon (and root) get to control it through the socket
+static int peer_allowed(int fd)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        fm_log_error("Unable to get the credentials of a client: %s", strerror(errno));
+        return 0;
+    }
+    if (cred.uid != getuid() && cred.uid != 0) {
+        fm_log_warn("Refusing client of uid %d (pid %d)", (int) cred.uid, (int) cred.pid);
+        return 0;
+    }
+    return 1;
+}
+
+static void conn_accept(fm_server_t *server, int listen_fd)
+{
+    int fd;
+    fm_conn_t *conn;
+    struct epoll_event ev;
+    while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        if (listen_fd == server->unix_fd && !peer_allowed(fd)) {
+            close(fd);
+            continue;
+        }
+        conn = (fm_conn_t *) calloc(1, sizeof(fm_conn_t));
+        conn->fd = fd;
+        conn->events = EPOLLIN;
+        ev.events = conn->events;
+        ev.data.ptr = conn;
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            fm_log_error("Unable to watch a client: %s", strerror(errno));
+            close(fd);
+            free(conn);
+            continue;
+        }
+        conn->next = server->conns;
+        if (server->conns)
+            server->conns->prev = conn;
+        server->conns = conn;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        fm_log_error("Unable to accept a client: %s", strerror(errno));
+    }
+}
+
+static const char *event_names[] = { "player", "playlist", "options" };
+
+static void request_free(fm_request_t *req)
+{
+    if (req->event && --req->event->refs == 0)
+        free(req->event);
+    fm_json_free(&req->output);
+    free(req);
+}
+
+// keep a few of the finished requests around so that steady traffic does not allocate
+static void conn_recycle(fm_conn_t *conn, fm_request_t *req)
 {
-    int done = 0;
-    int ret = 0;
-    while (done < buf_size) {
-        ret = send(fd, buf + done, buf_size - done, 0);
+    if (conn->nspare >= SERVER_SPARE_REQUESTS) {
+        request_free(req);
+        return;
+    }
+    if (req->event && --req->event->refs == 0)
+        free(req->event);
+    req->event = NULL;
+    req->done = 0;
+    fm_json_reset(&req->output);
+    req->next = conn->spare;
+    conn->spare = req;
+    conn->nspare++;
+}
+
+static void reply_status(fm_json_t *w, const char *status, const char *message)
+{
+    fm_json_object(w);
+    fm_json_kstr(w, "status", status);
+    if (message)
+        fm_json_kstr(w, "message", message);
+    fm_json_object_end(w);
+}
+
+static void conn_close(fm_server_t *server, fm_conn_t *conn)
+{
+    fm_request_t *req, *next;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    pthread_mutex_lock(&server->mutex);
+    for (req = conn->requests; req; req = next) {
+        next = req->next;
+        // the ones still running are freed when they are handed back
+        if (req->done || req == conn->idle || req == conn->http)
+            request_free(req);
+        else
+            req->conn = NULL;
+    }
+    pthread_mutex_unlock(&server->mutex);
+    while ((req = conn->spare)) {
+        conn->spare = req->next;
+        request_free(req);
+    }
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        server->conns = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    free(conn);
+}
+
+static void conn_append(fm_conn_t *conn, fm_request_t *req)
+{
+    if (conn->requests_tail)
+        conn->requests_tail->next = req;
+    else
+        conn->requests = req;
+    conn->requests_tail = req;
+    conn->nrequests++;
+}
+
+static fm_request_t *conn_request(fm_conn_t *conn)
+{
+    fm_request_t *req;
+    if ((req = conn->spare)) {
+        conn->spare = req->next;
+        conn->nspare--;
+    } else {
+        req = (fm_request_t *) calloc(1, sizeof(fm_request_t));
+        fm_json_init(&req->output);
+    }
+    req->conn = conn;
+    req->next = NULL;
+    req->framed = conn->framed;
+    conn_append(conn, req);
+    return req;
+}
+
+// the kinds of event named in args, all of them if there are none; -1 on an unknown name
+static int parse_events(char *args)
+{
+    int mask = 0, i;
+    char *name;
+    while (args && *args) {
+        name = args;
+        args = split(args, ' ');
+        for (i = 0; i < sizeof(event_names) / sizeof(event_names[0]); i++) {
+            if (strcmp(name, event_names[i]) == 0)
+                break;
+        }
+        if (i == sizeof(event_names) / sizeof(event_names[0]))
+            return -1;
+        mask |= 1 << i;
+    }
+    return mask ? mask : SERVER_EVENT_ALL;
+}
+
+static void observe_latency(fm_request_t *req)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    fm_metrics_observe(mhCommand, (now.tv_sec - req->received.tv_sec) + (now.tv_nsec - req->received.tv_nsec) / 1e9);
+}
+
+// a scraper can fetch the metrics with a plain HTTP GET on the same port
+static void http_respond(fm_request_t *req, const char *path)
+{
+    static const char ok[] = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n";
+    static const char not_found[] = "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\nNot found\n";
+    char *query;
+    if ((query = strchr(path, '?')))
+        *query = '\0';
+    if (strcmp(path, "/metrics") == 0) {
+        fm_json_text(&req->output, ok, sizeof(ok) - 1);
+        fm_metrics_write(&req->output);
+    } else {
+        fm_json_text(&req->output, not_found, sizeof(not_found) - 1);
+    }
+    req->framed = 0;
+}
+
+// the commands about the connection itself; return 0 if req is none of them
+static int conn_builtin(fm_conn_t *conn, fm_request_t *req)
+{
+    char cmd[SERVER_LINE_MAX];
+    char message[SERVER_LINE_MAX + 32];
+    char *args;
+    int mask;
+
+    strcpy(cmd, req->input);
+    args = split(cmd, ' ');
+    if (strcmp(cmd, "noidle") == 0) {
+        // the pending idle returns without any change; noidle itself has no reply
+        if (conn->idle) {
+            fm_json_object(&conn->idle->output);
+            fm_json_key(&conn->idle->output, "changed");
+            fm_json_array(&conn->idle->output);
+            fm_json_array_end(&conn->idle->output);
+            fm_json_object_end(&conn->idle->output);
+            conn->idle->done = 1;
+            conn->idle = NULL;
+        }
+        req->framed = 0;
+    } else if (strcmp(cmd, "idle") == 0 || strcmp(cmd, "subscribe") == 0) {
+        if ((mask = parse_events(args)) < 0) {
+            snprintf(message, sizeof(message), "Wrong argument: %s", args);
+            reply_status(&req->output, "error", message);
+        } else if (cmd[0] == 's') {
+            conn->subscribed = mask;
+            reply_status(&req->output, "ok", NULL);
+        } else if (conn->idle) {
+            reply_status(&req->output, "error", "Already idle");
+        } else {
+            // answered by the next event
+            conn->idle = req;
+            conn->idle_mask = mask;
+            return 1;
+        }
+    } else if (strcmp(cmd, "unsubscribe") == 0) {
+        conn->subscribed = 0;
+        reply_status(&req->output, "ok", NULL);
+    } else if (strcmp(cmd, "GET") == 0 && args) {
+        // the response goes out once the headers are over
+        split(args, ' ');
+        http_respond(req, args);
+        conn->http = req;
+        return 1;
+    } else {
+        return 0;
+    }
+    req->done = 1;
+    return 1;
+}
+
+static void conn_command(fm_server_t *server, fm_conn_t *conn, char *line, server_handle handle, void *handle_data)
+{
+    fm_request_t *req;
+    char *p;
+    if (conn->closing)
+        return;
+    for (p = line; isspace(*p); p++)
+        ;
+    if (conn->http) {
+        // the headers are of no interest; the empty line after them ends the request
+        if (*p == '\0') {
+            conn->http->done = 1;
+            conn->http = NULL;
+            conn->closing = 1;
+        }
+        return;
+    }
+    if (*p == '\0')
+        return;
+    req = conn_request(conn);
+    clock_gettime(CLOCK_MONOTONIC, &req->received);
+    strcpy(req->input, line);
+    trim(req->input);
+    if (conn_builtin(conn, req))
+        return;
+    if (handle(handle_data, req) == 0) {
+        observe_latency(req);
+        pthread_mutex_lock(&server->mutex);
+        req->done = 1;
+        pthread_mutex_unlock(&server->mutex);
+    }
+}
+
+// split off the complete lines; stops early while too many replies are outstanding
+static void conn_parse(fm_server_t *server, fm_conn_t *conn, server_handle handle, void *handle_data)
+{
+    char *nl;
+    int n;
+    fm_request_t *req;
+    while (conn->nrequests < SERVER_MAX_PIPELINE && conn->in_len > 0) {
+        if ((nl = memchr(conn->in, '\n', conn->in_len))) {
+            *nl = '\0';
+            n = nl - conn->in + 1;
+            conn->framed = 1;
+            if (conn->discarding)
+                conn->discarding = 0;
+            else
+                conn_command(server, conn, conn->in, handle, handle_data);
+            memmove(conn->in, conn->in + n, conn->in_len - n);
+            conn->in_len -= n;
+            conn->partial_at = 0;
+        } else if (conn->in_len == sizeof(conn->in) - 1) {
+            if (!conn->discarding) {
+                req = conn_request(conn);
+                reply_status(&req->output, "error", "Command too long");
+                req->done = 1;
+                conn->discarding = 1;
+            }
+            conn->in_len = 0;
+        } else if (conn->discarding) {
+            conn->in_len = 0;
+        } else if (!conn->framed && (conn->eof || (conn->partial_at > 0 && now_ms() - conn->partial_at >= SERVER_LEGACY_DELAY))) {
+            // a client from before newlines: whatever it sent is the command
+            conn->in[conn->in_len] = '\0';
+            conn_command(server, conn, conn->in, handle, handle_data);
+            conn->in_len = 0;
+            conn->partial_at = 0;
+        } else {
+            if (conn->eof) {
+                // nothing is ever going to complete the line
+                conn->in_len = 0;
+            } else if (!conn->framed && conn->partial_at == 0) {
+                conn->partial_at = now_ms();
+            }
+            break;
+        }
+    }
+}
+
+static int conn_read(fm_conn_t *conn)
+{
+    // one byte is kept free for terminating the command
+    size_t room = sizeof(conn->in) - 1 - conn->in_len;
+    ssize_t ret;
+    if (room == 0)
+        return 0;
+    ret = read(conn->fd, conn->in + conn->in_len, room);
+    if (ret > 0) {
+        conn->in_len += ret;
+    } else if (ret == 0) {
+        conn->eof = 1;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        fm_log_error("Unable to read from a client: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// write out as many of the ready replies at the front as the socket takes
+static int conn_flush(fm_server_t *server, fm_conn_t *conn)
+{
+    struct iovec iov[SERVER_WRITE_BATCH * 2];
+    size_t len[SERVER_WRITE_BATCH];
+    fm_request_t *req;
+    ssize_t ret;
+    size_t skip, out;
+    char *data;
+    int i, n, niov;
+
+    for (;;) {
+        n = niov = 0;
+        pthread_mutex_lock(&server->mutex);
+        for (req = conn->requests; req && req->done && n < SERVER_WRITE_BATCH; req = req->next) {
+            data = req->event ? req->event->data : req->output.buf;
+            out = req->event ? req->event->len : req->output.len;
+            len[n] = out + req->framed;
+            skip = n == 0 ? conn->written : 0;
+            if (skip < out) {
+                iov[niov].iov_base = data + skip;
+                iov[niov++].iov_len = out - skip;
+            }
+            if (req->framed) {
+                iov[niov].iov_base = "\n";
+                iov[niov++].iov_len = 1;
+            }
+            n++;
+        }
+        pthread_mutex_unlock(&server->mutex);
+        if (n == 0) {
+            conn->blocked = 0;
+            return 0;
+        }
+
+        ret = niov > 0 ? writev(conn->fd, iov, niov) : 0;
         if (ret < 0) {
-            if (errno == EINTR) {
+            if (errno == EINTR)
                 continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn->blocked = 1;
+                return 0;
             }
-            else {
-                break;
-            }
+            fm_log_error("Unable to write to a client: %s", strerror(errno));
+            return -1;
         }
-        else {
-            done += ret;
+        for (i = 0; i < n; i++) {
+            if (conn->written + ret < len[i]) {
+                conn->written += ret;
+                // the socket buffer is full; wait for it to drain
+                conn->blocked = 1;
+                return 0;
+            }
+            ret -= len[i] - conn->written;
+            conn->written = 0;
+            req = conn->requests;
+            conn->requests = req->next;
+            if (!conn->requests)
+                conn->requests_tail = NULL;
+            conn->nrequests--;
+            if (req->event)
+                conn->nevents--;
+            conn_recycle(conn, req);
         }
     }
-    if (ret < 0) {
-        return ret;
+}
+
+static void conn_update(fm_server_t *server, fm_conn_t *conn)
+{
+    struct epoll_event ev;
+    unsigned events = 0;
+    if (!conn->eof && !conn->closing && conn->nrequests < SERVER_MAX_PIPELINE)
+        events |= EPOLLIN;
+    if (conn->blocked)
+        events |= EPOLLOUT;
+    if (events != conn->events) {
+        ev.events = events;
+        ev.data.ptr = conn;
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->events = events;
     }
-    else {
-        return done;
+}
+
+// bring the connection up to date; return -1 if it has to go
+static int conn_service(fm_server_t *server, fm_conn_t *conn, server_handle handle, void *handle_data)
+{
+    if (conn_flush(server, conn) < 0)
+        return -1;
+    // room might have been made for the lines held back
+    conn_parse(server, conn, handle, handle_data);
+    if (conn_flush(server, conn) < 0)
+        return -1;
+    if ((conn->eof && conn->in_len == 0) || conn->closing) {
+        if (!conn->requests)
+            return -1;
     }
+    conn_update(server, conn);
+    return 0;
 }
 
-static void getPeerInfo(int socket, char *ipstr, int iplen, int *port) {
-    socklen_t len;
-    struct sockaddr_storage addr;
+// hand the events queued by fm_server_notify to the clients waiting for them
+static void dispatch_events(fm_server_t *server)
+{
+    fm_event_t *event, *next;
+    fm_conn_t *conn;
+    fm_request_t *req;
+
+    pthread_mutex_lock(&server->mutex);
+    event = server->pending;
+    server->pending = server->pending_tail = NULL;
+    pthread_mutex_unlock(&server->mutex);
+
+    for (; event; event = next) {
+        next = event->next;
+        // counts as a reference until it has been handed to everyone
+        event->refs = 1;
+        for (conn = server->conns; conn; conn = conn->next) {
+            if (conn->idle && (conn->idle_mask & event->mask)) {
+                req = conn->idle;
+                conn->idle = NULL;
+            } else if ((conn->subscribed & event->mask) && conn->nevents < SERVER_MAX_EVENTS) {
+                req = conn_request(conn);
+            } else {
+                continue;
+            }
+            req->event = event;
+            req->framed = 0;
+            req->done = 1;
+            event->refs++;
+            conn->nevents++;
+        }
+        if (--event->refs == 0)
+            free(event);
+    }
+}
+
+void fm_server_notify(fm_server_t *server, unsigned mask, const char *info)
+{
+    uint64_t one = 1;
+    char changed[64];
+    int i, n = 0;
+    size_t size;
+    fm_event_t *event;
+
+    changed[0] = '\0';
+    for (i = 0; i < sizeof(event_names) / sizeof(event_names[0]); i++) {
+        if (mask & (1 << i))
+            n += sprintf(changed + n, "%s\"%s\"", n ? "," : "", event_names[i]);
+    }
+    size = strlen(info) + n + 32;
+    event = (fm_event_t *) malloc(sizeof(fm_event_t) + size);
+    event->mask = mask;
+    event->refs = 0;
+    event->next = NULL;
+    event->len = snprintf(event->data, size, "{\"changed\":[%s],\"info\":%s}\n", changed, info);
 
-    len = sizeof(addr);
-    getpeername(socket, (struct sockaddr*) &addr, &len);
+    pthread_mutex_lock(&server->mutex);
+    if (server->pending_tail)
+        server->pending_tail->next = event;
+    else
+        server->pending = event;
+    server->pending_tail = event;
+    pthread_mutex_unlock(&server->mutex);
+    write(server->wake_fd, &one, sizeof(one));
+}
 
-    if (addr.ss_family == AF_INET) {
-        struct sockaddr_in *s = (struct sockaddr_in *) &addr;
-        *port = ntohs(s->sin_port);
-        inet_ntop(AF_INET, &s->sin_addr, ipstr, iplen);
+void fm_server_reply(fm_server_t *server, fm_request_t *req)
+{
+    uint64_t one = 1;
+    observe_latency(req);
+    pthread_mutex_lock(&server->mutex);
+    if (req->conn == NULL) {
+        request_free(req);
+    } else {
+        req->done = 1;
     }
-    else {
-        struct sockaddr_in6 *s = (struct sockaddr_in6 *) &addr;
-        *port = ntohs(s->sin6_port);
-        inet_ntop(AF_INET6, &s->sin6_addr, ipstr, iplen);
+    pthread_mutex_unlock(&server->mutex);
+    write(server->wake_fd, &one, sizeof(one));
+}
+
+void fm_server_cleanup(fm_server_t *server)
+{
+    fm_event_t *event;
+    while ((event = server->pending)) {
+        server->pending = event->next;
+        free(event);
     }
+    close(server->wake_fd);
+    close(server->epoll_fd);
+    pthread_mutex_destroy(&server->mutex);
 }
 
 void fm_server_run(fm_server_t *server, server_handle handle, void *handle_data)
 {
-    int i;
-    int client = 0;
-    char input_buf[64];
-    char output_buf[1024];
-    int buf_size;
-    fd_set read_fds;
-    char ipstr[INET6_ADDRSTRLEN];
-    int port;
+    struct epoll_event events[32];
+    fm_conn_t *conn, *next;
+    uint64_t count;
+    long long now, deadline;
+    int i, n, timeout, woken;
 
     while (!server->should_quit) {
-        read_fds = server->fds;
-        if (select(server->fd_max + 1, &read_fds, NULL, NULL, NULL) < 0) {
+        // the unframed input waiting to be taken as a command decides how long to sleep
+        timeout = -1;
+        now = now_ms();
+        for (conn = server->conns; conn; conn = conn->next) {
+            if (conn->partial_at > 0) {
+                deadline = conn->partial_at + SERVER_LEGACY_DELAY - now;
+                if (deadline < 0)
+                    deadline = 0;
+                if (timeout < 0 || deadline < timeout)
+                    timeout = deadline;
+            }
+        }
+
+        n = epoll_wait(server->epoll_fd, events, sizeof(events) / sizeof(events[0]), timeout);
+        if (n < 0) {
             if (errno == EINTR) {
                 continue;
             }
             else {
-                perror("select");
-                return;
+                fm_log_error("Unable to wait for clients: %s", strerror(errno));
+                break;
             }
         }
 
-        if (FD_ISSET(server->listen_fd, &read_fds)) {
-            client = accept(server->listen_fd, NULL, NULL);
-            if (client < 0) {
-                perror("accept");
-            }
-            else {
-                getPeerInfo(client, ipstr, sizeof(ipstr), &port);
-                /*printf("Server has a new client from %s:%d\n", ipstr, port);*/
-                FD_SET(client, &server->fds);
-                if (client > server->fd_max) {
-                    server->fd_max = client;
+        woken = 0;
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == &server->listen_fd || events[i].data.ptr == &server->unix_fd) {
+                conn_accept(server, *(int *) events[i].data.ptr);
+            } else if (events[i].data.ptr == &server->wake_fd) {
+                read(server->wake_fd, &count, sizeof(count));
+                woken = 1;
+            } else {
+                conn = (fm_conn_t *) events[i].data.ptr;
+                if ((events[i].events & (EPOLLERR | EPOLLHUP)) && !(events[i].events & EPOLLIN)) {
+                    conn_close(server, conn);
+                    continue;
                 }
-            }
-            FD_CLR(server->listen_fd, &read_fds);
-        }
-
-        for (i = 0; i <= server->fd_max; i++) {
-            if (FD_ISSET(i, &read_fds)) {
-                memset(input_buf, 0, sizeof(input_buf));
-                buf_size = recv(i, input_buf, sizeof(input_buf), 0);
-                if (buf_size == 0) {
-                    getPeerInfo(client, ipstr, sizeof(ipstr), &port);
-                    /*printf("Server says goodbye to client from %s:%d\n", ipstr, port);*/
-                    close(i);
-                    FD_CLR(i, &server->fds);
-                }
-                else if (buf_size > 0) {
-                    trim(input_buf);
-                    getPeerInfo(client, ipstr, sizeof(ipstr), &port);
-                    /*printf("Server receives from client %s:%d => %s\n", ipstr, port, input_buf);*/
-                    memset(output_buf, 0, sizeof(output_buf));
-                    handle(handle_data, input_buf, output_buf);
-                    buf_size = strlen(output_buf);
-                    if (send_all(i, output_buf, buf_size) < 0) {
-                        perror("client write");
-                        close(i);
-                        FD_CLR(i, &server->fds);
-                    }
-                }
-                else if (errno != EINTR) {
-                    perror("client read");
-                    close(i);
-                    FD_CLR(i, &server->fds);
+                if ((events[i].events & EPOLLIN) && conn_read(conn) < 0) {
+                    conn_close(server, conn);
+                    continue;
                 }
+                if (conn_service(server, conn, handle, handle_data) < 0)
+                    conn_close(server, conn);
             }
         }
-    }
-    for (i = 0; i <= server->fd_max; i++) {
-        if (FD_ISSET(i, &server->fds)) {
-            close(i);
+
+        // the replies and events from other threads and the expired unframed input can concern any connection
+        if (woken)
+            dispatch_events(server);
+        if (woken || timeout >= 0) {
+            for (conn = server->conns; conn; conn = next) {
+                next = conn->next;
+                if (conn_service(server, conn, handle, handle_data) < 0)
+                    conn_close(server, conn);
+            }
         }
     }
+    while (server->conns) {
+        conn_close(server, server->conns);
+    }
+    if (server->listen_fd >= 0) {
+        close(server->listen_fd);
+    }
+    if (server->unix_fd >= 0) {
+        close(server->unix_fd);
+        unlink(server->socket_path);
+    }
 }
@@ -1,22 +1,133 @@
 #ifndef _FM_SERVER_H_
 #define _FM_SERVER_H_
 
-#include <sys/select.h>
+#include "json.h"
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+
+// the longest command accepted, including the newline
+#define SERVER_LINE_MAX 256
+// a client stops being read from while this many of its commands wait for their replies
+#define SERVER_MAX_PIPELINE 64
+// the number of replies written with a single writev
+#define SERVER_WRITE_BATCH 16
+// clients that have never sent a newline are taken to send one command per write, which counts as complete
+// once nothing more has arrived for this long (in milliseconds)
+#define SERVER_LEGACY_DELAY 20
+
+// the kinds of change clients can wait for with idle and subscribe
+#define SERVER_EVENT_PLAYER 1
+#define SERVER_EVENT_PLAYLIST 2
+#define SERVER_EVENT_OPTIONS 4
+#define SERVER_EVENT_ALL (SERVER_EVENT_PLAYER | SERVER_EVENT_PLAYLIST | SERVER_EVENT_OPTIONS)
+// the finished requests a connection keeps for reuse, buffers and all
+#define SERVER_SPARE_REQUESTS 4
+// a subscriber that does not read misses whatever comes beyond this many undelivered events
+#define SERVER_MAX_EVENTS 64
+
+struct fm_conn;
+
+// an encoded event shared by every client it goes to; only touched by the server thread once queued
+typedef struct fm_event {
+    unsigned mask;
+    int refs;
+    size_t len;
+    struct fm_event *next;
+    char data[];
+} fm_event_t;
+
+// a command from a client together with its reply
+typedef struct fm_request {
+    // NULL once the client has gone away
+    struct fm_conn *conn;
+    // whether the output is ready to be sent
+    int done;
+    // whether the reply is terminated by a newline
+    int framed;
+    // sent instead of the output if set
+    fm_event_t *event;
+    struct timespec received;
+    // the next request from the same client
+    struct fm_request *next;
+    // free for whoever runs the request
+    struct fm_request *job_next;
+    char input[SERVER_LINE_MAX];
+    fm_json_t output;
+} fm_request_t;
+
+typedef struct fm_conn {
+    int fd;
+    // what has been read but not parsed yet
+    char in[SERVER_LINE_MAX];
+    int in_len;
+    // the rest of an over-long line is being skipped
+    int discarding;
+    // whether a newline has ever been seen
+    int framed;
+    // when the unterminated input of a client without newlines started waiting
+    long long partial_at;
+    // the client has shut down its side; the connection goes away once the replies are out
+    int eof;
+    // nothing more is read either; set after answering an HTTP request
+    int closing;
+    // the HTTP request whose headers are still coming in
+    fm_request_t *http;
+    // the requests in the order they came in; the replies go out in the same order
+    fm_request_t *requests;
+    fm_request_t *requests_tail;
+    int nrequests;
+    fm_request_t *spare;
+    int nspare;
+    // how much of the first reply has been written already
+    size_t written;
+    // the last write could not take everything
+    int blocked;
+    // what the connection is registered with epoll for
+    unsigned events;
+    // the events pushed to the client as they happen
+    unsigned subscribed;
+    int nevents;
+    // a pending idle waits for the first of these events
+    fm_request_t *idle;
+    unsigned idle_mask;
+    struct fm_conn *prev;
+    struct fm_conn *next;
+} fm_conn_t;
 
 typedef struct {
     char addr[16];
+    // no TCP listener if empty
     char port[8];
+    // no Unix domain socket if empty
+    char socket_path[108];
 
     int listen_fd;
-    fd_set fds;
-    int fd_max;
+    int unix_fd;
+    int epoll_fd;
+    // replies handed back from other threads wake up the loop through this eventfd
+    int wake_fd;
+    fm_conn_t *conns;
+    // the events waiting to be handed out
+    fm_event_t *pending;
+    fm_event_t *pending_tail;
+    // guards the done and conn fields of the requests and the pending events
+    pthread_mutex_t mutex;
 
     int should_quit;
 } fm_server_t;
 
-typedef void (*server_handle)(void *ptr, char *input, char *output);
+// write the reply into req->output and return 0, or return 1 after handing req over to someone who calls fm_server_reply later
+typedef int (*server_handle)(void *ptr, fm_request_t *req);
 
 int fm_server_setup(fm_server_t *server);
 void fm_server_run(fm_server_t *server, server_handle handle, void *handle_data);
+// hand back a request whose output is ready; can be called from any thread
+void fm_server_reply(fm_server_t *server, fm_request_t *req);
+// tell the clients waiting for any of the kinds in mask what has changed; info is a JSON object
+// can be called from any thread
+void fm_server_notify(fm_server_t *server, unsigned mask, const char *info);
+// once nobody is going to reply any more
+void fm_server_cleanup(fm_server_t *server);
 
 #endif
@@ -0,0 +1,153 @@
+#include "taskpool.h"
+
+#include <stdlib.h>
+
+static void task_group_done(task_group_t *group)
+{
+    pthread_mutex_lock(&group->mutex);
+    if (--group->pending == 0)
+        pthread_cond_broadcast(&group->cond_done);
+    pthread_mutex_unlock(&group->mutex);
+}
+
+static void *task_pool_thread(void *data)
+{
+    task_pool_t *pool = (task_pool_t *) data;
+    task_t *task;
+
+    while (1) {
+        pthread_mutex_lock(&pool->mutex);
+        while (!pool->head && !pool->should_quit)
+            pthread_cond_wait(&pool->cond_task, &pool->mutex);
+        if (!pool->head) {
+            // only quit once the queue has been drained
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+        task = pool->head;
+        pool->head = task->next;
+        if (!pool->head)
+            pool->tail = NULL;
+        pool->length--;
+        pool->active++;
+        pthread_cond_signal(&pool->cond_space);
+        pthread_mutex_unlock(&pool->mutex);
+
+        task->fun(task->arg);
+        if (task->group)
+            task_group_done(task->group);
+        free(task);
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->active--;
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    return pool;
+}
+
+task_pool_t *task_pool_init(int nthreads, int capacity)
+{
+    int i;
+    task_pool_t *pool = (task_pool_t *) malloc(sizeof(task_pool_t));
+    pool->nthreads = nthreads;
+    pool->threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+    pool->head = pool->tail = NULL;
+    pool->length = 0;
+    pool->capacity = capacity;
+    pool->active = 0;
+    pool->should_quit = 0;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond_task, NULL);
+    pthread_cond_init(&pool->cond_space, NULL);
+    for (i = 0; i < nthreads; i++) {
+        pthread_create(&pool->threads[i], NULL, task_pool_thread, pool);
+    }
+    return pool;
+}
+
+void task_pool_free(task_pool_t *pool)
+{
+    int i;
+    pthread_mutex_lock(&pool->mutex);
+    pool->should_quit = 1;
+    pthread_cond_broadcast(&pool->cond_task);
+    pthread_mutex_unlock(&pool->mutex);
+    for (i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->cond_task);
+    pthread_cond_destroy(&pool->cond_space);
+    free(pool);
+}
+
+static int task_pool_queue(task_pool_t *pool, task_group_t *group, task_fun_t fun, void *arg, int block)
+{
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->capacity > 0 && pool->length >= pool->capacity) {
+        if (!block) {
+            pthread_mutex_unlock(&pool->mutex);
+            return -1;
+        }
+        pthread_cond_wait(&pool->cond_space, &pool->mutex);
+    }
+    task_t *task = (task_t *) malloc(sizeof(task_t));
+    task->fun = fun;
+    task->arg = arg;
+    task->group = group;
+    task->next = NULL;
+    if (group) {
+        pthread_mutex_lock(&group->mutex);
+        group->pending++;
+        pthread_mutex_unlock(&group->mutex);
+    }
+    if (pool->tail)
+        pool->tail->next = task;
+    else
+        pool->head = task;
+    pool->tail = task;
+    pool->length++;
+    pthread_cond_signal(&pool->cond_task);
+    pthread_mutex_unlock(&pool->mutex);
+    return 0;
+}
+
+int task_pool_submit(task_pool_t *pool, task_group_t *group, task_fun_t fun, void *arg)
+{
+    return task_pool_queue(pool, group, fun, arg, 1);
+}
+
+int task_pool_try_submit(task_pool_t *pool, task_group_t *group, task_fun_t fun, void *arg)
+{
+    return task_pool_queue(pool, group, fun, arg, 0);
+}
+
+void task_pool_stats(task_pool_t *pool, int *queued, int *active)
+{
+    pthread_mutex_lock(&pool->mutex);
+    *queued = pool->length;
+    *active = pool->active;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void task_group_init(task_group_t *group)
+{
+    group->pending = 0;
+    pthread_mutex_init(&group->mutex, NULL);
+    pthread_cond_init(&group->cond_done, NULL);
+}
+
+void task_group_wait(task_group_t *group)
+{
+    pthread_mutex_lock(&group->mutex);
+    while (group->pending > 0)
+        pthread_cond_wait(&group->cond_done, &group->mutex);
+    pthread_mutex_unlock(&group->mutex);
+}
+
+void task_group_destroy(task_group_t *group)
+{
+    pthread_mutex_destroy(&group->mutex);
+    pthread_cond_destroy(&group->cond_done);
+}
@@ -0,0 +1,53 @@
+#ifndef _FM_TASKPOOL_H_
+#define _FM_TASKPOOL_H_
+
+#include <pthread.h>
+
+typedef void (*task_fun_t)(void *arg);
+
+// a group lets the submitter wait for a batch of tasks (including the tasks they submit themselves)
+typedef struct {
+    int pending;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond_done;
+} task_group_t;
+
+typedef struct task {
+    task_fun_t fun;
+    void *arg;
+    task_group_t *group;
+    struct task *next;
+} task_t;
+
+typedef struct {
+    int nthreads;
+    pthread_t *threads;
+    // the fifo of queued tasks
+    task_t *head;
+    task_t *tail;
+    int length;
+    // the maximum number of queued tasks; 0 means unbounded
+    int capacity;
+    // the number of tasks being run right now
+    int active;
+    int should_quit;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond_task;
+    pthread_cond_t cond_space;
+} task_pool_t;
+
+task_pool_t *task_pool_init(int nthreads, int capacity);
+// finish all the queued tasks and join the threads
+void task_pool_free(task_pool_t *pool);
+// queue a task; blocks while the queue is full
+// group can be NULL if nobody needs to wait for the task
+int task_pool_submit(task_pool_t *pool, task_group_t *group, task_fun_t fun, void *arg);
+// same as above but return -1 instead of blocking when the queue is full
+int task_pool_try_submit(task_pool_t *pool, task_group_t *group, task_fun_t fun, void *arg);
+void task_pool_stats(task_pool_t *pool, int *queued, int *active);
+
+void task_group_init(task_group_t *group);
+void task_group_wait(task_group_t *group);
+void task_group_destroy(task_group_t *group);
+
+#endif
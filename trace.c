@@ -0,0 +1,152 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+static const char *step_names[tsSteps] = {
+    [tsRequested] = "requested",
+    [tsParsed] = "parsed",
+    [tsDownloadStart] = "download_start",
+    [tsFirstByte] = "first_byte",
+    [tsDownloaded] = "downloaded",
+    [tsPlay] = "play",
+    [tsProbed] = "probed",
+    [tsDeviceOpened] = "device_opened",
+    [tsFirstAudio] = "first_audio",
+    [tsDone] = "done",
+};
+
+static fm_trace_record_t ring[TRACE_RING_SIZE];
+static int ring_next = 0;
+static int ring_count = 0;
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int64_t fm_trace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void fm_trace_mark(fm_trace_t *trace, enum fm_trace_step step)
+{
+    if (__atomic_load_n(&trace->at[step], __ATOMIC_RELAXED) == 0)
+        __atomic_store_n(&trace->at[step], fm_trace_now(), __ATOMIC_RELAXED);
+}
+
+void fm_trace_set(fm_trace_t *trace, enum fm_trace_step step, int64_t at)
+{
+    __atomic_store_n(&trace->at[step], at, __ATOMIC_RELAXED);
+}
+
+void fm_trace_commit(const fm_trace_record_t *record)
+{
+    pthread_mutex_lock(&ring_mutex);
+    ring[ring_next] = *record;
+    ring_next = (ring_next + 1) % TRACE_RING_SIZE;
+    if (ring_count < TRACE_RING_SIZE)
+        ring_count++;
+    pthread_mutex_unlock(&ring_mutex);
+}
+
+static int64_t trace_start(const fm_trace_t *trace)
+{
+    int i;
+    for (i = 0; i < tsSteps; i++) {
+        if (trace->at[i])
+            return trace->at[i];
+    }
+    return 0;
+}
+
+static void write_steps(fm_json_t *out, const fm_trace_record_t *r)
+{
+    int64_t start = trace_start(&r->trace);
+    int i;
+    fm_json_object(out);
+    fm_json_kint(out, "sid", r->sid);
+    fm_json_kstr(out, "artist", r->artist);
+    fm_json_kstr(out, "title", r->title);
+    fm_json_key(out, "steps");
+    fm_json_object(out);
+    for (i = 0; i < tsSteps; i++) {
+        if (r->trace.at[i])
+            fm_json_kdouble(out, step_names[i], (r->trace.at[i] - start) / 1e6, 3);
+    }
+    fm_json_object_end(out);
+    fm_json_object_end(out);
+}
+
+// every step becomes an instant event, and the time since the step before it a complete event named after it
+// each song gets a row (tid) of its own
+static void write_chrome(fm_json_t *out, const fm_trace_record_t *r, int row)
+{
+    char name[300];
+    int64_t prev = 0;
+    int i;
+    snprintf(name, sizeof(name), "%s - %s", r->artist, r->title);
+    fm_json_object(out);
+    fm_json_kstr(out, "name", "thread_name");
+    fm_json_kstr(out, "ph", "M");
+    fm_json_kint(out, "pid", 1);
+    fm_json_kint(out, "tid", row);
+    fm_json_key(out, "args");
+    fm_json_object(out);
+    fm_json_kstr(out, "name", name);
+    fm_json_object_end(out);
+    fm_json_object_end(out);
+    for (i = 0; i < tsSteps; i++) {
+        if (!r->trace.at[i])
+            continue;
+        if (prev) {
+            fm_json_object(out);
+            fm_json_kstr(out, "name", step_names[i]);
+            fm_json_kstr(out, "ph", "X");
+            fm_json_kdouble(out, "ts", prev / 1e3, 3);
+            fm_json_kdouble(out, "dur", (r->trace.at[i] - prev) / 1e3, 3);
+            fm_json_kint(out, "pid", 1);
+            fm_json_kint(out, "tid", row);
+            fm_json_object_end(out);
+        }
+        fm_json_object(out);
+        fm_json_kstr(out, "name", step_names[i]);
+        fm_json_kstr(out, "ph", "i");
+        fm_json_kstr(out, "s", "t");
+        fm_json_kdouble(out, "ts", r->trace.at[i] / 1e3, 3);
+        fm_json_kint(out, "pid", 1);
+        fm_json_kint(out, "tid", row);
+        fm_json_object_end(out);
+        prev = r->trace.at[i];
+    }
+}
+
+void fm_trace_write(fm_json_t *out, const fm_trace_record_t *live, int chrome)
+{
+    int i, n = 0;
+    if (chrome) {
+        fm_json_object(out);
+        fm_json_kstr(out, "displayTimeUnit", "ms");
+        fm_json_key(out, "traceEvents");
+    }
+    fm_json_array(out);
+    pthread_mutex_lock(&ring_mutex);
+    for (i = 0; i < ring_count; i++, n++) {
+        const fm_trace_record_t *r = &ring[(ring_next - ring_count + i + TRACE_RING_SIZE) % TRACE_RING_SIZE];
+        if (chrome)
+            write_chrome(out, r, n + 1);
+        else
+            write_steps(out, r);
+    }
+    pthread_mutex_unlock(&ring_mutex);
+    if (live) {
+        if (chrome)
+            write_chrome(out, live, n + 1);
+        else
+            write_steps(out, live);
+    }
+    fm_json_array_end(out);
+    if (chrome)
+        fm_json_object_end(out);
+}
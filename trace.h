@@ -0,0 +1,54 @@
+#ifndef _FM_TRACE_H_
+#define _FM_TRACE_H_
+
+#include "json.h"
+#include <stdint.h>
+
+// the number of finished timelines kept around
+#define TRACE_RING_SIZE 32
+
+// the steps in the life of a song, in the order they normally happen
+enum fm_trace_step {
+    // the playlist request that brought the song in was sent
+    tsRequested,
+    // the response has been parsed
+    tsParsed,
+    // a downloader has been assigned
+    tsDownloadStart,
+    tsFirstByte,
+    tsDownloaded,
+    // the player has been handed the song
+    tsPlay,
+    // the format has been probed in open_song
+    tsProbed,
+    // the audio device is open
+    tsDeviceOpened,
+    tsFirstAudio,
+    // the song has left the playlist
+    tsDone,
+    tsSteps
+};
+
+// monotonic timestamps in nanoseconds; 0 for the steps that have not happened (yet)
+typedef struct {
+    int64_t at[tsSteps];
+} fm_trace_t;
+
+typedef struct {
+    fm_trace_t trace;
+    int sid;
+    char artist[128];
+    char title[128];
+} fm_trace_record_t;
+
+int64_t fm_trace_now();
+// record the step as happening now unless it has been already; can be called from any thread
+void fm_trace_mark(fm_trace_t *trace, enum fm_trace_step step);
+void fm_trace_set(fm_trace_t *trace, enum fm_trace_step step, int64_t at);
+// keep the timeline of a song that is gone, dropping the oldest one if the ring is full
+void fm_trace_commit(const fm_trace_record_t *record);
+// the kept timelines from the oldest on, followed by live if it is not NULL
+// either as a list of the steps per song (in milliseconds from the first step) or in the Chrome trace event format
+void fm_trace_write(fm_json_t *out, const fm_trace_record_t *live, int chrome);
+
+#endif
@@ -1,7 +1,18 @@
+#define _GNU_SOURCE
 #include "util.h"
+#include "logger.h"
 
 #include <ctype.h>
 #include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define LOG_MODULE lmApp
+
+#define FILE_MODE S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH
 
 char* trim(char *str)
 {
@@ -58,8 +69,46 @@ char *escapesh(char *buf, char *str)
     return escapech(buf, '\'', str);
 }
 
-char *escapejson(char *buf, char *str)
+int move_file(const char *src, const char *dest, const char *part)
 {
-    return escapech(buf, '"', str);
-}
+    ssize_t n;
+    int in, out, ret = 0;
 
+    if (rename(src, dest) == 0)
+        return 0;
+    if (errno != EXDEV) {
+        fm_log_error("Unable to move %s to %s: %s", src, dest, strerror(errno));
+        return -1;
+    }
+    if ((in = open(src, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    if ((out = open(part, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, FILE_MODE)) < 0) {
+        close(in);
+        return -1;
+    }
+    while ((n = copy_file_range(in, NULL, out, NULL, 1 << 20, 0)) > 0);
+    if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL)) {
+        // older kernels do not copy across file systems
+        char buf[65536];
+        lseek(in, 0, SEEK_SET);
+        lseek(out, 0, SEEK_SET);
+        while ((n = read(in, buf, sizeof(buf))) > 0) {
+            if (write(out, buf, n) != n) {
+                n = -1;
+                break;
+            }
+        }
+    }
+    if (n < 0) {
+        fm_log_error("Unable to copy %s to %s: %s", src, part, strerror(errno));
+        ret = -1;
+    }
+    close(in);
+    if (close(out) != 0 || (ret == 0 && rename(part, dest) != 0))
+        ret = -1;
+    if (ret == 0)
+        unlink(src);
+    else
+        unlink(part);
+    return ret;
+}
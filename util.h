@@ -4,6 +4,8 @@
 char* trim(char *str);
 char* split(char *str, char delimiter);
 char *escapesh(char *buf, char *str);
-char *escapejson(char *buf, char *str);
+// move a file; /tmp usually lives on another file system, in which case the data is copied within the kernel
+// into part (a temporary name next to dest) first
+int move_file(const char *src, const char *dest, const char *part);
 
 #endif
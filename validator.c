@@ -1,17 +1,48 @@
 #include "validator.h"
+#include "logger.h"
 #include <sys/stat.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define LOG_MODULE lmValidator
+
 #define FILESIZE_PASS_RATIO 0.9
+// the cache file is rewritten on open once it holds this many times more lines than live entries
+#define CACHE_COMPACT_RATIO 2
+
+typedef struct cache_entry {
+    char *path;
+    int64_t size;
+    int64_t mtime;
+    char digest[65];
+    struct cache_entry *next;
+} cache_entry_t;
 
-void sha256_hash_string (unsigned char hash[SHA256_DIGEST_LENGTH], char outputBuffer[65])
+// the cache is an append-only file of "<mtime> <size> <digest> <path>" lines; later lines win
+static struct {
+    char path[256];
+    // the directories whose files are cached
+    char roots[2][256];
+    FILE *file;
+    cache_entry_t **buckets;
+    unsigned nbuckets;
+    unsigned count;
+    pthread_mutex_t mutex;
+} cache = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static void hash_string(unsigned char *hash, unsigned int length, char outputBuffer[65])
 {
-    int i = 0;
+    unsigned int i = 0;
 
-    for(i = 0; i < SHA256_DIGEST_LENGTH; i++)
+    for(i = 0; i < length && i < 32; i++)
     {
         sprintf(outputBuffer + (i * 2), "%02x", hash[i]);
     }
 
-    outputBuffer[64] = 0;
+    outputBuffer[i * 2] = 0;
 }
 
 int calc_sha256 (char* path, char output[65])
@@ -19,43 +50,269 @@ int calc_sha256 (char* path, char output[65])
     FILE* file = fopen(path, "rb");
     if(!file) return -1;
 
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256_CTX sha256;
-    SHA256_Init(&sha256);
     const int bufSize = 32768;
     char* buffer = malloc(bufSize);
     int bytesRead = 0;
-    if(!buffer) return -1;
+    if(!buffer) {
+        fclose(file);
+        return -1;
+    }
+    digest_stream_t ds;
+    digest_stream_init(&ds);
     while((bytesRead = fread(buffer, 1, bufSize, file)))
     {
-        SHA256_Update(&sha256, buffer, bytesRead);
+        digest_stream_update(&ds, buffer, bytesRead);
     }
-    SHA256_Final(hash, &sha256);
-
-    sha256_hash_string(hash, output);
+    digest_stream_finish(&ds);
+    strcpy(output, ds.hex);
+    digest_stream_free(&ds);
     fclose(file);
     free(buffer);
-    return 0;
+    return output[0] ? 0 : -1;
 }      
 
+void digest_stream_init(digest_stream_t *ds)
+{
+    ds->ctx = EVP_MD_CTX_new();
+    digest_stream_reset(ds);
+}
+
+void digest_stream_reset(digest_stream_t *ds)
+{
+    ds->hex[0] = '\0';
+    if (ds->ctx && EVP_DigestInit_ex(ds->ctx, EVP_sha256(), NULL) != 1) {
+        EVP_MD_CTX_free(ds->ctx);
+        ds->ctx = NULL;
+    }
+}
+
+void digest_stream_update(digest_stream_t *ds, const void *data, size_t length)
+{
+    if (ds->ctx && EVP_DigestUpdate(ds->ctx, data, length) != 1) {
+        // a digest that missed some data is worthless
+        EVP_MD_CTX_free(ds->ctx);
+        ds->ctx = NULL;
+    }
+}
+
+void digest_stream_finish(digest_stream_t *ds)
+{
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int length;
+    if (ds->ctx && EVP_DigestFinal_ex(ds->ctx, hash, &length) == 1)
+        hash_string(hash, length, ds->hex);
+    else
+        ds->hex[0] = '\0';
+}
+
+void digest_stream_free(digest_stream_t *ds)
+{
+    if (ds->ctx)
+        EVP_MD_CTX_free(ds->ctx);
+    ds->ctx = NULL;
+}
+
+static unsigned cache_hash(const char *path)
+{
+    unsigned h = 5381;
+    while (*path)
+        h = h * 33 + (unsigned char) *path++;
+    return h;
+}
+
+static cache_entry_t **cache_find(const char *path)
+{
+    cache_entry_t **e = &cache.buckets[cache_hash(path) & (cache.nbuckets - 1)];
+    while (*e && strcmp((*e)->path, path) != 0)
+        e = &(*e)->next;
+    return e;
+}
+
+static void cache_grow()
+{
+    unsigned i, n = cache.nbuckets ? cache.nbuckets * 2 : 1024;
+    cache_entry_t **buckets = (cache_entry_t **) calloc(n, sizeof(cache_entry_t *));
+    cache_entry_t *e, *next;
+    for (i = 0; i < cache.nbuckets; i++) {
+        for (e = cache.buckets[i]; e; e = next) {
+            next = e->next;
+            e->next = buckets[cache_hash(e->path) & (n - 1)];
+            buckets[cache_hash(e->path) & (n - 1)] = e;
+        }
+    }
+    free(cache.buckets);
+    cache.buckets = buckets;
+    cache.nbuckets = n;
+}
+
+// expects the mutex to be held
+static void cache_put(const char *path, int64_t size, int64_t mtime, const char *digest)
+{
+    cache_entry_t **slot, *e;
+    if (cache.count >= cache.nbuckets)
+        cache_grow();
+    slot = cache_find(path);
+    if ((e = *slot) == NULL) {
+        e = (cache_entry_t *) malloc(sizeof(cache_entry_t));
+        e->path = strdup(path);
+        e->next = NULL;
+        *slot = e;
+        cache.count++;
+    }
+    e->size = size;
+    e->mtime = mtime;
+    strcpy(e->digest, digest);
+}
+
+static void cache_write_entry(FILE *f, cache_entry_t *e)
+{
+    fprintf(f, "%lld %lld %s %s\n", (long long) e->mtime, (long long) e->size, e->digest, e->path);
+}
+
+void validator_cache_open(const char *path)
+{
+    char line[512], digest[65];
+    long long mtime, size;
+    unsigned lines = 0, i;
+    int n;
+    FILE *f;
+
+    pthread_mutex_lock(&cache.mutex);
+    strncpy(cache.path, path, sizeof(cache.path) - 1);
+    cache_grow();
+    if ((f = fopen(path, "r"))) {
+        while (fgets(line, sizeof(line), f)) {
+            char *nl = strchr(line, '\n');
+            if (!nl)
+                continue;
+            *nl = '\0';
+            if (sscanf(line, "%lld %lld %64s %n", &mtime, &size, digest, &n) == 3 && strlen(digest) == 64 && line[n] != '\0')
+                cache_put(line + n, size, mtime, digest);
+            lines++;
+        }
+        fclose(f);
+    }
+    if (lines > cache.count * CACHE_COMPACT_RATIO) {
+        // drop the superseded lines and the files that are gone
+        char tmp_path[272];
+        struct stat st;
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+        if ((f = fopen(tmp_path, "w"))) {
+            for (i = 0; i < cache.nbuckets; i++) {
+                cache_entry_t *e;
+                for (e = cache.buckets[i]; e; e = e->next) {
+                    if (stat(e->path, &st) == 0)
+                        cache_write_entry(f, e);
+                }
+            }
+            if (fclose(f) == 0)
+                rename(tmp_path, path);
+            else
+                unlink(tmp_path);
+        }
+    }
+    if ((cache.file = fopen(path, "a")) == NULL)
+        fm_log_error("Unable to open the validation cache %s: %s", path, strerror(errno));
+    fm_log_info("Validation cache: %u files", cache.count);
+    pthread_mutex_unlock(&cache.mutex);
+}
+
+void validator_cache_close()
+{
+    unsigned i;
+    cache_entry_t *e, *next;
+    pthread_mutex_lock(&cache.mutex);
+    if (cache.file)
+        fclose(cache.file);
+    cache.file = NULL;
+    for (i = 0; i < cache.nbuckets; i++) {
+        for (e = cache.buckets[i]; e; e = next) {
+            next = e->next;
+            free(e->path);
+            free(e);
+        }
+    }
+    free(cache.buckets);
+    cache.buckets = NULL;
+    cache.nbuckets = cache.count = 0;
+    pthread_mutex_unlock(&cache.mutex);
+}
+
+void validator_cache_set_roots(const char *music_dir, const char *cache_dir)
+{
+    pthread_mutex_lock(&cache.mutex);
+    snprintf(cache.roots[0], sizeof(cache.roots[0]), "%s", music_dir ? music_dir : "");
+    snprintf(cache.roots[1], sizeof(cache.roots[1]), "%s", cache_dir ? cache_dir : "");
+    pthread_mutex_unlock(&cache.mutex);
+}
+
+// expects the mutex to be held
+static int cache_covers(const char *path)
+{
+    int i;
+    for (i = 0; i < sizeof(cache.roots) / sizeof(cache.roots[0]); i++) {
+        size_t len = strlen(cache.roots[i]);
+        if (len > 0 && strncmp(path, cache.roots[i], len) == 0 && path[len] == '/')
+            return 1;
+    }
+    return 0;
+}
+
+// the sha256 of the file, from the cache if it has not changed since it was last hashed
+static int file_sha256(char *filepath, struct stat *st, char output[65])
+{
+    int64_t mtime = (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    cache_entry_t *e;
+    int covered;
+
+    pthread_mutex_lock(&cache.mutex);
+    covered = cache_covers(filepath);
+    if (covered && cache.buckets && (e = *cache_find(filepath)) && e->size == st->st_size && e->mtime == mtime) {
+        strcpy(output, e->digest);
+        pthread_mutex_unlock(&cache.mutex);
+        return 0;
+    }
+    pthread_mutex_unlock(&cache.mutex);
+
+    if (calc_sha256(filepath, output) != 0)
+        return -1;
+    pthread_mutex_lock(&cache.mutex);
+    if (covered && cache.file) {
+        cache_put(filepath, st->st_size, mtime, output);
+        cache_write_entry(cache.file, *cache_find(filepath));
+        fflush(cache.file);
+    }
+    pthread_mutex_unlock(&cache.mutex);
+    return 0;
+}
+
 void validator_init(validator_t *validator)
 {
     validator->mode = vNone;
+    validator->digest[0] = '\0';
 }
 
 void validator_sha256_init(validator_t *validator, const char *sha256)
 {
-    printf("SHA256 validator initiated with SHA256 string: %s\n", sha256);
+    fm_log_debug("SHA256 validator initiated with SHA256 string: %s", sha256);
     strncpy(validator->data.sha256sum, sha256, 64);
     validator->data.sha256sum[64] = '\0';
     validator->mode = vSHA256;
+    validator->digest[0] = '\0';
 }
 
 void validator_filesize_init(validator_t *validator, int size)
 {
-    printf("FileSize validator initiated with filesize: %d\n", size);
+    fm_log_debug("FileSize validator initiated with filesize: %d", size);
     validator->data.filesize = size;
     validator->mode = vFileSize;
+    validator->digest[0] = '\0';
+}
+
+void validator_set_digest(validator_t *validator, const char *digest)
+{
+    strncpy(validator->digest, digest, 64);
+    validator->digest[64] = '\0';
 }
 
 int validate(validator_t *validator, char *filepath)
@@ -65,17 +322,19 @@ int validate(validator_t *validator, char *filepath)
         return 0;
     switch(validator->mode) {
         case vSHA256: {
+            // the digest from the download saves reading the whole file again
+            if (validator->digest[0] != '\0')
+                return strcmp(validator->digest, validator->data.sha256sum) == 0;
             char output[65];
-            return calc_sha256(filepath, output) == 0 && strcmp(output, validator->data.sha256sum) == 0;
+            return file_sha256(filepath, &sts, output) == 0 && strcmp(output, validator->data.sha256sum) == 0;
         }
         case vFileSize: 
-            printf("Attempting to validate path %s with recorded filesize %d vs actual filesize %d\n", filepath, validator->data.filesize, (int) sts.st_size);
+            fm_log_debug("Attempting to validate path %s with recorded filesize %d vs actual filesize %d", filepath, validator->data.filesize, (int) sts.st_size);
             float percent = (float) sts.st_size / validator->data.filesize;
-            printf("The current file size is of percentage %f of the required file size\n", percent);
+            fm_log_debug("The current file size is of percentage %f of the required file size", percent);
             return percent > FILESIZE_PASS_RATIO;
         default:
             // no validator means no need to validate -> always true
             return 1;
     }
 }
-
@@ -1,4 +1,7 @@
-#include <openssl/sha.h>
+#ifndef _FM_VALIDATOR_H_
+#define _FM_VALIDATOR_H_
+
+#include <openssl/evp.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,10 +18,38 @@ typedef struct {
         char sha256sum[65];
         int filesize;
     } data;
+    // the sha256 of the file as computed while it was downloaded; empty if unknown
+    char digest[65];
 } validator_t;
 
+// a sha256 computed over data as it streams by
+typedef struct {
+    EVP_MD_CTX *ctx;
+    // the hex digest once finished; empty until then
+    char hex[65];
+} digest_stream_t;
+
+void digest_stream_init(digest_stream_t *ds);
+// start over
+void digest_stream_reset(digest_stream_t *ds);
+void digest_stream_update(digest_stream_t *ds, const void *data, size_t length);
+void digest_stream_finish(digest_stream_t *ds);
+void digest_stream_free(digest_stream_t *ds);
+
 void validator_init(validator_t *validator);
 void validator_sha256_init(validator_t *validator, const char *sha256);
 void validator_filesize_init(validator_t *validator, int size);
+// the sha256 digests of files on disk are remembered across runs (keyed by path, size and mtime) so that an
+// unchanged file is never hashed twice; the cache is optional and only used once opened
+void validator_cache_open(const char *path);
+void validator_cache_close();
+// only the files below these directories are cached; the downloads in progress would only pile up dead entries
+// either can be NULL or empty; call it again whenever they change
+void validator_cache_set_roots(const char *music_dir, const char *cache_dir);
+
+// remember the digest computed while downloading the file; validate then needs no further disk read
+void validator_set_digest(validator_t *validator, const char *digest);
 // return 1 if the file is valid otherwise 0
 int validate(validator_t *validator, char *filepath);
+
+#endif